@@ -0,0 +1,305 @@
+/*
+  Host build of pa55ware. Teensy 3 core, EEPROM, clock and screen
+*/
+#include "Arduino.h"
+#include "EEPROM.h"
+#include "Time.h"
+#include "Teensy3_ST7735.h"
+#include "host.h"
+
+#include <ctype.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+const char * HOST_CARD = "card";
+const char * HOST_EEPROM = "eeprom.bin";
+bool HOST_VERBOSE = false;
+long HOST_CUT = 0;
+long HOST_READ_US = 0;
+long HOST_WRITE_US = 0;
+unsigned long HOST_BLOCKS_READ = 0;
+unsigned long HOST_BLOCKS_WRITTEN = 0;
+volatile sig_atomic_t HOST_REPORT = 0;
+volatile sig_atomic_t HOST_RESUME = 0;
+
+size_t Print::write(const uint8_t * buffer, size_t size) {
+  size_t count = 0;
+  while (size--) count += write(*buffer++);
+  return count;
+}
+
+size_t Print::print(const char * text) {
+  return write(text);
+}
+
+size_t Print::print(char value) {
+  return write((uint8_t)value);
+}
+
+size_t Print::print(int value) {
+  return print((long)value);
+}
+
+size_t Print::print(unsigned int value) {
+  return print((unsigned long)value);
+}
+
+size_t Print::print(long value) {
+  char text[24];
+  snprintf(text, sizeof(text), "%ld", value);
+  return write(text);
+}
+
+size_t Print::print(unsigned long value) {
+  char text[24];
+  snprintf(text, sizeof(text), "%lu", value);
+  return write(text);
+}
+
+size_t Print::println(void) {
+  return write("\r\n");
+}
+
+size_t Print::println(const char * text) {
+  return print(text) + println();
+}
+
+size_t Print::println(char value) {
+  return print(value) + println();
+}
+
+size_t Print::println(int value) {
+  return print(value) + println();
+}
+
+size_t Print::println(unsigned int value) {
+  return print(value) + println();
+}
+
+size_t Print::println(long value) {
+  return print(value) + println();
+}
+
+size_t Print::println(unsigned long value) {
+  return print(value) + println();
+}
+
+size_t Stream::readBytes(char * buffer, size_t length) {
+  size_t count = 0;
+  uint32_t start = millis();
+  while (count < length && millis() - start < _timeout) {
+    int value = read();
+    if (value < 0) continue;
+    buffer[count++] = value;
+  }
+  return count;
+}
+
+static uint64_t hostMicros(void) {
+  static uint64_t start = 0;
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  uint64_t time = (uint64_t)now.tv_sec * 1000000 + now.tv_usec;
+  if (!start) start = time;
+  //The sketch reads the clock all the time, it reports for the signal
+  if (HOST_REPORT) {
+    HOST_REPORT = 0;
+    fprintf(stderr, "pa55ware: %lu blocks read, %lu blocks written\n", HOST_BLOCKS_READ, HOST_BLOCKS_WRITTEN);
+  }
+  return time - start;
+}
+
+uint32_t millis(void) {
+  return hostMicros() / 1000;
+}
+
+uint32_t micros(void) {
+  return hostMicros();
+}
+
+void delay(uint32_t ms) {
+  usleep(ms * 1000);
+}
+
+void yield(void) {
+}
+
+//Pins of the buttons, as INPUTS in the sketch
+static const uint8_t BUTTON_PINS[4] = {16, 15, 17, 18};
+//Queued presses, with the time each button is held. A pause is a press
+// of PRESS_PAUSE
+#define PRESS_MAX 4096
+#define PRESS_PAUSE -1
+static int PRESS_BUTTON[PRESS_MAX];
+static uint32_t PRESS_TIME[PRESS_MAX];
+static int PRESS_COUNT = 0;
+static int PRESS_NEXT = 0;
+//Time the current press started, if it has been seen yet
+static uint32_t PRESS_START = 0;
+static bool PRESS_SEEN = false;
+
+void hostButtons(const char * script) {
+  PRESS_COUNT = 0;
+  PRESS_NEXT = 0;
+  PRESS_SEEN = false;
+  static char trace[PRESS_MAX * 8];
+  if (*script == '@') {
+    FILE * stream = fopen(script + 1, "r");
+    size_t length = stream ? fread(trace, 1, sizeof(trace) - 1, stream) : 0;
+    if (stream) fclose(stream);
+    else perror(script + 1);
+    trace[length] = '\0';
+    script = trace;
+  }
+  while (isspace(*script)) script++;
+  while (*script && PRESS_COUNT < PRESS_MAX) {
+    char * end;
+    int button = strtol(script, &end, 10);
+    uint32_t time = 50;
+    if (*script == 'p') {
+      button = PRESS_PAUSE;
+      end = (char *)script + 1;
+    } else if (*end == ':') {
+      time = strtoul(end + 1, &end, 10);
+    }
+    if (end == script || button < PRESS_PAUSE || button > 3) break;
+    PRESS_BUTTON[PRESS_COUNT] = button;
+    PRESS_TIME[PRESS_COUNT++] = time;
+    script = (*end == ',') ? end + 1 : end;
+    while (isspace(*script)) script++;
+  }
+}
+
+//The next queued button reads as pressed until its time has elapsed
+int touchRead(uint8_t pin) {
+  if (PRESS_NEXT < PRESS_COUNT && PRESS_BUTTON[PRESS_NEXT] == PRESS_PAUSE) {
+    //The block counts are reported once the presses before have been run
+    if (!PRESS_SEEN) {
+      PRESS_SEEN = true;
+      HOST_RESUME = 0;
+      fprintf(stderr, "pa55ware: paused\n");
+      HOST_REPORT = 1;
+    }
+    if (!HOST_RESUME) return 0;
+    PRESS_NEXT++;
+    PRESS_SEEN = false;
+  }
+  if (PRESS_NEXT == PRESS_COUNT || BUTTON_PINS[PRESS_BUTTON[PRESS_NEXT]] != pin) return 0;
+  if (!PRESS_SEEN) {
+    PRESS_SEEN = true;
+    PRESS_START = millis();
+  }
+  if (millis() - PRESS_START < PRESS_TIME[PRESS_NEXT]) return 1000;
+  PRESS_NEXT++;
+  PRESS_SEEN = false;
+  return 0;
+}
+
+usb_keyboard_class Keyboard;
+
+size_t usb_keyboard_class::write(uint8_t value) {
+  fputc(value, stdout);
+  fflush(stdout);
+  return 1;
+}
+
+
+EEPROMClass EEPROM;
+
+//The Teensy 3 EEPROM, erased to 0xFF
+static uint8_t EEPROM_DATA[2048];
+static bool EEPROM_LOADED = false;
+
+static void eepromSave(void) {
+  FILE * stream = fopen(HOST_EEPROM, "wb");
+  if (!stream) return;
+  fwrite(EEPROM_DATA, 1, sizeof(EEPROM_DATA), stream);
+  fclose(stream);
+}
+
+static void eepromLoad(void) {
+  if (EEPROM_LOADED) return;
+  EEPROM_LOADED = true;
+  memset(EEPROM_DATA, 0xFF, sizeof(EEPROM_DATA));
+  FILE * stream = fopen(HOST_EEPROM, "rb");
+  if (stream) {
+    if (fread(EEPROM_DATA, 1, sizeof(EEPROM_DATA), stream)) {}
+    fclose(stream);
+    return;
+  }
+  //A new EEPROM is set up as a provisioned device: no failed attempt in
+  // byte 0, and a random 256 bit AES key in bytes 1 to 32
+  EEPROM_DATA[0] = 0;
+  stream = fopen("/dev/urandom", "rb");
+  if (stream) {
+    if (fread(EEPROM_DATA + 1, 1, 32, stream)) {}
+    fclose(stream);
+  }
+  eepromSave();
+}
+
+uint8_t EEPROMClass::read(int address) {
+  eepromLoad();
+  return (address >= 0 && address < (int)sizeof(EEPROM_DATA)) ? EEPROM_DATA[address] : 0xFF;
+}
+
+void EEPROMClass::write(int address, uint8_t value) {
+  eepromLoad();
+  if (address < 0 || address >= (int)sizeof(EEPROM_DATA)) return;
+  EEPROM_DATA[address] = value;
+  eepromSave();
+}
+
+Teensy3ClockClass Teensy3Clock;
+
+//Offset of the device clock from the host clock
+static time_t CLOCK_OFFSET = 0;
+
+time_t now(void) {
+  return time(NULL) + CLOCK_OFFSET;
+}
+
+void setTime(time_t t) {
+  CLOCK_OFFSET = t - time(NULL);
+}
+
+void setSyncProvider(getExternalTime) {
+}
+
+unsigned long Teensy3ClockClass::get(void) {
+  return now();
+}
+
+void Teensy3ClockClass::set(unsigned long t) {
+  setTime(t);
+}
+
+Teensy3_ST7735::Teensy3_ST7735(uint8_t, uint8_t, uint8_t) {
+}
+
+void Teensy3_ST7735::initR(uint8_t) {
+}
+
+void Teensy3_ST7735::setRotation(uint8_t) {
+}
+
+void Teensy3_ST7735::setCursor(int16_t, int16_t) {
+}
+
+void Teensy3_ST7735::fillScreen(uint16_t) {
+  if (HOST_VERBOSE) fputs("\n----\n", stderr);
+}
+
+void Teensy3_ST7735::setTextColor(uint16_t) {
+}
+
+void Teensy3_ST7735::setTextColor(uint16_t, uint16_t) {
+}
+
+void Teensy3_ST7735::setTextSize(uint8_t) {
+}
+
+size_t Teensy3_ST7735::write(uint8_t value) {
+  if (HOST_VERBOSE) fputc(value, stderr);
+  return 1;
+}
@@ -0,0 +1,121 @@
+#!/usr/bin/env python3
+"""
+Host receiver of the export of pa55ware (command 10). Saves the export
+stream of the vault, the records as stored on the card, encrypted, and
+resumes an interrupted export from the offset of the first chunk missing.
+
+Each chunk carries its offset, its length and a CRC-16 of both and of its
+data. The stream ends with an empty chunk, whose offset is the length of
+the stream. The chunks received are appended to FILE.part, which is
+renamed FILE once the stream is whole, so that running the receiver again
+after an interruption resumes the export.
+
+Usage: backup.py PORT FILE [-t tries]
+  -t tries - Exports started before giving up, 5 by default
+"""
+import argparse
+import os
+import struct
+import sys
+import termios
+import time
+
+from load import Port, exchange, crc16, FRAME_HELLO, FRAME_MORE, FRAME_NAK
+
+COMMAND_EXPORT = 10
+
+
+class Backup:
+    """The export stream received so far, in a file"""
+
+    def __init__(self, path):
+        self.path = path
+        self.part = path + '.part'
+        self.stream = open(self.part, 'ab')
+        self.length = self.stream.tell()
+        self.received = 0
+
+    def store(self, offset, chunk):
+        """Appends a chunk, only the part past the stream received so far"""
+        if offset > self.length:
+            raise IOError('chunk at %d, the stream stops at %d' % (offset, self.length))
+        chunk = chunk[self.length - offset:]
+        self.stream.write(chunk)
+        self.stream.flush()
+        self.length += len(chunk)
+        self.received += len(chunk)
+
+    def finish(self, length):
+        self.stream.close()
+        if length != self.length:
+            raise IOError('the stream is %d bytes, %d received' % (length, self.length))
+        os.rename(self.part, self.path)
+
+
+def receive(port, sequence, backup):
+    """
+    Runs an export from the end of the backup. Returns the length of the
+    stream, or None if the device ended it early
+    """
+    port.send(sequence, COMMAND_EXPORT, struct.pack('<I', backup.length))
+    data = b''
+    started = False
+    length = None
+    while True:
+        _, kind, payload = port.receive()
+        if kind == FRAME_NAK:
+            raise IOError('frame refused by the device')
+        data += payload
+        if not started and data:
+            if data[0] != 1:
+                raise IOError('export refused')
+            data = data[1:]
+            started = True
+        while len(data) >= 6:
+            offset, size = struct.unpack('<IH', data[:6])
+            if len(data) < 8 + size:
+                break
+            chunk = data[6:6 + size]
+            if struct.unpack('<H', data[6 + size:8 + size])[0] != crc16(data[:6] + chunk):
+                raise IOError('bad chunk at %d' % offset)
+            data = data[8 + size:]
+            if size == 0:
+                length = offset
+            else:
+                backup.store(offset, chunk)
+        if kind != FRAME_MORE:
+            return length
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('port')
+    parser.add_argument('file')
+    parser.add_argument('-t', type=int, default=5)
+    options = parser.parse_args()
+
+    port = Port(options.port)
+    backup = Backup(options.file)
+    if backup.length:
+        print('resuming at %d bytes' % backup.length)
+    exchange(port, 0, FRAME_HELLO)
+    for sequence in range(1, options.t + 1):
+        try:
+            length = receive(port, sequence, backup)
+        except (IOError, TimeoutError) as error:
+            print('export interrupted at %d bytes: %s' % (backup.length, error))
+            #The rest of the reply is dropped
+            time.sleep(1)
+            termios.tcflush(port.fd, termios.TCIFLUSH)
+            port.buffer = b''
+            continue
+        if length is not None:
+            backup.finish(length)
+            print('%d bytes saved in %s' % (length, options.file))
+            return 0
+        print('export ended at %d bytes' % backup.length)
+    return 1
+
+
+if __name__ == '__main__':
+    sys.exit(main())
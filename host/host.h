@@ -0,0 +1,34 @@
+/*
+  Host build of pa55ware. Settings of the mocks, set by the runner
+*/
+#ifndef host_h
+#define host_h
+
+#include <signal.h>
+
+//Folder holding the contents of the card
+extern const char * HOST_CARD;
+//File holding the EEPROM
+extern const char * HOST_EEPROM;
+//true to copy the screen text to stderr
+extern bool HOST_VERBOSE;
+//Number of card writes before the power is cut, 0 to never cut it
+extern long HOST_CUT;
+//Time in us the card takes to read and to write a block, see sd.cpp
+extern long HOST_READ_US;
+extern long HOST_WRITE_US;
+//Number of card blocks read and written, see sd.cpp
+extern unsigned long HOST_BLOCKS_READ;
+extern unsigned long HOST_BLOCKS_WRITTEN;
+//Set by SIGUSR1, the block counts are then written to stderr
+extern volatile sig_atomic_t HOST_REPORT;
+//Set by SIGUSR2, ends a pause of the button presses
+extern volatile sig_atomic_t HOST_RESUME;
+
+//Queues the button presses, "button[:ms],..." with the button numbers of
+// the sketch and the time each is held, 50 ms by default. "p" pauses the
+// presses until SIGUSR2. "@file" reads them from a file, a browse trace,
+// where they can also be separated by white space
+void hostButtons(const char * script);
+
+#endif
@@ -0,0 +1,283 @@
+#!/usr/bin/env python3
+"""
+Load generator for the framed command protocol of pa55ware. Works with
+the device or with the host build, through its serial port.
+
+Keeps a window of frames in flight, then prints the host side latency
+along with the metrics kept by the device (command 14).
+
+Usage: load.py PORT [-n count] [-s size] [-c] [-w window] [-r] [-p]
+  -n count - Number of commands, 1000 by default
+  -s size - Payload size of the ping commands, 64 bytes by default
+  -c - Creates records in /LOAD instead of sending pings
+  -w window - Frames in flight, up to the window of the device
+  -r - The frames go in raw HID reports, as with the HID host build
+  -p - Compressed frames, if the device accepts them
+"""
+import argparse
+import os
+import select
+import struct
+import sys
+import termios
+import time
+import tty
+
+FRAME_SOF = 0xA5
+FRAME_HELLO = 0
+FRAME_REPLY = 0x80
+FRAME_MORE = 0xFE
+FRAME_NAK = 0xFF
+FRAME_PACKED = 0x80
+
+#Option of the hello frame, compressed frames
+HELLO_PACK = 0x01
+PACK_WINDOW = 256
+PACK_MATCH_MIN = 3
+PACK_MATCH_MAX = PACK_MATCH_MIN + 255
+
+#Size of a raw HID report
+REPORT_SIZE = 64
+
+COMMAND_CREATE = 1
+COMMAND_MKDIR = 2
+COMMAND_PING = 13
+COMMAND_METRICS = 14
+
+
+def crc16(data):
+    crc = 0xFFFF
+    for value in data:
+        crc ^= value << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else crc << 1
+            crc &= 0xFFFF
+    return crc
+
+
+def pack(data):
+    """Compresses a frame payload, as packEncode() of the sketch"""
+    packed = bytearray()
+    flags = 0
+    item = 8
+    position = 0
+    while position < len(data):
+        if item == 8:
+            flags = len(packed)
+            packed.append(0)
+            item = 0
+        best = 0
+        distance = 0
+        for back in range(1, min(position, PACK_WINDOW) + 1):
+            match = 0
+            while (match < PACK_MATCH_MAX and position + match < len(data) and
+                   data[position + match] == data[position - back + match]):
+                match += 1
+            if match > best:
+                best = match
+                distance = back
+        if best >= PACK_MATCH_MIN:
+            packed += bytes([distance - 1, best - PACK_MATCH_MIN])
+            position += best
+        else:
+            packed[flags] |= 1 << item
+            packed.append(data[position])
+            position += 1
+        item += 1
+    return bytes(packed)
+
+
+def unpack(packed):
+    """Uncompresses a frame payload, as packDecode() of the sketch"""
+    data = bytearray()
+    position = 0
+    while position < len(packed):
+        flags = packed[position]
+        position += 1
+        for item in range(8):
+            if position >= len(packed):
+                break
+            if flags & (1 << item):
+                data.append(packed[position])
+                position += 1
+                continue
+            if position + 2 > len(packed):
+                raise IOError('bad compressed payload')
+            distance = packed[position] + 1
+            match = packed[position + 1] + PACK_MATCH_MIN
+            position += 2
+            if distance > len(data):
+                raise IOError('bad compressed payload')
+            for _ in range(match):
+                data.append(data[-distance])
+    return bytes(data)
+
+
+class Port:
+    def __init__(self, path, timeout=5):
+        self.fd = os.open(path, os.O_RDWR | os.O_NOCTTY)
+        tty.setraw(self.fd)
+        termios.tcflush(self.fd, termios.TCIOFLUSH)
+        self.buffer = b''
+        self.timeout = timeout
+        #True in a session with HELLO_PACK, the frames are then sent
+        # compressed when this makes them shorter
+        self.packed = False
+
+    def write(self, data):
+        while data:
+            data = data[os.write(self.fd, data):]
+
+    def read(self, length, timeout=None):
+        end = time.time() + (self.timeout if timeout is None else timeout)
+        while len(self.buffer) < length:
+            ready, _, _ = select.select([self.fd], [], [], max(0, end - time.time()))
+            if not ready:
+                raise TimeoutError('no reply from the device')
+            data = os.read(self.fd, 4096)
+            if not data:
+                raise IOError('the port was closed')
+            self.buffer += data
+        data, self.buffer = self.buffer[:length], self.buffer[length:]
+        return data
+
+    def send(self, sequence, command, payload=b''):
+        flag = 0
+        if self.packed and payload:
+            packed = pack(payload)
+            if len(packed) < len(payload):
+                payload = packed
+                flag = FRAME_PACKED
+        header = bytes([sequence, command, len(payload) & 0xFF, (len(payload) >> 8) | flag])
+        body = header + payload
+        self.write(bytes([FRAME_SOF]) + body + struct.pack('<H', crc16(body)))
+
+    def receive(self):
+        """Returns the sequence, command and payload of the next frame"""
+        while self.read(1)[0] != FRAME_SOF:
+            pass
+        header = self.read(4)
+        length = header[2] | ((header[3] & ~FRAME_PACKED) << 8)
+        payload = self.read(length)
+        crc, = struct.unpack('<H', self.read(2))
+        if crc != crc16(header + payload):
+            raise IOError('bad frame checksum')
+        if header[3] & FRAME_PACKED:
+            payload = unpack(payload)
+        return header[0], header[1], payload
+
+
+class ReportPort(Port):
+    """
+    Port carrying raw HID reports, whose first byte gives the length of
+    the data that follows, as the HID host build does on its pseudo
+    terminal
+    """
+
+    def __init__(self, path, timeout=5):
+        Port.__init__(self, path, timeout)
+        self.data = b''
+
+    def write(self, data):
+        for start in range(0, len(data), REPORT_SIZE - 1):
+            piece = data[start:start + REPORT_SIZE - 1]
+            Port.write(self, (bytes([len(piece)]) + piece).ljust(REPORT_SIZE, b'\x00'))
+
+    def read(self, length, timeout=None):
+        while len(self.data) < length:
+            report = Port.read(self, REPORT_SIZE, timeout)
+            self.data += report[1:1 + min(report[0], REPORT_SIZE - 1)]
+        data, self.data = self.data[:length], self.data[length:]
+        return data
+
+
+def exchange(port, sequence, command, payload=b''):
+    """Sends a frame and returns the payload of its reply, MORE included"""
+    port.send(sequence, command, payload)
+    reply = b''
+    while True:
+        _, kind, data = port.receive()
+        if kind == FRAME_NAK:
+            raise IOError('frame refused by the device')
+        reply += data
+        if kind != FRAME_MORE:
+            return reply
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('port')
+    parser.add_argument('-n', type=int, default=1000)
+    parser.add_argument('-s', type=int, default=64)
+    parser.add_argument('-c', action='store_true')
+    parser.add_argument('-w', type=int, default=8)
+    parser.add_argument('-r', action='store_true')
+    parser.add_argument('-p', action='store_true')
+    options = parser.parse_args()
+
+    port = (ReportPort if options.r else Port)(options.port)
+    hello = exchange(port, 0, FRAME_HELLO, bytes([HELLO_PACK]) if options.p else b'')
+    window = min(options.w, hello[1])
+    maximum = hello[2] | (hello[3] << 8)
+    port.packed = len(hello) > 4 and bool(hello[4] & HELLO_PACK)
+    print('protocol %d, window %d, frames up to %d bytes%s' % (
+        hello[0], hello[1], maximum, ', compressed' if port.packed else ''))
+
+    sequence = 1
+    exchange(port, sequence, COMMAND_METRICS, b'\x01')
+    sequence += 1
+    if options.c:
+        exchange(port, sequence, COMMAND_MKDIR, b'/LOAD\x00')
+        sequence += 1
+
+    def payload(index):
+        if not options.c:
+            return bytes((index + i) & 0xFF for i in range(min(options.s, maximum)))
+        path = ('/LOAD/R%05d' % index).encode()
+        data = b'load %d' % index
+        #Password record, with the login in section 0
+        return bytes([len(path)]) + path + bytes([1, 0, len(data)]) + data
+
+    command = COMMAND_CREATE if options.c else COMMAND_PING
+    sent = {}
+    latencies = []
+    errors = 0
+    next_index = 0
+    start = time.time()
+    while next_index < options.n or sent:
+        while next_index < options.n and len(sent) < window:
+            number = sequence & 0xFF
+            port.send(number, command, payload(next_index))
+            sent[number] = time.time()
+            sequence += 1
+            next_index += 1
+        number, kind, _ = port.receive()
+        if kind == FRAME_MORE:
+            continue
+        if kind == FRAME_NAK or kind != (command | FRAME_REPLY):
+            errors += 1
+        if number in sent:
+            latencies.append(time.time() - sent.pop(number))
+    elapsed = time.time() - start
+
+    metrics = exchange(port, sequence & 0xFF, COMMAND_METRICS, b'\x00').decode(errors='replace')
+    latencies.sort()
+    print('%d commands in %.2f s, %.0f commands/s, %d errors' % (len(latencies), elapsed, len(latencies) / elapsed, errors))
+    if latencies:
+        print('host latency ms: median %.2f, 99th %.2f, max %.2f' % (
+            latencies[len(latencies) // 2] * 1000,
+            latencies[int(len(latencies) * 0.99)] * 1000,
+            latencies[-1] * 1000))
+    lines = metrics.split()
+    if len(lines) >= 4:
+        device = int(lines[0]) / 1000.0 or 1
+        print('device: %s commands, %.0f bytes/s in, %.0f bytes/s out' % (
+            lines[1], int(lines[2]) / device, int(lines[3]) / device))
+        for bucket, count in enumerate(lines[4:]):
+            if int(count):
+                print('  < %6d us  %s' % (2 << (bucket + 6), count))
+    return 1 if errors else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
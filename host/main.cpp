@@ -0,0 +1,188 @@
+/*
+  Host build of pa55ware. Runs the sketch with its serial port on a
+  pseudo terminal, so that the host tools and the load generator talk to
+  it as they do to the device. The HID build, with RAWHID_INTERFACE
+  defined, carries the 64 bytes raw HID reports on the pseudo terminal
+  instead
+
+  Usage: pa55ware [-c card] [-e eeprom] [-b buttons] [-l link] [-k writes]
+                  [-t write_us[,read_us]] [-v]
+    -c card - Folder holding the contents of the card, "card" by default
+    -e eeprom - File holding the EEPROM, "eeprom.bin" by default
+    -b buttons - Button presses, "button[:ms],...", or "@file" to replay
+                 a browse trace. "p" pauses them until SIGUSR2. By
+                 default the back button is held at boot to start in
+                 command mode, then the unlock sequence of the sketch
+                 is typed
+    -l link - Symbolic link created to the pseudo terminal
+    -k writes - Cuts the power at this card write, see sd.cpp
+    -t write_us[,read_us] - Time a card block write and read take
+    -v - Copies the screen text to stderr
+
+  SIGUSR1 writes the number of card blocks read and written to stderr
+*/
+#include "Arduino.h"
+#include "host.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+void setup(void);
+void loop(void);
+
+//Master side of the pseudo terminal
+static int SERIAL_FD = -1;
+//Byte read ahead by peek(), -1 if none
+static int SERIAL_PEEK = -1;
+
+usb_serial_class Serial;
+
+void usb_serial_class::begin(long) {
+}
+
+void usb_serial_class::end(void) {
+}
+
+usb_serial_class::operator bool() {
+  return SERIAL_FD >= 0;
+}
+
+int usb_serial_class::available(void) {
+  if (SERIAL_PEEK >= 0) return 1;
+  struct pollfd poll_fd = {SERIAL_FD, POLLIN, 0};
+  return (poll(&poll_fd, 1, 0) == 1 && (poll_fd.revents & POLLIN)) ? 1 : 0;
+}
+
+int usb_serial_class::read(void) {
+  int value = peek();
+  SERIAL_PEEK = -1;
+  return value;
+}
+
+int usb_serial_class::peek(void) {
+  if (SERIAL_PEEK < 0) {
+    uint8_t value;
+    if (available() && ::read(SERIAL_FD, &value, 1) == 1) SERIAL_PEEK = value;
+  }
+  return SERIAL_PEEK;
+}
+
+void usb_serial_class::flush(void) {
+}
+
+void usb_serial_class::send_now(void) {
+}
+
+int usb_serial_class::availableForWrite(void) {
+  struct pollfd poll_fd = {SERIAL_FD, POLLOUT, 0};
+  return (poll(&poll_fd, 1, 0) == 1 && (poll_fd.revents & POLLOUT)) ? 64 : 0;
+}
+
+size_t usb_serial_class::write(uint8_t value) {
+  return write(&value, 1);
+}
+
+//As on the device, data is dropped when the host does not read it
+size_t usb_serial_class::write(const uint8_t * buffer, size_t size) {
+  size_t written = 0;
+  while (written < size) {
+    struct pollfd poll_fd = {SERIAL_FD, POLLOUT, 0};
+    if (poll(&poll_fd, 1, 100) != 1) break;
+    ssize_t count = ::write(SERIAL_FD, buffer + written, size - written);
+    if (count < 0 && errno != EAGAIN) break;
+    if (count > 0) written += count;
+  }
+  return written;
+}
+
+//Report being received, and its length so far
+static uint8_t REPORT[64];
+static int REPORT_LENGTH = 0;
+
+usb_rawhid_class RawHID;
+
+int usb_rawhid_class::available(void) {
+  return (REPORT_LENGTH == 64 || Serial.available()) ? 64 : 0;
+}
+
+int usb_rawhid_class::recv(void * buffer, uint16_t) {
+  while (REPORT_LENGTH < 64 && Serial.available()) REPORT[REPORT_LENGTH++] = Serial.read();
+  if (REPORT_LENGTH < 64) return 0;
+  memcpy(buffer, REPORT, 64);
+  REPORT_LENGTH = 0;
+  return 64;
+}
+
+//A report is sent whole, or not at all when the host does not read
+int usb_rawhid_class::send(const void * buffer, uint16_t) {
+  struct pollfd poll_fd = {SERIAL_FD, POLLOUT, 0};
+  if (poll(&poll_fd, 1, 100) != 1) return 0;
+  return (Serial.write((const uint8_t *)buffer, 64) == 64) ? 64 : 0;
+}
+
+//The block counts are written by the next clock read, see arduino.cpp
+static void hostReport(int) {
+  HOST_REPORT = 1;
+}
+
+static void hostResume(int) {
+  HOST_RESUME = 1;
+}
+
+int main(int argc, char ** argv) {
+  const char * link = NULL;
+  //PASS_LENGTH presses of button 0 unlock the sketch as shipped
+  const char * buttons = "2:1500,0";
+  int option;
+  while ((option = getopt(argc, argv, "c:e:b:l:k:t:v")) != -1) {
+    switch (option) {
+      case 'c': HOST_CARD = optarg; break;
+      case 'e': HOST_EEPROM = optarg; break;
+      case 'b': buttons = optarg; break;
+      case 'l': link = optarg; break;
+      case 'k': HOST_CUT = atol(optarg); break;
+      case 't': {
+        char * end;
+        HOST_WRITE_US = strtol(optarg, &end, 10);
+        if (*end == ',') HOST_READ_US = strtol(end + 1, NULL, 10);
+        break;
+      }
+      case 'v': HOST_VERBOSE = true; break;
+      default:
+        fprintf(stderr, "usage: %s [-c card] [-e eeprom] [-b buttons] [-l link] [-k writes] [-t write_us[,read_us]] [-v]\n", argv[0]);
+        return 2;
+    }
+  }
+  
+  SERIAL_FD = posix_openpt(O_RDWR | O_NOCTTY);
+  if (SERIAL_FD < 0 || grantpt(SERIAL_FD) || unlockpt(SERIAL_FD)) {
+    perror("posix_openpt");
+    return 1;
+  }
+  fcntl(SERIAL_FD, F_SETFL, fcntl(SERIAL_FD, F_GETFL) | O_NONBLOCK);
+  const char * port = ptsname(SERIAL_FD);
+  //The other side is kept open in raw mode, so that the port keeps its
+  // settings and does not hang up between two host tools
+  int slave = open(port, O_RDWR | O_NOCTTY);
+  struct termios settings;
+  if (slave < 0 || tcgetattr(slave, &settings)) {
+    perror(port);
+    return 1;
+  }
+  cfmakeraw(&settings);
+  tcsetattr(slave, TCSANOW, &settings);
+  if (link) {
+    unlink(link);
+    if (symlink(port, link)) perror(link);
+  }
+  fprintf(stderr, "pa55ware: serial port %s\n", link ? link : port);
+  
+  signal(SIGUSR1, hostReport);
+  signal(SIGUSR2, hostResume);
+  hostButtons(buttons);
+  setup();
+  while (true) loop();
+}
@@ -0,0 +1,96 @@
+/*
+  Host build of pa55ware. Declares the part of the Teensy 3 core the
+  sketch and its libraries use. Only the C library is included, so that
+  the sketch is compiled as it is on the device
+*/
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <time.h>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+//As in the core, each argument is evaluated once
+#define min(a, b) ({ __typeof__(a) _a = (a); __typeof__(b) _b = (b); _a < _b ? _a : _b; })
+#define max(a, b) ({ __typeof__(a) _a = (a); __typeof__(b) _b = (b); _a > _b ? _a : _b; })
+
+uint32_t millis(void);
+uint32_t micros(void);
+void delay(uint32_t ms);
+void yield(void);
+int touchRead(uint8_t pin);
+
+class Print {
+  public:
+    virtual size_t write(uint8_t value) = 0;
+    virtual size_t write(const uint8_t * buffer, size_t size);
+    size_t write(const char * text) { return write((const uint8_t *)text, strlen(text)); }
+    size_t print(const char * text);
+    size_t print(char value);
+    size_t print(int value);
+    size_t print(unsigned int value);
+    size_t print(long value);
+    size_t print(unsigned long value);
+    size_t println(void);
+    size_t println(const char * text);
+    size_t println(char value);
+    size_t println(int value);
+    size_t println(unsigned int value);
+    size_t println(long value);
+    size_t println(unsigned long value);
+};
+
+class Stream : public Print {
+  public:
+    virtual int available(void) = 0;
+    virtual int read(void) = 0;
+    virtual int peek(void) = 0;
+    virtual void flush(void) = 0;
+    void setTimeout(unsigned long timeout) { _timeout = timeout; }
+    size_t readBytes(char * buffer, size_t length);
+  protected:
+    unsigned long _timeout = 1000;
+};
+
+//The serial port of the device, a pseudo terminal in the host build
+class usb_serial_class : public Stream {
+  public:
+    void begin(long speed);
+    void end(void);
+    operator bool();
+    int available(void);
+    int read(void);
+    int peek(void);
+    void flush(void);
+    void send_now(void);
+    int availableForWrite(void);
+    size_t write(uint8_t value);
+    size_t write(const uint8_t * buffer, size_t size);
+    using Print::write;
+};
+extern usb_serial_class Serial;
+
+//The keyboard the device types the passwords with, written to stdout
+class usb_keyboard_class : public Print {
+  public:
+    size_t write(uint8_t value);
+    using Print::write;
+};
+extern usb_keyboard_class Keyboard;
+
+class usb_rawhid_class {
+  public:
+    int available(void);
+    int recv(void * buffer, uint16_t timeout);
+    int send(const void * buffer, uint16_t timeout);
+};
+extern usb_rawhid_class RawHID;
+
+#endif
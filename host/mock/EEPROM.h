@@ -0,0 +1,16 @@
+/*
+  Host build of pa55ware. The EEPROM is kept in a file, see host.h
+*/
+#ifndef EEPROM_h
+#define EEPROM_h
+
+#include "Arduino.h"
+
+class EEPROMClass {
+  public:
+    uint8_t read(int address);
+    void write(int address, uint8_t value);
+};
+extern EEPROMClass EEPROM;
+
+#endif
@@ -0,0 +1,100 @@
+/*
+  Host build of pa55ware. The card is a folder of the host, see host.h.
+  Names are folded to upper case as on the FAT card, and a directory is
+  read as 32 bytes FAT entries, which the sketch parses itself
+*/
+#ifndef SD_h
+#define SD_h
+
+#include "Arduino.h"
+
+#define O_READ 0x01
+#define O_RDONLY O_READ
+#define O_WRITE 0x02
+#define O_WRONLY O_WRITE
+#define O_RDWR (O_READ | O_WRITE)
+#define O_APPEND 0x04
+#define O_SYNC 0x08
+#define O_CREAT 0x10
+#define O_EXCL 0x20
+#define O_TRUNC 0x40
+
+#define FILE_READ O_READ
+#define FILE_WRITE (O_READ | O_WRITE | O_CREAT)
+
+#define SPI_FULL_SPEED 0
+#define SPI_HALF_SPEED 1
+#define SPI_QUARTER_SPEED 2
+
+struct HostFile;
+
+class File : public Stream {
+  public:
+    File(void);
+    File(HostFile * file);
+    size_t write(uint8_t value);
+    size_t write(const uint8_t * buffer, size_t size);
+    using Print::write;
+    int read(void);
+    int read(void * buffer, uint16_t length);
+    int peek(void);
+    int available(void);
+    void flush(void);
+    boolean seek(uint32_t position);
+    uint32_t position(void);
+    uint32_t size(void);
+    void close(void);
+    operator bool();
+    char * name(void);
+    boolean isDirectory(void);
+    File openNextFile(uint8_t mode = O_RDONLY);
+    void rewindDirectory(void);
+  private:
+    HostFile * _file;
+};
+
+//Block access used by the raw vault. The blocks of the last contiguous
+// file opened are the blocks of its host file
+class Sd2Card {
+  public:
+    uint8_t init(uint8_t sckRateID, uint8_t chipSelectPin);
+    uint8_t readBlock(uint32_t block, uint8_t * data);
+    uint8_t writeBlock(uint32_t block, const uint8_t * data);
+    uint32_t cardSize(void);
+};
+
+class SdVolume {
+  public:
+    uint8_t init(Sd2Card * card);
+    uint8_t init(Sd2Card * card, uint8_t partition);
+};
+
+class SdFile {
+  public:
+    SdFile(void);
+    uint8_t openRoot(SdVolume * volume);
+    uint8_t open(SdFile * directory, const char * name, uint8_t flags);
+    uint8_t createContiguous(SdFile * directory, const char * name, uint32_t size);
+    uint8_t contiguousRange(uint32_t * first, uint32_t * last);
+    uint32_t fileSize(void) const;
+    uint8_t isOpen(void) const;
+    uint8_t close(void);
+  private:
+    char _path[256];
+};
+
+//The card and the volume of the library are used by the raw vault
+class SDClass {
+  public:
+    boolean begin(uint8_t csPin);
+    File open(const char * path, uint8_t mode = FILE_READ);
+    boolean exists(const char * path);
+    boolean mkdir(const char * path);
+    boolean remove(const char * path);
+    boolean rmdir(const char * path);
+    Sd2Card card;
+    SdVolume volume;
+};
+extern SDClass SD;
+
+#endif
@@ -0,0 +1,3 @@
+/*
+  Host build of pa55ware. The card and the screen are not on a SPI bus
+*/
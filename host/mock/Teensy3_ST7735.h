@@ -0,0 +1,34 @@
+/*
+  Host build of pa55ware. The screen text is written to stderr when the
+  runner is started with -v
+*/
+#ifndef Teensy3_ST7735_h
+#define Teensy3_ST7735_h
+
+#include "Arduino.h"
+
+#define INITR_BLACKTAB 0x02
+#define ST7735_BLACK 0x0000
+#define ST7735_BLUE 0x001F
+#define ST7735_RED 0xF800
+#define ST7735_GREEN 0x07E0
+#define ST7735_CYAN 0x07FF
+#define ST7735_MAGENTA 0xF81F
+#define ST7735_YELLOW 0xFFE0
+#define ST7735_WHITE 0xFFFF
+
+class Teensy3_ST7735 : public Print {
+  public:
+    Teensy3_ST7735(uint8_t cs, uint8_t rs, uint8_t rst);
+    void initR(uint8_t options);
+    void setRotation(uint8_t rotation);
+    void setCursor(int16_t x, int16_t y);
+    void fillScreen(uint16_t color);
+    void setTextColor(uint16_t color);
+    void setTextColor(uint16_t color, uint16_t background);
+    void setTextSize(uint8_t size);
+    size_t write(uint8_t value);
+    using Print::write;
+};
+
+#endif
@@ -0,0 +1,22 @@
+/*
+  Host build of pa55ware. The clock of the device is the clock of the
+  host, moved by the sync clock command
+*/
+#ifndef Time_h
+#define Time_h
+
+#include "Arduino.h"
+
+typedef time_t (*getExternalTime)(void);
+time_t now(void);
+void setTime(time_t t);
+void setSyncProvider(getExternalTime provider);
+
+class Teensy3ClockClass {
+  public:
+    unsigned long get(void);
+    void set(unsigned long t);
+};
+extern Teensy3ClockClass Teensy3Clock;
+
+#endif
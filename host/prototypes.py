@@ -0,0 +1,35 @@
+#!/usr/bin/env python3
+"""
+Host build of pa55ware. Turns the sketch into a C++ file as the Arduino
+IDE does, declaring the prototypes of its functions after the last
+#include.
+
+Usage: prototypes.py pa55ware.ino pa55ware.cpp
+"""
+import re
+import sys
+
+source, target = sys.argv[1], sys.argv[2]
+lines = open(source).read().split('\n')
+
+#Only the lines outside of braces can start a function
+top = []
+depth = 0
+for line in lines:
+    if depth == 0:
+        top.append(line)
+    depth += line.count('{') - line.count('}')
+
+prototypes = []
+for line in top:
+    match = re.match(r'^([A-Za-z_][\w\s\*&]*?[\s\*&])(\w+)\s*\(([^;]*)\)\s*\{', line)
+    if not match or match.group(2) in ('setup', 'loop'):
+        continue
+    if line.startswith(('class', 'struct', 'union', 'enum', 'if', 'while', 'for', 'switch')):
+        continue
+    parameters = re.sub(r'\s*=\s*[^,]+', '', match.group(3))
+    prototypes.append(match.group(1) + match.group(2) + '(' + parameters + ');')
+
+last = max(i for i, line in enumerate(lines) if line.startswith('#include'))
+output = lines[:last + 1] + prototypes + ['#line %d "%s"' % (last + 2, source)] + lines[last + 1:]
+open(target, 'w').write('\n'.join(output))
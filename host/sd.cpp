@@ -0,0 +1,457 @@
+/*
+  Host build of pa55ware. SD library on a folder of the host
+*/
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "SD.h"
+#include "host.h"
+
+struct HostFile {
+  std::string host;
+  std::string name;
+  bool directory;
+  FILE * stream;
+  uint32_t position;
+  //A directory is read as the FAT entries of its contents
+  std::vector<uint8_t> entries;
+  std::vector<std::string> listing;
+  size_t next;
+  //true when the directory entry has to be written, for the size
+  bool changed;
+};
+
+SDClass SD;
+
+/*
+  The power is cut at the HOST_CUT-th card write: the writes of a file,
+  the files created or truncated, the removals, the folders and the blocks
+  of the contiguous file. A cut write is half done. What the host did not
+  flush yet is lost, as the block buffered by the SD library is
+*/
+static bool hostCut(void) {
+  return HOST_CUT > 0 && --HOST_CUT == 0;
+}
+
+static void hostPowerOff(void) {
+  fprintf(stderr, "pa55ware: power cut\n");
+  _exit(3);
+}
+
+/*
+  The card time: the files go through a single block buffer, as with the
+  SD library. A block is read when the buffer moves to it, and written
+  back when the buffer moves away or the file is flushed. Updating a
+  directory entry, creating or removing an entry costs a block write
+*/
+static std::string BUFFER_HOST;
+static uint32_t BUFFER_BLOCK = 0;
+static bool BUFFER_DIRTY = false;
+
+static void hostWait(long us) {
+  if (us > 0) usleep(us);
+}
+
+static void hostRead(void) {
+  HOST_BLOCKS_READ++;
+  hostWait(HOST_READ_US);
+}
+
+static void hostWrite(void) {
+  HOST_BLOCKS_WRITTEN++;
+  hostWait(HOST_WRITE_US);
+}
+
+static void hostSync(void) {
+  if (!BUFFER_DIRTY) return;
+  BUFFER_DIRTY = false;
+  hostWrite();
+}
+
+static void hostAccess(const std::string & host, uint32_t position, size_t size, bool write) {
+  for (uint32_t block = position / 512; size > 0 && block <= (position + size - 1) / 512; block++) {
+    if (host != BUFFER_HOST || block != BUFFER_BLOCK) {
+      hostSync();
+      //A block written whole is not read first
+      bool whole = write && position <= block * 512 && position + size >= (block + 1) * 512;
+      if (!whole) hostRead();
+      BUFFER_HOST = host;
+      BUFFER_BLOCK = block;
+    }
+    if (write) BUFFER_DIRTY = true;
+  }
+}
+
+static void hostEntry(void) {
+  hostSync();
+  hostWrite();
+}
+
+static std::string hostPath(const char * path) {
+  std::string host = HOST_CARD;
+  std::string part;
+  for (const char * c = path; ; c++) {
+    if (*c == '/' || *c == '\0') {
+      if (!part.empty()) host += "/" + part;
+      part.clear();
+      if (*c == '\0') break;
+    } else {
+      part += toupper(*c);
+    }
+  }
+  return host;
+}
+
+static bool hostIsDirectory(const std::string & host) {
+  struct stat info;
+  return stat(host.c_str(), &info) == 0 && S_ISDIR(info.st_mode);
+}
+
+static bool hostExists(const std::string & host) {
+  struct stat info;
+  return stat(host.c_str(), &info) == 0;
+}
+
+//Builds the FAT entries of a directory, in creation order
+static void hostList(HostFile * file) {
+  std::vector<std::pair<long, std::string> > names;
+  DIR * directory = opendir(file->host.c_str());
+  if (directory) {
+    struct dirent * entry;
+    while ((entry = readdir(directory))) {
+      std::string name = entry->d_name;
+      if (name == "." || name == "..") continue;
+      names.push_back(std::make_pair((long)entry->d_ino, name));
+    }
+    closedir(directory);
+  }
+  std::sort(names.begin(), names.end());
+  
+  file->entries.clear();
+  file->listing.clear();
+  uint8_t entry[32];
+  if (file->host != HOST_CARD) {
+    memset(entry, ' ', 11);
+    memset(entry + 11, 0, 21);
+    entry[0] = '.';
+    entry[11] = 0x10;
+    file->entries.insert(file->entries.end(), entry, entry + 32);
+    entry[1] = '.';
+    file->entries.insert(file->entries.end(), entry, entry + 32);
+  }
+  for (size_t i = 0; i < names.size(); i++) {
+    std::string name = names[i].second;
+    std::string full = file->host + "/" + name;
+    size_t dot = name.find('.');
+    std::string base = name.substr(0, dot);
+    std::string extension = (dot == std::string::npos) ? "" : name.substr(dot + 1);
+    memset(entry, ' ', 11);
+    memset(entry + 11, 0, 21);
+    memcpy(entry, base.c_str(), std::min<size_t>(8, base.size()));
+    memcpy(entry + 8, extension.c_str(), std::min<size_t>(3, extension.size()));
+    bool folder = hostIsDirectory(full);
+    entry[11] = folder ? 0x10 : 0x20;
+    struct stat info;
+    uint32_t size = (!folder && stat(full.c_str(), &info) == 0) ? info.st_size : 0;
+    for (int b = 0; b < 4; b++) entry[28 + b] = size >> (8 * b);
+    file->entries.insert(file->entries.end(), entry, entry + 32);
+    file->listing.push_back(name);
+  }
+  //The end of the directory is an entry starting with 0
+  file->entries.resize((file->entries.size() / 512 + 1) * 512, 0);
+}
+
+File::File(void) : _file(NULL) {}
+
+File::File(HostFile * file) : _file(file) {}
+
+size_t File::write(uint8_t value) {
+  return write(&value, 1);
+}
+
+size_t File::write(const uint8_t * buffer, size_t size) {
+  if (!_file || _file->directory) return 0;
+  fseek(_file->stream, _file->position, SEEK_SET);
+  if (hostCut()) {
+    fwrite(buffer, 1, size / 2, _file->stream);
+    fflush(_file->stream);
+    hostPowerOff();
+  }
+  hostAccess(_file->host, _file->position, size, true);
+  size_t written = fwrite(buffer, 1, size, _file->stream);
+  _file->position += written;
+  _file->changed = true;
+  return written;
+}
+
+int File::read(void) {
+  uint8_t value;
+  return (read(&value, 1) == 1) ? value : -1;
+}
+
+int File::read(void * buffer, uint16_t length) {
+  if (!_file) return -1;
+  if (_file->directory) {
+    hostList(_file);
+    size_t left = (_file->position < _file->entries.size()) ? _file->entries.size() - _file->position : 0;
+    size_t count = std::min<size_t>(length, left);
+    hostAccess(_file->host, _file->position, count, false);
+    memcpy(buffer, _file->entries.data() + _file->position, count);
+    _file->position += count;
+    return count;
+  }
+  fseek(_file->stream, _file->position, SEEK_SET);
+  size_t count = fread(buffer, 1, length, _file->stream);
+  hostAccess(_file->host, _file->position, count, false);
+  _file->position += count;
+  return count;
+}
+
+int File::peek(void) {
+  int value = read();
+  if (value >= 0) _file->position--;
+  return value;
+}
+
+int File::available(void) {
+  return _file ? size() - _file->position : 0;
+}
+
+void File::flush(void) {
+  if (!_file || !_file->stream) return;
+  fflush(_file->stream);
+  if (BUFFER_HOST == _file->host) hostSync();
+  if (_file->changed) hostEntry();
+  _file->changed = false;
+}
+
+boolean File::seek(uint32_t position) {
+  //As on the card, a file cannot be sought past its end
+  if (!_file || (!_file->directory && position > size())) return false;
+  _file->position = position;
+  return true;
+}
+
+uint32_t File::position(void) {
+  return _file ? _file->position : 0;
+}
+
+uint32_t File::size(void) {
+  if (!_file || _file->directory) return 0;
+  fflush(_file->stream);
+  struct stat info;
+  return (fstat(fileno(_file->stream), &info) == 0) ? info.st_size : 0;
+}
+
+void File::close(void) {
+  if (!_file) return;
+  flush();
+  if (_file->stream) fclose(_file->stream);
+  delete _file;
+  _file = NULL;
+}
+
+File::operator bool() {
+  return _file != NULL;
+}
+
+char * File::name(void) {
+  return (char *)_file->name.c_str();
+}
+
+boolean File::isDirectory(void) {
+  return _file && _file->directory;
+}
+
+File File::openNextFile(uint8_t mode) {
+  if (!_file || !_file->directory) return File();
+  if (_file->next == 0) hostList(_file);
+  if (_file->next >= _file->listing.size()) return File();
+  std::string path = _file->host.substr(strlen(HOST_CARD)) + "/" + _file->listing[_file->next++];
+  return SD.open(path.c_str(), mode);
+}
+
+void File::rewindDirectory(void) {
+  if (!_file) return;
+  _file->next = 0;
+  _file->position = 0;
+}
+
+boolean SDClass::begin(uint8_t csPin) {
+  ::mkdir(HOST_CARD, 0755);
+  return card.init(SPI_HALF_SPEED, csPin) && volume.init(&card) && hostIsDirectory(HOST_CARD);
+}
+
+File SDClass::open(const char * path, uint8_t mode) {
+  std::string host = hostPath(path);
+  size_t slash = host.rfind('/');
+  //The path is walked from the root, reading a block of each folder
+  for (size_t i = strlen(HOST_CARD); i < host.size() && i != std::string::npos; i = host.find('/', i + 1)) {
+    hostAccess(host.substr(0, i), 0, 32, false);
+  }
+  HostFile * file = new HostFile();
+  file->host = host;
+  file->name = (host == HOST_CARD) ? "/" : host.substr(slash + 1);
+  file->stream = NULL;
+  file->position = 0;
+  file->next = 0;
+  file->changed = false;
+  file->directory = hostIsDirectory(host);
+  if (file->directory) return File(file);
+  
+  if (mode & O_WRITE) {
+    //The folder has to exist, and writes start at the end of the file
+    if (!hostIsDirectory(host.substr(0, slash)) ||
+        (!(mode & O_CREAT) && !hostExists(host))) {
+      delete file;
+      return File();
+    }
+    boolean keep = hostExists(host) && !(mode & O_TRUNC);
+    if (!keep && hostCut()) hostPowerOff();
+    if (!keep) hostEntry();
+    file->stream = fopen(host.c_str(), keep ? "r+b" : "w+b");
+    if (file->stream) {
+      fseek(file->stream, 0, SEEK_END);
+      file->position = ftell(file->stream);
+    }
+  } else {
+    file->stream = fopen(host.c_str(), "rb");
+  }
+  if (!file->stream) {
+    delete file;
+    return File();
+  }
+  return File(file);
+}
+
+boolean SDClass::exists(const char * path) {
+  return hostExists(hostPath(path));
+}
+
+boolean SDClass::mkdir(const char * path) {
+  //The missing parent folders are created too
+  std::string host = hostPath(path);
+  if (hostCut()) hostPowerOff();
+  hostEntry();
+  for (size_t i = strlen(HOST_CARD) + 1; i <= host.size(); i++) {
+    if (i == host.size() || host[i] == '/') ::mkdir(host.substr(0, i).c_str(), 0755);
+  }
+  return hostIsDirectory(host);
+}
+
+boolean SDClass::remove(const char * path) {
+  if (hostCut()) hostPowerOff();
+  hostEntry();
+  return ::unlink(hostPath(path).c_str()) == 0;
+}
+
+boolean SDClass::rmdir(const char * path) {
+  if (hostCut()) hostPowerOff();
+  hostEntry();
+  return ::rmdir(hostPath(path).c_str()) == 0;
+}
+
+//Host file of the contiguous file, and the card block it starts at
+static std::string CONTIGUOUS_HOST;
+static const uint32_t CONTIGUOUS_FIRST = 1024;
+
+uint8_t Sd2Card::init(uint8_t, uint8_t) {
+  return 1;
+}
+
+uint8_t Sd2Card::readBlock(uint32_t block, uint8_t * data) {
+  hostRead();
+  memset(data, 0, 512);
+  FILE * stream = fopen(CONTIGUOUS_HOST.c_str(), "rb");
+  if (!stream || block < CONTIGUOUS_FIRST) {
+    if (stream) fclose(stream);
+    return 0;
+  }
+  fseek(stream, (long)(block - CONTIGUOUS_FIRST) * 512, SEEK_SET);
+  size_t count = fread(data, 1, 512, stream);
+  fclose(stream);
+  return count == 512;
+}
+
+uint8_t Sd2Card::writeBlock(uint32_t block, const uint8_t * data) {
+  if (hostCut()) hostPowerOff();
+  hostWrite();
+  FILE * stream = fopen(CONTIGUOUS_HOST.c_str(), "r+b");
+  if (!stream || block < CONTIGUOUS_FIRST) {
+    if (stream) fclose(stream);
+    return 0;
+  }
+  fseek(stream, (long)(block - CONTIGUOUS_FIRST) * 512, SEEK_SET);
+  size_t count = fwrite(data, 1, 512, stream);
+  fclose(stream);
+  return count == 512;
+}
+
+uint32_t Sd2Card::cardSize(void) {
+  return 1UL << 21;
+}
+
+uint8_t SdVolume::init(Sd2Card *) {
+  return 1;
+}
+
+uint8_t SdVolume::init(Sd2Card *, uint8_t) {
+  return 1;
+}
+
+SdFile::SdFile(void) {
+  _path[0] = '\0';
+}
+
+uint8_t SdFile::openRoot(SdVolume *) {
+  strcpy(_path, "/");
+  return 1;
+}
+
+uint8_t SdFile::open(SdFile *, const char * name, uint8_t) {
+  snprintf(_path, sizeof(_path), "%s", hostPath(name).c_str());
+  if (!hostExists(_path)) {
+    _path[0] = '\0';
+    return 0;
+  }
+  return 1;
+}
+
+uint8_t SdFile::createContiguous(SdFile *, const char * name, uint32_t size) {
+  snprintf(_path, sizeof(_path), "%s", hostPath(name).c_str());
+  FILE * stream = fopen(_path, "wb");
+  if (!stream || size == 0) {
+    if (stream) fclose(stream);
+    return 0;
+  }
+  fseek(stream, size - 1, SEEK_SET);
+  fputc(0, stream);
+  fclose(stream);
+  return 1;
+}
+
+uint8_t SdFile::contiguousRange(uint32_t * first, uint32_t * last) {
+  if (!_path[0]) return 0;
+  CONTIGUOUS_HOST = _path;
+  *first = CONTIGUOUS_FIRST;
+  *last = CONTIGUOUS_FIRST + fileSize() / 512 - 1;
+  return 1;
+}
+
+uint32_t SdFile::fileSize(void) const {
+  struct stat info;
+  return (stat(_path, &info) == 0) ? info.st_size : 0;
+}
+
+uint8_t SdFile::isOpen(void) const {
+  return _path[0] != '\0';
+}
+
+uint8_t SdFile::close(void) {
+  _path[0] = '\0';
+  return 1;
+}
@@ -0,0 +1,253 @@
+#!/usr/bin/env python3
+"""
+Reference client of the delta sync of pa55ware. Pushes the records of a
+host database to the device, sending only the records changed since the
+last sync, and reports the records changed on the device meanwhile.
+
+The device sends the digest of a folder and of its entries (command 11).
+The client keeps the digests of its last sync, and only walks down the
+folders whose digest changed. The digests cover the records as stored on
+the card, encrypted, so they are compared with those of the last sync,
+not computed from the database. tree_digests() computes them from an
+export of the vault, as a reference of the device side.
+
+Usage: sync.py PORT DATABASE [-s state]
+  DATABASE - JSON file of the records, {"/FOLDER/NAME": {"type": 1,
+             "sections": {"0": "login", "1": "password"}}}. Names are
+             8.3 names, as on the card
+  -s state - JSON file of the last sync, DATABASE.state by default
+"""
+import argparse
+import hashlib
+import json
+import os
+import sys
+
+from load import Port, exchange, FRAME_HELLO
+
+COMMAND_MKDIR = 2
+COMMAND_BATCH = 9
+COMMAND_DIGESTS = 11
+
+ENTRY_FILE = 2
+ENTRY_FOLDER = 3
+
+#Payload of a batch create command
+BATCH_MAX = 480
+
+
+class Client:
+    """Runs the commands of the sync, and counts the bytes they move"""
+
+    def __init__(self, command):
+        self.command = command
+        self.moved = 0
+        self.pushed = []
+        self.changed = []
+
+    def run(self, command, payload=b''):
+        reply = self.command(command, payload)
+        self.moved += len(payload) + len(reply)
+        return reply
+
+    def digests(self, folder):
+        """Returns the digest of a folder and of its entries, as {path: (type, digest)}"""
+        reply = self.run(COMMAND_DIGESTS, folder.encode() + b'\x00')
+        if not reply or reply[0] != 1:
+            return None, {}
+        digest = reply[1:33]
+        entries = {}
+        position = 33
+        while position < len(reply):
+            kind, length = reply[position], reply[position + 1]
+            name = reply[position + 2:position + 2 + length].decode()
+            position += 2 + length
+            entries[join(folder, name)] = (kind, reply[position:position + 32])
+            position += 32
+        return digest, entries
+
+
+def join(folder, name):
+    return folder.rstrip('/') + '/' + name
+
+
+def parent(path):
+    return path.rsplit('/', 1)[0] or '/'
+
+
+def own(folder):
+    """The key of the digest of a folder, its entry being under its path"""
+    return folder.rstrip('/') + '/'
+
+
+def record_hash(record):
+    return hashlib.sha256(json.dumps(record, sort_keys=True).encode()).hexdigest()
+
+
+def sections(path, record):
+    """The sections of a record, as in the payload of a create command"""
+    data = b''
+    encoded = path.encode()
+    for section_type, text in sorted(record['sections'].items()):
+        text = text.encode()
+        data += bytes([len(encoded)]) + encoded + bytes([record.get('type', 1), int(section_type), len(text)]) + text
+    return data
+
+
+def walk(client, folder, state, digests, walked):
+    """
+    Walks down the folders whose digest changed since the last sync, and
+    collects the records changed on the device. digests receives the new
+    digests of the folders walked and of their entries
+    """
+    digest, entries = client.digests(folder)
+    if digest is None:
+        return
+    walked.add(folder)
+    digests[own(folder)] = digest.hex()
+    for path, (kind, entry) in entries.items():
+        digests[path] = entry.hex()
+        if state.get(path) == entry.hex():
+            continue
+        if kind == ENTRY_FOLDER:
+            walk(client, path, state, digests, walked)
+        else:
+            client.changed.append(path)
+    #The entries gone since the last sync
+    for path in state:
+        if parent(path) == folder and path not in entries and not path.endswith('/'):
+            client.changed.append(path)
+
+
+def sync(command, database, state):
+    """
+    Syncs the device with the database. state is the result of the last
+    sync, {} for the first one. Returns the client, with the bytes moved,
+    the records pushed and those changed on the device, and the new state
+    """
+    client = Client(command)
+    digests = {}
+    last = state.get('digests', {})
+    records = state.get('records', {})
+
+    #The device side, from the digests of the last sync. The folders not
+    # walked keep the digests of their entries
+    walked = set()
+    walk(client, '/', last, digests, walked)
+    for path, value in last.items():
+        if path not in digests and parent(path) not in walked:
+            digests[path] = value
+
+    #The records changed in the database since the last sync
+    pushed = sorted(path for path, record in database.items() if records.get(path) != record_hash(record))
+    folders = sorted(set(parent(path) for path in pushed))
+    for folder in folders:
+        path = ''
+        for name in folder.strip('/').split('/'):
+            path += '/' + name
+            if own(path) not in digests:
+                client.run(COMMAND_MKDIR, path.encode() + b'\x00')
+    batch = b''
+    for path in pushed:
+        data = sections(path, database[path])
+        if batch and len(batch) + len(data) > BATCH_MAX:
+            client.run(COMMAND_BATCH, batch)
+            batch = b''
+        batch += data
+    if batch:
+        client.run(COMMAND_BATCH, batch)
+    client.pushed = pushed
+    client.changed = [path for path in client.changed if path not in pushed]
+
+    #The digests of the folders written, and of the folders above them
+    touched = set()
+    for folder in folders:
+        while True:
+            touched.add(folder)
+            if folder == '/':
+                break
+            folder = parent(folder)
+    for folder in sorted(touched):
+        digest, entries = client.digests(folder)
+        if digest is not None:
+            digests[own(folder)] = digest.hex()
+            for path, (_, entry) in entries.items():
+                digests[path] = entry.hex()
+
+    new_state = {'digests': digests,
+                 'records': dict((path, record_hash(record)) for path, record in database.items())}
+    return client, new_state
+
+
+def tree_digests(records):
+    """
+    Computes the digests of the device from the records of an export, as
+    {path: digest} with the entries, and the folders under own(). Folders
+    without records are not in an export, and are not included
+    """
+    folders = {'/': []}
+    for path in records:
+        child = path
+        while child != '/':
+            folder = parent(child)
+            folders.setdefault(folder, [])
+            if child not in folders[folder]:
+                folders[folder].append(child)
+            child = folder
+    digests = {}
+
+    def entry(path, kind, digest):
+        name = path.rsplit('/', 1)[1].encode()
+        return hashlib.sha256(bytes([kind, len(name)]) + name + digest).digest()
+
+    def folder_digest(folder):
+        total = bytes(32)
+        for child in folders[folder]:
+            if child in folders:
+                digest = entry(child, ENTRY_FOLDER, folder_digest(child))
+            else:
+                digest = entry(child, ENTRY_FILE, hashlib.sha256(records[child]).digest())
+            digests[child] = digest
+            total = bytes(a ^ b for a, b in zip(total, digest))
+        digests[own(folder)] = hashlib.sha256(total).digest()
+        return digests[own(folder)]
+
+    folder_digest('/')
+    return digests
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('port')
+    parser.add_argument('database')
+    parser.add_argument('-s', dest='state')
+    options = parser.parse_args()
+    state_path = options.state or options.database + '.state'
+
+    with open(options.database) as stream:
+        database = json.load(stream)
+    state = {}
+    if os.path.exists(state_path):
+        with open(state_path) as stream:
+            state = json.load(stream)
+
+    port = Port(options.port)
+    exchange(port, 0, FRAME_HELLO)
+    sequence = [1]
+
+    def command(number, payload):
+        reply = exchange(port, sequence[0] & 0xFF, number, payload)
+        sequence[0] += 1
+        return reply
+
+    client, state = sync(command, database, state)
+    with open(state_path, 'w') as stream:
+        json.dump(state, stream)
+    for path in client.changed:
+        print('changed on the device: %s' % path)
+    print('%d records pushed, %d bytes moved' % (len(client.pushed), client.moved))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
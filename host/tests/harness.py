@@ -0,0 +1,219 @@
+"""
+Host tests of pa55ware. Runs the host build on a card folder and talks to
+it through its pseudo terminal, with the framing of load.py.
+
+The build is taken from $PA55WARE, build/pa55ware by default.
+"""
+import os
+import re
+import shutil
+import signal
+import subprocess
+import sys
+import tempfile
+import time
+
+HOST = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+sys.path.insert(0, HOST)
+
+from load import Port, ReportPort, exchange, crc16, FRAME_HELLO, HELLO_PACK  # noqa: E402
+
+COMMAND_CREATE = 1
+COMMAND_MKDIR = 2
+COMMAND_LIST = 4
+COMMAND_STATS = 5
+COMMAND_COMPACT = 6
+COMMAND_RAW = 7
+COMMAND_VERIFY = 8
+COMMAND_BATCH = 9
+COMMAND_EXPORT = 10
+COMMAND_DIGESTS = 11
+COMMAND_PAGE = 12
+COMMAND_PING = 13
+COMMAND_METRICS = 14
+COMMAND_LOOPBACK = 15
+
+#Lines of the stats command (5)
+STATS = ['cache_hits', 'cache_misses', 'path_hits', 'path_misses', 'catalog_count',
+         'catalog_load_ms', 'prefetch_hits', 'prefetch_misses', 'record_loads',
+         'record_load_us', 'record_stores', 'record_store_us', 'bloom_skips',
+         'bloom_misses', 'verify_checked', 'verify_errors', 'time_to_password',
+         'frames', 'frame_errors', 'receive_peak', 'pipe_stalls', 'pipe_samples',
+         'pipe_receive', 'pipe_encrypt', 'pipe_write', 'pack_received_raw',
+         'pack_received_wire', 'pack_sent_raw', 'pack_sent_wire', 'hid_failures']
+
+
+def binary(hid=False):
+    """The host build, $PA55WARE_HID or build/hid/pa55ware for the HID one"""
+    if hid:
+        return os.environ.get('PA55WARE_HID', os.path.join(HOST, 'build', 'hid', 'pa55ware'))
+    return os.environ.get('PA55WARE', os.path.join(HOST, 'build', 'pa55ware'))
+
+
+def section(path, data, record_type=1, section_type=0):
+    """Payload of a create command, a section of a record"""
+    path = path.encode() if isinstance(path, str) else path
+    data = data.encode() if isinstance(data, str) else data
+    return bytes([len(path)]) + path + bytes([record_type, section_type, len(data)]) + data
+
+
+class Device:
+    """
+    The host build running on a card folder. The card and the EEPROM are
+    kept by restart(), so that a test can power the device off and on.
+    With hid, the HID build is run and the frames go in raw HID reports
+    """
+
+    def __init__(self, card=None, binary_path=None, timeout=10, options=(), eeprom=None, hid=False):
+        self.directory = tempfile.mkdtemp(prefix='pa55ware-')
+        self.card = card or os.path.join(self.directory, 'card')
+        os.makedirs(self.card, exist_ok=True)
+        self.eeprom = os.path.join(self.directory, 'eeprom.bin')
+        #The key of another device, so that the records compare
+        if eeprom:
+            with open(self.eeprom, 'wb') as stream:
+                stream.write(eeprom)
+        self.binary = binary_path or binary(hid)
+        self.port_class = ReportPort if hid else Port
+        self.timeout = timeout
+        self.process = None
+        self.port = None
+        self.sequence = 0
+        self.start(options)
+
+    def start(self, options=()):
+        """Powers the device on, options are added to those of the runner"""
+        link = os.path.join(self.directory, 'port')
+        if os.path.lexists(link):
+            os.unlink(link)
+        arguments = [self.binary, '-c', self.card, '-e', self.eeprom, '-l', link] + list(options)
+        self.log = open(os.path.join(self.directory, 'stderr'), 'w+')
+        self.process = subprocess.Popen(arguments, stdout=subprocess.DEVNULL, stderr=self.log)
+        end = time.time() + self.timeout
+        while not os.path.exists(link):
+            if self.process.poll() is not None or time.time() > end:
+                raise RuntimeError('the host build did not start: ' + self.stderr())
+            time.sleep(0.01)
+        self.port = self.port_class(link, self.timeout)
+        try:
+            self.session()
+        except OSError:
+            #The power can be cut while booting, see -k
+            if self.process.wait(self.timeout) != 3:
+                raise
+
+    def session(self, options=b''):
+        """Starts a v2 session, again after another host tool used the port"""
+        #The device reads the frame once it is in command mode, after the
+        # boot buttons
+        self.port.packed = False
+        self.port.send(0, FRAME_HELLO, options)
+        _, _, self.hello = self.port.receive()
+        self.port.packed = len(self.hello) > 4 and bool(self.hello[4] & HELLO_PACK)
+        self.sequence = 1
+
+    def stop(self):
+        """Powers the device off"""
+        if self.process and self.process.poll() is None:
+            self.process.send_signal(signal.SIGKILL)
+            self.process.wait()
+        if self.port:
+            os.close(self.port.fd)
+            self.port = None
+        self.process = None
+
+    def restart(self, options=()):
+        self.stop()
+        self.start(options)
+
+    def close(self):
+        self.stop()
+        shutil.rmtree(self.directory, ignore_errors=True)
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exception):
+        self.close()
+
+    def stderr(self):
+        self.log.seek(0)
+        return self.log.read()
+
+    def next_sequence(self):
+        number = self.sequence & 0xFF
+        self.sequence += 1
+        return number
+
+    def command(self, command, payload=b''):
+        """Runs a v2 command, returns the payload of its reply"""
+        try:
+            return exchange(self.port, self.next_sequence(), command, payload)
+        except TimeoutError:
+            if self.process.poll() is not None:
+                raise RuntimeError('the host build stopped: ' + self.stderr())
+            raise
+
+    def stats(self):
+        lines = self.command(COMMAND_STATS).split()
+        return dict(zip(STATS, (int(value) for value in lines)))
+
+    def blocks(self):
+        """Returns the card blocks read and written so far, as (read, written)"""
+        count = self.stderr().count(' blocks read')
+        self.process.send_signal(signal.SIGUSR1)
+        end = time.time() + self.timeout
+        while self.stderr().count(' blocks read') == count:
+            if time.time() > end:
+                raise TimeoutError('no block counts')
+            time.sleep(0.01)
+        read, written = re.findall(r'(\d+) blocks read, (\d+) blocks written', self.stderr())[-1]
+        return int(read), int(written)
+
+    def export(self):
+        """Returns the records of the vault as a list of (path, record)"""
+        return parse_export(self.command(COMMAND_EXPORT))
+
+    def wait(self, seconds):
+        """Lets the device run its idle work"""
+        time.sleep(seconds)
+
+
+def parse_chunks(reply):
+    """Returns the export stream carried by the reply of an export command"""
+    if not reply or reply[0] != 1:
+        raise IOError('export refused')
+    stream = b''
+    position = 1
+    while True:
+        header = reply[position:position + 6]
+        offset = int.from_bytes(header[:4], 'little')
+        length = int.from_bytes(header[4:6], 'little')
+        chunk = reply[position + 6:position + 6 + length]
+        check = int.from_bytes(reply[position + 6 + length:position + 8 + length], 'little')
+        if len(header) < 6 or check != crc16(header + chunk) or offset != len(stream):
+            raise IOError('bad export chunk at %d' % offset)
+        if length == 0:
+            return stream
+        stream += chunk
+        position += 8 + length
+
+
+def parse_export(reply):
+    records = []
+    stream = parse_chunks(reply)
+    position = 0
+    while position < len(stream):
+        length = stream[position]
+        path = stream[position + 1:position + 1 + length].decode()
+        position += 1 + length
+        size = int.from_bytes(stream[position:position + 2], 'little')
+        records.append((path, stream[position + 2:position + 2 + size]))
+        position += 2 + size
+    return records
+
+
+def check(condition, message):
+    if not condition:
+        print('FAIL: ' + message)
+        sys.exit(1)
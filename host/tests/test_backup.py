@@ -0,0 +1,94 @@
+#!/usr/bin/env python3
+"""
+Backs up the vault of the host build with the host receiver, backup.py.
+The first export is cut by a power off, the second one by the receiver
+no longer reading, which the device abandons. Each time the export is
+resumed from the chunks already saved, and the backup has to end equal to
+an export run whole.
+"""
+import os
+import shutil
+import tempfile
+import termios
+import time
+
+from harness import Device, HOST, COMMAND_BATCH, COMMAND_EXPORT, COMMAND_MKDIR, COMMAND_PING, section, \
+    parse_chunks, check
+
+import sys
+sys.path.insert(0, HOST)
+from backup import Backup, receive  # noqa: E402
+
+FOLDERS = 10
+RECORDS = 150
+#Payload of a batch create command
+BATCH_MAX = 480
+
+
+class Interrupted(Exception):
+    pass
+
+
+class Cut(Backup):
+    """Backup interrupted once it received this many bytes"""
+
+    def __init__(self, path, limit):
+        Backup.__init__(self, path)
+        self.limit = limit
+
+    def store(self, offset, chunk):
+        Backup.store(self, offset, chunk)
+        if self.received >= self.limit:
+            raise Interrupted()
+
+
+def main():
+    scratch = tempfile.mkdtemp(prefix='pa55ware-backup-')
+    path = os.path.join(scratch, 'vault.bin')
+    try:
+        with Device() as device:
+            for folder in range(FOLDERS):
+                check(device.command(COMMAND_MKDIR, ('/B%d\x00' % folder).encode()) == b'\x01', 'mkdir')
+                batch = b''
+                for index in range(RECORDS + 1):
+                    data = section('/B%d/R%03d' % (folder, index), 'user%d.%d@example.com' % (folder, index))
+                    if index == RECORDS or len(batch) + len(data) > BATCH_MAX:
+                        check(device.command(COMMAND_BATCH, batch)[0] == 1, 'batch create')
+                        batch = b''
+                    batch += data
+            reference = parse_chunks(device.command(COMMAND_EXPORT))
+            print('export stream: %d bytes' % len(reference))
+
+            #Power off during the export
+            backup = Cut(path, len(reference) // 3)
+            try:
+                receive(device.port, device.next_sequence(), backup)
+                check(False, 'the export is cut')
+            except Interrupted:
+                pass
+            backup.stream.close()
+            device.restart()
+
+            #The receiver stops reading, the device gives up on the export
+            backup = Backup(path)
+            resumed = backup.length
+            device.port.send(device.next_sequence(), COMMAND_EXPORT, resumed.to_bytes(4, 'little'))
+            time.sleep(4)
+            termios.tcflush(device.port.fd, termios.TCIFLUSH)
+            device.port.buffer = b''
+            check(device.command(COMMAND_PING, b'alive') == b'alive', 'the device gave up the export')
+
+            #Resumed from the end of the saved chunks
+            length = receive(device.port, device.next_sequence(), backup)
+            check(length == len(reference), 'the stream ends at its length')
+            backup.finish(length)
+            print('resumed at %d bytes, %d bytes received' % (resumed, backup.received))
+            check(0 < resumed and backup.received == len(reference) - resumed, 'only the missing chunks are received')
+        check(open(path, 'rb').read() == reference, 'the backup equals the whole export')
+    finally:
+        shutil.rmtree(scratch, ignore_errors=True)
+    print('test_backup: ok')
+
+
+if __name__ == '__main__':
+    main()
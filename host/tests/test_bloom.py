@@ -0,0 +1,56 @@
+#!/usr/bin/env python3
+"""
+Imports 5,000 new records in a folder with the batch create command, and
+checks that the Bloom filter of the folder told them apart from the
+existing ones without looking them up on the card. The filter has to
+have grown with the folder.
+"""
+import os
+import time
+
+from harness import Device, COMMAND_BATCH, COMMAND_MKDIR, section, check
+
+RECORDS = 5000
+
+
+def main():
+    with Device() as device:
+        check(device.command(COMMAND_MKDIR, b'/IMPORT\x00') == b'\x01', 'mkdir /IMPORT')
+        before = device.stats()
+        start = time.time()
+        batch = b''
+        for index in range(RECORDS + 1):
+            item = section('/IMPORT/R%05d' % index, 'user%d' % index) if index < RECORDS else b''
+            if len(batch) + len(item) > 480 or index == RECORDS:
+                reply = device.command(COMMAND_BATCH, batch)
+                check(reply[0] == 1, 'batch create before record %d' % index)
+                batch = b''
+            batch += item
+        #The last records are folded by the listing checkpoint
+        device.command(4, b'/IMPORT\x00')
+        elapsed = time.time() - start
+        after = device.stats()
+
+        skips = after['bloom_skips'] - before['bloom_skips']
+        misses = after['bloom_misses'] - before['bloom_misses']
+        lookups = after['path_misses'] - before['path_misses']
+        print('%d records in %.1f s, %.0f records/s' % (RECORDS, elapsed, RECORDS / elapsed))
+        print('filter: %d new records skipped the card, %d false positives, %d paths looked up' % (
+            skips, misses, lookups))
+        check(skips + misses == RECORDS, 'every new record went through the filter')
+        check(misses < RECORDS * 0.1, 'fewer than 10% false positives')
+        check(lookups < RECORDS / 2, 'the new records are not looked up on the card')
+
+        with open(os.path.join(device.card, 'IMPORT', '_BLOOM'), 'rb') as stream:
+            header = stream.read(6)
+        length = int.from_bytes(header[2:4], 'little')
+        count = int.from_bytes(header[4:6], 'little')
+        print('filter: %d bytes, %d entries' % (length, count))
+        check(header[0:1] == b'B' and count == RECORDS, 'the filter counts the 5,000 entries')
+        check(length >= 2048 or length * 8 >= count * 10, 'the filter grew with the folder')
+        check(len(device.export()) == RECORDS, 'the records are all exported')
+    print('test_bloom: ok')
+
+
+if __name__ == '__main__':
+    main()
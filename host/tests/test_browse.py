@@ -0,0 +1,124 @@
+#!/usr/bin/env python3
+"""
+Replays a browse trace on the host build, on a card whose blocks take
+200 us to read: folders opened, records opened and their password shown,
+the same few records over and over as when the device is used. The trace
+is replayed twice, and the card blocks each pass reads are counted by the
+host build (SIGUSR1), once the idle verifier of the boot is done. Prints
+the blocks read per button press and the hits of the caches.
+
+The trace is written to a file, and can be replayed by hand with
+pa55ware -b @trace.
+"""
+import os
+import random
+import signal
+import time
+
+from harness import Device, COMMAND_CREATE, COMMAND_LIST, COMMAND_MKDIR, section, check
+
+FOLDERS = 6
+RECORDS = 12
+#Records opened in a folder each time it is browsed
+OPENS = 2
+VISITS = 6
+
+UP = '0'
+DOWN = '1'
+BACK = '2'
+ENTER = '3'
+
+
+def move(position, target):
+    """The presses moving the selection from position to target"""
+    if target >= position:
+        return [DOWN] * (target - position)
+    return [UP] * (position - target)
+
+
+def browse():
+    """
+    The presses of a pass, starting and ending at the root folder. The
+    selection is kept when a folder is opened, as in the sketch, and
+    starts again at the top when it is past the end
+    """
+    generator = random.Random(28)
+    #Records opened most of the time, as the favourites of a user
+    favourites = [(generator.randrange(FOLDERS), generator.randrange(RECORDS)) for _ in range(5)]
+    presses = []
+    position = 0
+    for _ in range(VISITS):
+        folder = generator.choice(favourites)[0]
+        presses += move(position, folder) + [ENTER]
+        position = folder
+        for _ in range(OPENS):
+            if generator.random() < 0.7:
+                record = generator.choice([r for f, r in favourites if f == folder])
+            else:
+                record = generator.randrange(RECORDS)
+            presses += move(position, record) + [ENTER]
+            position = record
+            if generator.random() < 0.3:
+                presses.append(DOWN)
+            presses.append(BACK)
+        presses.append(BACK)
+        if position >= FOLDERS:
+            position = 0
+    return presses
+
+
+def blocks(device, count):
+    """Waits for the count-th pause of the trace, then for the card to be idle"""
+    end = time.time() + 600
+    while device.stderr().count('pa55ware: paused') < count:
+        check(time.time() < end and device.process.poll() is None, 'the trace is replayed')
+        time.sleep(0.2)
+    last = None
+    while True:
+        time.sleep(1)
+        read = device.blocks()[0]
+        if read == last:
+            return read
+        last = read
+
+
+def main():
+    presses = browse()
+    with Device() as device:
+        for folder in range(FOLDERS):
+            check(device.command(COMMAND_MKDIR, ('/F%d\x00' % folder).encode()) == b'\x01', 'mkdir /F%d' % folder)
+            for index in range(RECORDS):
+                reply = device.command(COMMAND_CREATE, section('/F%d/R%02d' % (folder, index), 'user%d' % index))
+                check(reply == b'\x01', 'create /F%d/R%02d' % (folder, index))
+            device.command(COMMAND_LIST, ('/F%d\x00' % folder).encode())
+
+        #Unlock, then each pass between two pauses
+        trace = os.path.join(device.directory, 'trace')
+        with open(trace, 'w') as stream:
+            stream.write('2:1500,0\np\n%s\np\n%s\np\n' % (' '.join(presses), ' '.join(presses)))
+        device.restart(['-t', '2000,200', '-b', '@' + trace])
+
+        start = blocks(device, 1)
+        before = device.stats()
+        passes = []
+        for number in (2, 3):
+            device.process.send_signal(signal.SIGUSR2)
+            began = time.time()
+            passes.append((blocks(device, number) - start, time.time() - began))
+            start += passes[-1][0]
+        after = device.stats()
+
+    for number, (read, elapsed) in enumerate(passes):
+        print('pass %d: %d presses, %d blocks read, %.2f per press, %.1f s' % (
+            number + 1, len(presses), read, read / len(presses), elapsed))
+    for name in ('cache', 'path', 'prefetch'):
+        print('%s: %d hits, %d misses' % (name, after[name + '_hits'] - before[name + '_hits'],
+                                          after[name + '_misses'] - before[name + '_misses']))
+    check(passes[1][0] <= passes[0][0], 'the second pass reads no more blocks than the first')
+    check(after['cache_hits'] > before['cache_hits'] and after['prefetch_hits'] > before['prefetch_hits'],
+          'the records are read from the caches')
+    print('test_browse: ok')
+
+
+if __name__ == '__main__':
+    main()
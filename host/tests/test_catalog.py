@@ -0,0 +1,66 @@
+#!/usr/bin/env python3
+"""
+Loads the catalog of a synthetic 2,000 entries vault on a card whose
+block writes take 2 ms and reads 200 us: 40 folders of 49 records. The
+catalog is built again from the folders once its file is removed, then
+decrypted at the next unlock. Prints the build time, the card blocks it
+read, and the load time, which has to stay below 300 ms.
+"""
+import os
+import time
+
+from harness import Device, COMMAND_BATCH, COMMAND_LIST, COMMAND_MKDIR, section, check
+
+FOLDERS = 40
+RECORDS = 49
+ENTRIES = FOLDERS * (RECORDS + 1)
+
+
+def catalog(device):
+    """Waits for the catalog to hold the whole vault, returns the stats"""
+    end = time.time() + 600
+    while True:
+        stats = device.stats()
+        if stats['catalog_count'] == ENTRIES:
+            return stats
+        check(time.time() < end, 'the catalog is built, %d entries' % stats['catalog_count'])
+        time.sleep(1)
+
+
+def main():
+    with Device() as device:
+        batch = b''
+        for folder in range(FOLDERS):
+            check(device.command(COMMAND_MKDIR, ('/C%02d\x00' % folder).encode()) == b'\x01', 'mkdir /C%02d' % folder)
+            for index in range(RECORDS + 1):
+                item = section('/C%02d/R%03d' % (folder, index), 'user%d.%d' % (folder, index))
+                if index == RECORDS or len(batch) + len(item) > 480:
+                    check(device.command(COMMAND_BATCH, batch)[0] == 1, 'batch create in /C%02d' % folder)
+                    batch = b''
+                if index < RECORDS:
+                    batch += item
+            device.command(COMMAND_LIST, ('/C%02d\x00' % folder).encode())
+        catalog(device)
+
+        #Built from the folders, on a slow card
+        os.unlink(os.path.join(device.card, '_CATALOG'))
+        device.restart(['-t', '2000,200'])
+        read = device.blocks()[0]
+        start = time.time()
+        built = catalog(device)
+        elapsed = time.time() - start
+        read = device.blocks()[0] - read
+
+        #Decrypted from its file at the next unlock
+        device.restart(['-t', '2000,200'])
+        loaded = catalog(device)
+
+    print('build: %d entries in %d ms (%.1f s seen by the host), %d blocks read' % (
+        ENTRIES, built['catalog_load_ms'], elapsed, read))
+    print('load: %d entries in %d ms' % (ENTRIES, loaded['catalog_load_ms']))
+    check(loaded['catalog_load_ms'] < 300, 'the catalog loads in less than 300 ms')
+    print('test_catalog: ok')
+
+
+if __name__ == '__main__':
+    main()
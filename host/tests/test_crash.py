@@ -0,0 +1,153 @@
+#!/usr/bin/env python3
+"""
+Cuts the power at a sweep of card writes while section updates are
+journaled and folded, then powers the device on again on the same card.
+The vault has to hold the updates of a prefix of the workload, whatever
+write was cut: in the middle of a journal append, of a checkpoint or of
+the writes of its record images. The workload is then sent again and has
+to end in the vault of a run without cut.
+
+The records are compared encrypted. The sections are encrypted without
+iv, so the reference run stores each of them alone in /REF to learn its
+encrypted form.
+"""
+import os
+import shutil
+import sys
+import tempfile
+
+from harness import Device, COMMAND_BATCH, COMMAND_CREATE, COMMAND_LIST, COMMAND_MKDIR, section, check
+
+RECORDS = 12
+ROUNDS = 6
+#Sections of a batch create command, sent after as many single creates
+BATCH = 8
+#Cut points tried, every STEP card writes
+STEP = 13
+
+
+def workload():
+    """The updates, as (path, record type, section type, data)"""
+    updates = []
+    for round_number in range(ROUNDS):
+        for index in range(RECORDS):
+            data = 'r%d-%d' % (index, round_number) + '.' * ((index * 7 + round_number) % 40)
+            updates.append(('/C/R%02d' % index, 1, round_number % 3, data))
+    #The device journals the sections of a batch in path order
+    for start in range(BATCH, len(updates), 2 * BATCH):
+        updates[start:start + BATCH] = sorted(updates[start:start + BATCH])
+    return updates
+
+
+def run(device, updates):
+    """Sends the updates, alternating single and batch creates"""
+    position = 0
+    while position < len(updates):
+        if position % (2 * BATCH) < BATCH:
+            path, record_type, section_type, data = updates[position]
+            reply = device.command(COMMAND_CREATE, section(path, data, record_type, section_type))
+            check(reply == b'\x01', 'create %s' % path)
+            position += 1
+        else:
+            batch = b''.join(section(path, data, record_type, section_type)
+                             for path, record_type, section_type, data in updates[position:position + BATCH])
+            check(device.command(COMMAND_BATCH, batch)[0] == 1, 'batch create at %d' % position)
+            position += BATCH
+    #Folds the end of the journal
+    device.command(COMMAND_LIST, b'/C\x00')
+
+
+def record(record_type, sections):
+    data = bytes([0x42, record_type])
+    for section_type, encrypted in sections:
+        data += bytes([section_type, len(encrypted)]) + encrypted
+    return data
+
+
+def prefixes(updates, encrypted):
+    """Returns the vault after each prefix of the updates, as a dict"""
+    vaults = [{}]
+    records = {}
+    for index, (path, record_type, section_type, _) in enumerate(updates):
+        kind, sections = records.get(path, (record_type, []))
+        sections = list(sections)
+        for position, entry in enumerate(sections):
+            if entry[0] == section_type:
+                sections[position] = (section_type, encrypted[index])
+                break
+        else:
+            sections.append((section_type, encrypted[index]))
+        records[path] = (kind, sections)
+        vaults.append(dict((key, record(*value)) for key, value in records.items()))
+    return vaults
+
+
+def vault(device):
+    return dict((path, data) for path, data in device.export() if path.startswith('/C/'))
+
+
+def main():
+    updates = workload()
+    scratch = tempfile.mkdtemp(prefix='pa55ware-crash-')
+    try:
+        #The card every run starts from, with its manifest already built
+        template = os.path.join(scratch, 'template')
+        with Device(card=template) as device:
+            check(device.command(COMMAND_MKDIR, b'/C\x00') == b'\x01', 'mkdir /C')
+            eeprom = open(device.eeprom, 'rb').read()
+
+        reference_card = os.path.join(scratch, 'reference')
+        shutil.copytree(template, reference_card)
+        with Device(card=reference_card, eeprom=eeprom) as reference:
+            run(reference, updates)
+            final = vault(reference)
+            check(reference.command(COMMAND_MKDIR, b'/REF\x00') == b'\x01', 'mkdir /REF')
+            for index, (_, record_type, section_type, data) in enumerate(updates):
+                reply = reference.command(COMMAND_CREATE, section('/REF/U%03d' % index, data, record_type,
+                                                                  section_type))
+                check(reply == b'\x01', 'create /REF/U%03d' % index)
+            reference.command(COMMAND_LIST, b'/REF\x00')
+            exported = dict(reference.export())
+        #The section data follows the record header and the section header
+        encrypted = [exported['/REF/U%03d' % index][4:] for index in range(len(updates))]
+        vaults = prefixes(updates, encrypted)
+        check(final == vaults[-1], 'the model of the records matches the run without cut')
+
+        cuts = 0
+        partial = 0
+        write = 1
+        while True:
+            card = os.path.join(scratch, 'card')
+            shutil.rmtree(card, ignore_errors=True)
+            shutil.copytree(template, card)
+            with Device(card=card, options=['-k', str(write)], eeprom=eeprom) as device:
+                try:
+                    run(device, updates)
+                except (OSError, RuntimeError, TimeoutError):
+                    device.process.wait(device.timeout)
+                if device.process.poll() is None:
+                    break
+                check(device.process.returncode == 3, 'the host build stopped at write %d: %s' % (
+                    write, device.stderr()))
+                cuts += 1
+
+                device.restart()
+                present = vault(device)
+                check(present in vaults, 'write %d: the vault holds a prefix of the updates' % write)
+                if 0 < vaults.index(present) < len(updates):
+                    partial += 1
+                run(device, updates)
+                check(vault(device) == final, 'write %d: the vault ends as without cut' % write)
+            write += STEP
+            sys.stdout.write('.')
+            sys.stdout.flush()
+    finally:
+        shutil.rmtree(scratch, ignore_errors=True)
+    print('\n%d power cuts over %d card writes, %d of them with part of the updates written' % (
+        cuts, write, partial))
+    check(cuts > 10 and partial > 0, 'the cuts covered the appends and the checkpoints')
+    print('test_crash: ok')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,60 @@
+#!/usr/bin/env python3
+"""
+Runs the v2 protocol over raw HID reports, with the HID build of the host
+(make hid), which carries the 64 bytes reports on its pseudo terminal:
+frames of every size split over reports, the write commands, a listing,
+an export and the loopback test of the transport. No report may be
+dropped. Prints the ping throughput next to that of the CDC build.
+"""
+import time
+
+from harness import Device, COMMAND_BATCH, COMMAND_CREATE, COMMAND_LIST, COMMAND_LOOPBACK, \
+    COMMAND_MKDIR, COMMAND_PING, section, check
+
+#Payload of the largest frame the device takes
+FRAME_MAX = 480
+PINGS = 200
+
+
+def throughput(device, size):
+    """Bytes per second moved by pings of this size, both ways"""
+    start = time.time()
+    for index in range(PINGS):
+        payload = bytes((index + i) & 0xFF for i in range(size))
+        check(device.command(COMMAND_PING, payload) == payload, 'ping of %d bytes' % size)
+    return 2 * size * PINGS / (time.time() - start)
+
+
+def main():
+    with Device(hid=True) as device:
+        #Frames shorter than a report, and split over several of them
+        for size in (0, 1, 55, 56, 57, 62, 63, 64, 126, 200, FRAME_MAX):
+            payload = bytes(i * 7 & 0xFF for i in range(size))
+            check(device.command(COMMAND_PING, payload) == payload, 'ping of %d bytes' % size)
+
+        check(device.command(COMMAND_MKDIR, b'/H\x00') == b'\x01', 'mkdir /H')
+        for index in range(8):
+            reply = device.command(COMMAND_CREATE, section('/H/R%d' % index, 'user%d' % index))
+            check(reply == b'\x01', 'create /H/R%d' % index)
+        batch = b''.join(section('/H/B%d' % index, 'batch%d' % index * 4) for index in range(8))
+        check(device.command(COMMAND_BATCH, batch)[0] == 1, 'batch create')
+        listing = device.command(COMMAND_LIST, b'/H\x00').split()
+        for index in range(8):
+            check(('R%d' % index).encode() in listing and ('B%d' % index).encode() in listing,
+                  'the records are listed')
+        exported = dict(device.export())
+        check(len([path for path in exported if path.startswith('/H/')]) == 16, 'the records are exported')
+
+        reply = device.command(COMMAND_LOOPBACK, b'\xc8')
+        check(reply[:1] == b'\x01', 'the loopback reports come back unchanged')
+        hid = throughput(device, FRAME_MAX)
+        check(device.stats()['hid_failures'] == 0, 'no report was dropped')
+
+    with Device() as device:
+        cdc = throughput(device, FRAME_MAX)
+    print('pings of %d bytes: %.0f bytes/s over HID reports, %.0f bytes/s over CDC' % (FRAME_MAX, hid, cdc))
+    print('test_hid: ok')
+
+
+if __name__ == '__main__':
+    main()
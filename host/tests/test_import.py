@@ -0,0 +1,82 @@
+#!/usr/bin/env python3
+"""
+Imports 1,000 accounts, a username and a password each, on a card whose
+block writes take 2 ms and reads 200 us: once with a create command per
+field (1), once with batch create commands (9), each command waiting for
+its reply as an import tool does. Both devices share their key, and have
+to end with the same vault. Prints the time, the frames and the card
+blocks written of each import. Both write each record once per journal
+checkpoint, so on the host the time is mostly that of the card; on the
+device each frame also costs the USB round trip.
+"""
+import time
+
+from harness import Device, COMMAND_BATCH, COMMAND_CREATE, COMMAND_LIST, COMMAND_MKDIR, section, check
+
+ACCOUNTS = 1000
+FOLDERS = 20
+#Payload of a batch create command
+BATCH_MAX = 480
+
+
+def fields():
+    """The sections of the accounts, as create command payloads"""
+    payloads = []
+    for index in range(ACCOUNTS):
+        path = '/I%02d/A%04d' % (index % FOLDERS, index)
+        payloads.append(section(path, 'user%d@example.com' % index, 1, 0))
+        payloads.append(section(path, 'pass-%08x' % (index * 2654435761 & 0xFFFFFFFF), 1, 1))
+    return payloads
+
+
+def single(device, payloads):
+    for payload in payloads:
+        check(device.command(COMMAND_CREATE, payload) == b'\x01', 'create')
+    return len(payloads)
+
+
+def batched(device, payloads):
+    frames = 0
+    batch = b''
+    for payload in payloads + [None]:
+        if batch and (payload is None or len(batch) + len(payload) > BATCH_MAX):
+            reply = device.command(COMMAND_BATCH, batch)
+            check(reply[0] == 1, 'batch create')
+            frames += 1
+            batch = b''
+        if payload is not None:
+            batch += payload
+    return frames
+
+
+def run(importer, eeprom):
+    """Returns the vault, the time, the frames and the blocks written of an import"""
+    with Device(options=['-t', '2000,200'], eeprom=eeprom) as device:
+        for folder in range(FOLDERS):
+            check(device.command(COMMAND_MKDIR, ('/I%02d\x00' % folder).encode()) == b'\x01', 'mkdir')
+        _, written = device.blocks()
+        start = time.time()
+        frames = importer(device, fields())
+        #The last updates are folded by the listing checkpoints
+        for folder in range(FOLDERS):
+            device.command(COMMAND_LIST, ('/I%02d\x00' % folder).encode())
+        elapsed = time.time() - start
+        written = device.blocks()[1] - written
+        return dict(device.export()), elapsed, frames, written, open(device.eeprom, 'rb').read()
+
+
+def main():
+    old_vault, old_time, old_frames, old_written, eeprom = run(single, None)
+    new_vault, new_time, new_frames, new_written, _ = run(batched, eeprom)
+    for name, elapsed, frames, written in (('create', old_time, old_frames, old_written),
+                                           ('batch', new_time, new_frames, new_written)):
+        print('%s: %d accounts in %.1f s, %.0f accounts/s, %d frames, %d blocks written' % (
+            name, ACCOUNTS, elapsed, ACCOUNTS / elapsed, frames, written))
+    check(len(old_vault) == ACCOUNTS and new_vault == old_vault, 'both imports give the same vault')
+    check(new_frames * 10 < old_frames and new_written <= old_written,
+          'the batch import takes fewer frames and no more card writes')
+    print('test_import: ok')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,26 @@
+#!/usr/bin/env python3
+"""
+Runs the load generator against the host build: pings, then creates in a
+window of frames. Both have to complete without any error.
+"""
+import os
+import subprocess
+import sys
+
+from harness import Device, HOST, check
+
+
+def main():
+    with Device() as device:
+        port = os.path.join(device.directory, 'port')
+        for options in (['-n', '1000', '-s', '200'], ['-n', '300', '-c']):
+            result = subprocess.run([sys.executable, os.path.join(HOST, 'load.py'), port] + options)
+            check(result.returncode == 0, 'load.py %s' % ' '.join(options))
+        device.session()
+        records = device.export()
+        check(len(records) == 300, 'the 300 created records are exported, not %d' % len(records))
+    print('test_load: ok')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,98 @@
+#!/usr/bin/env python3
+"""
+Imports a synthetic vault of 600 accounts with batch create commands, in
+a session with compressed frames (HELLO_PACK) and in one without, then
+lists each folder: the usernames, the URLs and the folder paths of the
+accounts repeat, as in a real vault, and the passwords do not. Both
+devices share their key, and have to end with the same vault. Prints the
+compression ratio of the commands and of the replies, from the stats of
+the device, and the effective throughput of both imports, the payload
+bytes moved per second. On the host the time is mostly that of the card,
+the link of the pseudo terminal having no bandwidth limit.
+"""
+import random
+import time
+
+from harness import Device, COMMAND_BATCH, COMMAND_LIST, COMMAND_MKDIR, section, check
+from load import HELLO_PACK, pack, unpack
+
+FOLDERS = ['MAIL', 'SOCIAL', 'SHOP', 'BANK', 'WORK', 'GAMES']
+SITES = ['google', 'github', 'amazon', 'paypal', 'reddit', 'twitter', 'netflix', 'ebay',
+         'dropbox', 'linkedin', 'spotify', 'yahoo', 'outlook', 'steam', 'slack', 'apple']
+NAMES = ['alice', 'bob', 'carol', 'dave']
+ACCOUNTS = 600
+#Payload of a batch create command
+BATCH_MAX = 480
+
+
+def vault():
+    """The sections of the accounts: username (1), password (2) and URL (3)"""
+    generator = random.Random(45)
+    letters = 'abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789!#%&*+-=?'
+    payloads = []
+    for index in range(ACCOUNTS):
+        site = generator.choice(SITES)
+        name = generator.choice(NAMES)
+        path = '/%s/%s%d' % (FOLDERS[index % len(FOLDERS)], site[:5].upper(), index)
+        password = ''.join(generator.choice(letters) for _ in range(16))
+        payloads.append(section(path, '%s.smith@%s.com' % (name, generator.choice(['gmail', 'example'])), 1, 1))
+        payloads.append(section(path, password, 1, 2))
+        payloads.append(section(path, 'https://www.%s.com/login' % site, 1, 3))
+    return payloads
+
+
+def run(options, eeprom):
+    """Returns the vault, the stats, the time and the payload bytes of an import"""
+    with Device(options=['-t', '2000,200'], eeprom=eeprom) as device:
+        device.session(options)
+        check(device.port.packed == bool(options), 'the session options')
+        for folder in FOLDERS:
+            check(device.command(COMMAND_MKDIR, ('/%s\x00' % folder).encode()) == b'\x01', 'mkdir /%s' % folder)
+        before = device.stats()
+        moved = 0
+        start = time.time()
+        batch = b''
+        for payload in vault() + [None]:
+            if batch and (payload is None or len(batch) + len(payload) > BATCH_MAX):
+                reply = device.command(COMMAND_BATCH, batch)
+                check(reply[0] == 1, 'batch create')
+                moved += len(batch) + len(reply)
+                batch = b''
+            if payload is not None:
+                batch += payload
+        for folder in FOLDERS:
+            listing = device.command(COMMAND_LIST, ('/%s\x00' % folder).encode())
+            check(len(listing.split()) == ACCOUNTS // len(FOLDERS), 'the listing of /%s' % folder)
+            moved += len(folder) + 2 + len(listing)
+        elapsed = time.time() - start
+        after = device.stats()
+        device.session()
+        exported = dict(device.export())
+        stats = dict((name, after[name] - before[name]) for name in after)
+        return exported, stats, elapsed, moved, open(device.eeprom, 'rb').read()
+
+
+def main():
+    #The codec of the host against itself, on the commands of the import
+    for payload in vault()[:60]:
+        check(unpack(pack(payload)) == payload, 'the codec of the host')
+
+    plain, _, plain_time, plain_moved, eeprom = run(b'', None)
+    packed, stats, packed_time, packed_moved, _ = run(bytes([HELLO_PACK]), eeprom)
+    check(len(plain) == ACCOUNTS and packed == plain, 'both imports give the same vault')
+    check(packed_moved == plain_moved, 'both imports move the same payload')
+
+    received = stats['pack_received_raw'] / max(stats['pack_received_wire'], 1)
+    sent = stats['pack_sent_raw'] / max(stats['pack_sent_wire'], 1)
+    print('commands: %d bytes, %d on the link, ratio %.2f' % (
+        stats['pack_received_raw'], stats['pack_received_wire'], received))
+    print('replies: %d bytes, %d on the link, ratio %.2f' % (
+        stats['pack_sent_raw'], stats['pack_sent_wire'], sent))
+    for name, elapsed in (('plain', plain_time), ('compressed', packed_time)):
+        print('%s: %d accounts in %.1f s, %.0f payload bytes/s' % (name, ACCOUNTS, elapsed, plain_moved / elapsed))
+    check(received > 1.3 and sent > 1.2, 'the commands and the listings are compressed')
+    print('test_pack: ok')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,91 @@
+#!/usr/bin/env python3
+"""
+Sends a mixed workload in a window of frames to the host build, on a
+card whose block writes take 2 ms: folders created, records created, and
+the listing and stats reads the host keeps sending meanwhile. The reads
+have to be answered ahead of the writes still queued before them.
+Prints the latency histogram of each kind of command.
+"""
+import time
+
+from harness import Device, COMMAND_CREATE, COMMAND_LIST, COMMAND_MKDIR, COMMAND_STATS, section, check
+from load import FRAME_MORE, FRAME_NAK, FRAME_REPLY
+
+COMMANDS = 400
+WINDOW = 8
+
+
+def command(index):
+    """The kind and the payload of the command at this index"""
+    if index % 8 == 0:
+        return 'mkdir', COMMAND_MKDIR, ('/W/D%03d\x00' % index).encode()
+    if index % 8 in (1, 5):
+        return 'create', COMMAND_CREATE, section('/W/R%03d' % index, 'user%d' % index)
+    if index % 8 in (2, 6):
+        return 'stats', COMMAND_STATS, b''
+    return 'list', COMMAND_LIST, b'/R\x00'
+
+
+def histogram(name, latencies):
+    latencies.sort()
+    print('%s: %d commands, median %.1f ms, 99th %.1f ms' % (
+        name, len(latencies), latencies[len(latencies) // 2] * 1000,
+        latencies[int(len(latencies) * 0.99)] * 1000))
+    buckets = {}
+    for latency in latencies:
+        bucket = 128
+        while bucket < latency * 1000000:
+            bucket *= 2
+        buckets[bucket] = buckets.get(bucket, 0) + 1
+    for bucket in sorted(buckets):
+        print('  < %7d us  %s' % (bucket, buckets[bucket]))
+
+
+def main():
+    with Device(options=['-t', '2000,200']) as device:
+        for path in (b'/W\x00', b'/R\x00'):
+            check(device.command(COMMAND_MKDIR, path) == b'\x01', 'mkdir %s' % path)
+        for index in range(4):
+            check(device.command(COMMAND_CREATE, section('/R/R%d' % index, 'read%d' % index)) == b'\x01',
+                  'create /R/R%d' % index)
+        device.command(COMMAND_LIST, b'/R\x00')
+
+        sent = {}
+        latencies = {}
+        overtaken = 0
+        reads = 0
+        index = 0
+        while index < COMMANDS or sent:
+            while index < COMMANDS and len(sent) < WINDOW:
+                kind, number, payload = command(index)
+                sequence = device.next_sequence()
+                device.port.send(sequence, number, payload)
+                sent[sequence] = (kind, index, time.time())
+                index += 1
+            sequence, reply, _ = device.port.receive()
+            if reply == FRAME_MORE:
+                continue
+            check(reply != FRAME_NAK and sequence in sent, 'reply to a frame in flight')
+            kind, number, start = sent.pop(sequence)
+            check(reply == FRAME_REPLY | command(number)[1], 'reply of a %s command' % kind)
+            latencies.setdefault(kind, []).append(time.time() - start)
+            if kind in ('stats', 'list'):
+                reads += 1
+                #A write sent before this read is still waiting for its reply
+                if any(other[0] in ('mkdir', 'create') and other[1] < number for other in sent.values()):
+                    overtaken += 1
+
+        for kind in ('mkdir', 'create', 'list', 'stats'):
+            histogram(kind, latencies[kind])
+        print('%d of %d reads answered ahead of a queued write' % (overtaken, reads))
+        check(overtaken > reads // 2, 'most reads complete ahead of the queued writes')
+        median = dict((kind, sorted(values)[len(values) // 2]) for kind, values in latencies.items())
+        check(median['stats'] < median['mkdir'] and median['list'] < median['mkdir'],
+              'the reads are answered faster than the folders are created')
+        check(len(device.command(COMMAND_LIST, b'/W\x00').split(b'\n')) > COMMANDS // 4,
+              'the folders and records are all created')
+    print('test_pipeline: ok')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,62 @@
+#!/usr/bin/env python3
+"""
+Compares the raw vault (command 7) with the record files on FAT, on a card
+whose block writes take 2 ms and reads 200 us. The records of a folder are
+created, then each of them is updated, then the vault is exported. Prints
+the records written and read per second, and the card blocks each record
+write and read takes, as counted by the host build.
+"""
+import time
+
+from harness import Device, COMMAND_CREATE, COMMAND_LIST, COMMAND_MKDIR, COMMAND_RAW, section, check
+
+RECORDS = 100
+SLOTS = 120
+
+
+def run(raw):
+    """Returns the figures of the vault, as a dict"""
+    figures = {}
+    with Device(options=['-t', '2000,200']) as device:
+        if raw:
+            check(device.command(COMMAND_RAW, bytes([SLOTS])) == b'\x01', 'the raw vault is created')
+        check(device.command(COMMAND_MKDIR, b'/V\x00') == b'\x01', 'mkdir /V')
+        for index in range(RECORDS):
+            reply = device.command(COMMAND_CREATE, section('/V/R%03d' % index, 'user%d' % index))
+            check(reply == b'\x01', 'create /V/R%03d' % index)
+        device.command(COMMAND_LIST, b'/V\x00')
+
+        #Updates, folded by the listing checkpoint
+        stats = device.stats()
+        _, written = device.blocks()
+        for index in range(RECORDS):
+            reply = device.command(COMMAND_CREATE, section('/V/R%03d' % index, 'pass%d' % index, 1, 1))
+            check(reply == b'\x01', 'update /V/R%03d' % index)
+        device.command(COMMAND_LIST, b'/V\x00')
+        after = device.stats()
+        stores = after['record_stores'] - stats['record_stores']
+        figures['writes'] = stores * 1000000.0 / max(1, after['record_store_us'] - stats['record_store_us'])
+        figures['written'] = (device.blocks()[1] - written) / float(RECORDS)
+
+        read, _ = device.blocks()
+        start = time.time()
+        records = [path for path, _ in device.export() if path.startswith('/V/')]
+        figures['reads'] = RECORDS / (time.time() - start)
+        figures['read'] = (device.blocks()[0] - read) / float(RECORDS)
+        check(len(records) == RECORDS, 'the records are exported')
+    return figures
+
+
+def main():
+    fat = run(False)
+    raw = run(True)
+    for name, figures in (('fat', fat), ('raw', raw)):
+        print('%s: %.0f record writes/s, %.1f blocks written each, %.0f records exported/s, %.1f blocks read each' % (
+            name, figures['writes'], figures['written'], figures['reads'], figures['read']))
+    check(raw['written'] < fat['written'], 'a record write takes fewer blocks in the raw vault')
+    check(raw['read'] <= fat['read'], 'a record read takes no more blocks in the raw vault')
+    print('test_raw: ok')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,65 @@
+#!/usr/bin/env python3
+"""
+Syncs a 2,004 record database to the host build with the reference
+client, sync.py. The digests of the device have to match those computed
+from the export of the vault. After 3 records changed in the database,
+the next sync has to push only them and move a few kilobytes, and a
+record created on the device has to be reported by the following one.
+"""
+import sys
+
+from harness import Device, HOST, COMMAND_CREATE, COMMAND_DIGESTS, section, check
+
+sys.path.insert(0, HOST)
+from sync import sync, tree_digests, own  # noqa: E402
+
+FOLDERS = 40
+RECORDS = 50
+
+
+def main():
+    database = {}
+    for folder in range(FOLDERS):
+        for index in range(RECORDS):
+            database['/F%02d/R%03d' % (folder, index)] = {
+                'type': 1, 'sections': {'0': 'user%d.%d' % (folder, index), '1': 'pass%d' % index}}
+    #Nested folders, whose digests are computed down the subtree
+    for path in ('/N/R000', '/N/A/R000', '/N/A/B/C/R000', '/N/A/B/C/R001'):
+        database[path] = {'type': 1, 'sections': {'0': path}}
+    records = len(database)
+
+    with Device() as device:
+        client, state = sync(device.command, database, {})
+        print('first sync: %d records pushed, %d bytes moved' % (len(client.pushed), client.moved))
+        check(len(client.pushed) == records, 'the first sync pushes every record')
+
+        #The digests of the device, against those of the exported records
+        reference = tree_digests(dict(device.export()))
+        for folder in ['/', '/N', '/N/A/B'] + ['/F%02d' % index for index in range(FOLDERS)]:
+            reply = device.command(COMMAND_DIGESTS, folder.encode() + b'\x00')
+            check(reply[1:33] == reference[own(folder)], 'the digest of %s' % folder)
+            check(state['digests'][own(folder)] == reply[1:33].hex(), 'the digest of %s is kept' % folder)
+        check(all(state['digests'][path] == digest.hex() for path, digest in reference.items()),
+              'the digests of the entries are kept')
+
+        for path in ('/F03/R007', '/F17/R020', '/F31/R049'):
+            database[path]['sections']['1'] = 'changed'
+        client, state = sync(device.command, database, state)
+        print('3 records changed: %d records pushed, %d bytes moved' % (len(client.pushed), client.moved))
+        check(client.pushed == ['/F03/R007', '/F17/R020', '/F31/R049'], 'only the changed records are pushed')
+        check(client.changed == [], 'no record changed on the device')
+        check(client.moved < 16 * 1024, 'the sync moves kilobytes')
+        reference = tree_digests(dict(device.export()))
+        check(all(state['digests'][path] == digest.hex() for path, digest in reference.items()),
+              'the digests are up to date after the sync')
+
+        reply = device.command(COMMAND_CREATE, section('/F05/X001', 'device'))
+        check(reply == b'\x01', 'create /F05/X001')
+        client, state = sync(device.command, database, state)
+        print('1 record created on the device: %d bytes moved' % client.moved)
+        check(client.pushed == [] and client.changed == ['/F05/X001'], 'the new record is reported')
+    print('test_sync: ok')
+
+
+if __name__ == '__main__':
+    main()
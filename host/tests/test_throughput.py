@@ -0,0 +1,90 @@
+#!/usr/bin/env python3
+"""
+Measures the throughput of record creates on the host build, on a card
+whose block writes take 2 ms: sent one at a time, each waiting for its
+reply, then in a window of frames, so that the next frames are received
+while the pipeline encrypts and writes the previous ones. Prints the
+records and bytes per second of both, and the occupancy of each stage of
+the pipeline, from the stats of the device.
+
+The host build runs the card in the same thread as the stages, so the
+window only hides the round trip of the host there, and the card time
+bounds both: the window must not be slower, and must keep the receive
+ring and the encrypt stage busy.
+"""
+import time
+
+from harness import Device, COMMAND_CREATE, COMMAND_MKDIR, section, check
+from load import FRAME_MORE, FRAME_NAK, FRAME_REPLY
+
+RECORDS = 300
+WINDOW = 8
+
+
+def creates(device, folder, window):
+    """Creates RECORDS records in folder, window frames in flight. Returns the bytes sent"""
+    check(device.command(COMMAND_MKDIR, folder.encode() + b'\x00') == b'\x01', 'mkdir %s' % folder)
+    sent = set()
+    size = 0
+    index = 0
+    while index < RECORDS or sent:
+        while index < RECORDS and len(sent) < window:
+            payload = section('%s/R%03d' % (folder, index), 'user%d@example.com' % index)
+            sequence = device.next_sequence()
+            device.port.send(sequence, COMMAND_CREATE, payload)
+            sent.add(sequence)
+            size += len(payload)
+            index += 1
+        sequence, reply, payload = device.port.receive()
+        if reply == FRAME_MORE:
+            continue
+        check(reply != FRAME_NAK and sequence in sent, 'reply to a frame in flight')
+        check(reply == FRAME_REPLY | COMMAND_CREATE and payload == b'\x01', 'create in %s' % folder)
+        sent.remove(sequence)
+    return size
+
+
+def idle(device):
+    """Waits for the idle verifier of the boot to stop reading the card"""
+    last = None
+    while True:
+        time.sleep(1)
+        read = device.blocks()[0]
+        if read == last:
+            return
+        last = read
+
+
+def main():
+    results = []
+    #Each on a new card, the card being idle
+    for window in (1, WINDOW):
+        with Device(options=['-t', '2000,200']) as device:
+            check(device.command(COMMAND_MKDIR, b'/T\x00') == b'\x01', 'mkdir /T')
+            idle(device)
+            before = device.stats()
+            start = time.time()
+            size = creates(device, '/T/W%d' % window, window)
+            elapsed = time.time() - start
+            after = device.stats()
+            delta = dict((name, after[name] - before[name]) for name in after)
+            results.append((window, RECORDS / elapsed, size / elapsed, delta))
+
+    for window, records, rate, delta in results:
+        samples = max(delta['pipe_samples'], 1)
+        print('window %d: %.0f records/s, %.0f bytes/s' % (window, records, rate))
+        print('  receive ring %.1f bytes, encrypt stage %.2f slots, write stage %.2f slots, %d stalls' % (
+            delta['pipe_receive'] / samples, delta['pipe_encrypt'] / samples,
+            delta['pipe_write'] / samples, delta['pipe_stalls']))
+    sequential, pipelined = results[0][3], results[1][3]
+    check(pipelined['pipe_receive'] > 0, 'frames are received while the pipeline runs')
+    check(pipelined['pipe_encrypt'] * sequential['pipe_samples'] >=
+          sequential['pipe_encrypt'] * pipelined['pipe_samples'],
+          'the encrypt stage is busier with a window of frames')
+    check(pipelined['pipe_stalls'] > 0, 'the window fills the pipeline')
+    check(results[1][1] > results[0][1] * 0.9, 'the window of frames creates the records as fast')
+    print('test_throughput: ok')
+
+
+if __name__ == '__main__':
+    main()
@@ -75,12 +75,14 @@ void Sha1Class::addUncounted(uint8_t data) {
 size_t Sha1Class::write(uint8_t data) {
   ++byteCount;
   addUncounted(data);
+  return 1;
 }
 
 size_t Sha1Class::write(uint8_t* data, int length) {
     for (int i=0; i<length; i++) {
         write(data[i]);
     }
+    return length;
 }
 
 void Sha1Class::pad() {
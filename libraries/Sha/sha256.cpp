@@ -90,6 +90,24 @@ void Sha256Class::addUncounted(uint8_t data) {
 size_t Sha256Class::write(uint8_t data) {
   ++byteCount;
   addUncounted(data);
+  return 1;
+}
+
+size_t Sha256Class::write(const uint8_t* data, size_t length) {
+  byteCount += length;
+  for (size_t i=0; i<length;) {
+    if (bufferOffset == 0 && length - i >= BUFFER_SIZE) {
+      // Whole block, loaded a word at a time
+      for (int w=0; w<BUFFER_SIZE/4; w++, i+=4) {
+        buffer.w[w] = ((uint32_t)data[i] << 24) | ((uint32_t)data[i+1] << 16) |
+                      ((uint32_t)data[i+2] << 8) | data[i+3];
+      }
+      hashBlock();
+    } else {
+      addUncounted(data[i++]);
+    }
+  }
+  return length;
 }
 
 void Sha256Class::pad() {
@@ -133,24 +151,21 @@ uint8_t* Sha256Class::result(void) {
 #define HMAC_IPAD 0x36
 #define HMAC_OPAD 0x5c
 
-uint8_t keyBuffer[BLOCK_LENGTH]; // K0 in FIPS-198a
-uint8_t innerHash[HASH_LENGTH];
-
 void Sha256Class::initHmac(const uint8_t* key, int keyLength) {
   uint8_t i;
-  memset(keyBuffer,0,BLOCK_LENGTH);
-  if (keyLength > BLOCK_LENGTH) {
+  memset(keyBuffer,0,SHA256_BLOCK_LENGTH);
+  if (keyLength > SHA256_BLOCK_LENGTH) {
     // Hash long keys
     init();
     for (;keyLength--;) write(*key++);
-    memcpy(keyBuffer,result(),HASH_LENGTH);
+    memcpy(keyBuffer,result(),SHA256_HASH_LENGTH);
   } else {
     // Block length keys are used as is
     memcpy(keyBuffer,key,keyLength);
   }
   // Start inner hash
   init();
-  for (i=0; i<BLOCK_LENGTH; i++) {
+  for (i=0; i<SHA256_BLOCK_LENGTH; i++) {
     write(keyBuffer[i] ^ HMAC_IPAD);
   }
 }
@@ -158,11 +173,11 @@ void Sha256Class::initHmac(const uint8_t* key, int keyLength) {
 uint8_t* Sha256Class::resultHmac(void) {
   uint8_t i;
   // Complete inner hash
-  memcpy(innerHash,result(),HASH_LENGTH);
+  memcpy(innerHash,result(),SHA256_HASH_LENGTH);
   // Calculate outer hash
   init();
-  for (i=0; i<BLOCK_LENGTH; i++) write(keyBuffer[i] ^ HMAC_OPAD);
-  for (i=0; i<HASH_LENGTH; i++) write(innerHash[i]);
+  for (i=0; i<SHA256_BLOCK_LENGTH; i++) write(keyBuffer[i] ^ HMAC_OPAD);
+  for (i=0; i<SHA256_HASH_LENGTH; i++) write(innerHash[i]);
   return result();
 }
 Sha256Class Sha256;
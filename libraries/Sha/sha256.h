@@ -4,16 +4,17 @@
 #include <inttypes.h>
 #include "Print.h"
 
-#define HASH_LENGTH 32
-#define BLOCK_LENGTH 64
+// Prefixed names, so that sha1.h and sha256.h can be used together
+#define SHA256_HASH_LENGTH 32
+#define SHA256_BLOCK_LENGTH 64
 
-union _buffer {
-  uint8_t b[BLOCK_LENGTH];
-  uint32_t w[BLOCK_LENGTH/4];
+union _buffer256 {
+  uint8_t b[SHA256_BLOCK_LENGTH];
+  uint32_t w[SHA256_BLOCK_LENGTH/4];
 };
-union _state {
-  uint8_t b[HASH_LENGTH];
-  uint32_t w[HASH_LENGTH/4];
+union _state256 {
+  uint8_t b[SHA256_HASH_LENGTH];
+  uint32_t w[SHA256_HASH_LENGTH/4];
 };
 
 class Sha256Class : public Print
@@ -24,18 +25,19 @@ class Sha256Class : public Print
     uint8_t* result(void);
     uint8_t* resultHmac(void);
     virtual size_t  write(uint8_t);
+    virtual size_t write(const uint8_t* data, size_t length);
     using Print::write;
   private:
     void pad();
     void addUncounted(uint8_t data);
     void hashBlock();
     uint32_t ror32(uint32_t number, uint8_t bits);
-    _buffer buffer;
+    _buffer256 buffer;
     uint8_t bufferOffset;
-    _state state;
+    _state256 state;
     uint32_t byteCount;
-    uint8_t keyBuffer[BLOCK_LENGTH];
-    uint8_t innerHash[HASH_LENGTH];
+    uint8_t keyBuffer[SHA256_BLOCK_LENGTH];
+    uint8_t innerHash[SHA256_HASH_LENGTH];
 };
 extern Sha256Class Sha256;
 
@@ -8,6 +8,7 @@
 
 #include <sha1.h> //From cryptosuite https://github.com/Cathedrow/Cryptosuite.git
                   //Patched with http://bazaar.launchpad.net/~chuck-bell/mysql-arduino/trunk/view/head:/sha1.diff
+#include <sha256.h>
 
 
 
@@ -15,17 +16,56 @@
   EEPROM contents
   [0] - Failed attempts on lockscreen
   [1 - KEYBITS/8] - AES key
+  [MRU_OFFSET - ...] - MRU_SLOTS recently used or favourite records,
+                       MRU_ENTRY bytes each :
+    [0] - Flags. MRU_USED, MRU_FAVOURITE
+    [1] - Reserved
+    [2 - 3] - Last use stamp, little endian. Highest is the most recent
+    [4 - 7] - Path hash, little endian, to check the entry
+    [8 - MRU_ENTRY-1] - Path of the record, null padded
 */
 
 
 /*
   Defines
 */
+//Board tier. The defaults below are sized for the 64KB of RAM of the
+// Teensy 3.1 and 3.2. The Teensy 3.0 only has 16KB, shared with the core,
+// the USB and SD buffers and the stack, so its buffers are smaller
+#if defined(__MK20DX128__)
+#define CACHE_SLOTS 2
+#define CATALOG_MAX 64
+#define EXPORT_CHUNK 128
+#define RAW_SLOTS_MAX 64
+#define DIGEST_SLOTS 4
+#define RECEIVE_SIZE 128
+#define LOOPBACK_PACKETS 2
+#define FRAME_MAX 256
+#define BLOOM_MAX 256
+#endif
+
 // All user actions. Related to buttons
 #define ACTION_UP 0
 #define ACTION_DOWN 1
 #define ACTION_BACK 2
 #define ACTION_ENTER 3
+//Flag added to an action when its button is held down
+#define ACTION_LONG 4
+//Action returned when the vault changed under the menu, which has to be
+// drawn again
+#define ACTION_REDRAW 8
+
+//Time in ms a button has to be held down for a long press
+#define LONG_PRESS 700
+//Time in ms the buttons are ignored after a press, as in readButtons()
+#define DEBOUNCE 300
+
+//Recently used records list in EEPROM
+#define MRU_OFFSET 64
+#define MRU_SLOTS 8
+#define MRU_ENTRY (8 + PATH_LENGTH)
+#define MRU_USED 0x01
+#define MRU_FAVOURITE 0x02
 
 //Unlocking sequence length
 #define PASS_LENGTH 1
@@ -36,193 +76,5405 @@
 //Length of the AES key
 #define KEYBITS 256
 
+//Maximum length of a field value. Fields are stored rounded up to the
+// AES block size, so this has to be a multiple of N_BLOCK
+#define FIELD_MAX 64
+
+//Maximum size of a record file (header and all its sections)
+#define RECORD_MAX 384
+
+//Maximum length of a path on the SD card
+#define PATH_LENGTH 64
+
+//Chip select pin of the SD card
+#define SD_CHIP_SELECT 6
+
+//Size of a block on the SD card
+#define BLOCK_SIZE 512
+//Number of blocks kept in the read cache. Each slot uses BLOCK_SIZE bytes
+// of RAM. Browsing a folder is served from the cache as long as its
+// directory fits, which is 16 entries per block
+#ifndef CACHE_SLOTS
+#define CACHE_SLOTS 4
+#endif
+
+//Number of resolved paths kept in the path cache
+#define PATH_CACHE_SLOTS 8
+//Open mode replacing the contents of a file. FILE_WRITE appends, and a
+// shorter record would leave stale bytes at the end of the old one
+#define FILE_REWRITE (O_RDWR | O_CREAT | O_TRUNC)
+//Number of decrypted record headers kept in the prefetch cache. Holds the
+// selected entry and the entries just above and below it
+#define PREFETCH_SLOTS 3
+
+//Name of the sorted index file of a folder. The vault metadata files are
+// not listed, see vaultFile()
+#define INDEX_NAME "_INDEX"
+//Size of the index file header and of each index entry
+#define INDEX_HEADER 128
+#define INDEX_ENTRY 16
+//Number of entries indexBuild() sorts in RAM. The entries of larger
+// folders past this number are inserted one by one
+#define INDEX_SORT_MAX 128
+//Flag of the index build references pointing to a raw vault slot
+#define INDEX_RAW 0x8000
+//Number of first character buckets in the index prefix table
+#define INDEX_BUCKETS 62
+
+//Path of the encrypted catalog of the whole vault
+#define CATALOG_NAME "/_CATALOG"
+//Size of a catalog entry
+#define CATALOG_ENTRY 16
+//Maximum number of entries of the catalog. The whole catalog is held in
+// RAM while the device is unlocked, using CATALOG_ENTRY bytes per entry
+// plus 2 bytes for the folder view, 36KB for a 2,000 entries vault on the
+// Teensy 3.1 and 3.2. The Teensy 3.0 tier keeps a small one. Bigger
+// vaults are browsed from the folder indexes instead
+#ifndef CATALOG_MAX
+#define CATALOG_MAX 2000
+#endif
+//Parent of the entries at the root of the vault
+#define CATALOG_ROOT 0xFFFF
+//Catalog header flag for a vault that outgrew the catalog
+#define CATALOG_OVER 1
+//Number of entries added to the catalog per build step
+#define CATALOG_STEP 4
+//States of the catalog build, besides the catalog position of the folder
+// being walked, -1 for the root
+#define CATALOG_BUILD_IDLE -2
+#define CATALOG_BUILD_RAW -3
+
+//Path of the write-ahead journal of record updates
+#define JOURNAL_NAME "/_JOURNAL"
+//Number of journal entries written before the journal is flushed
+#define JOURNAL_BATCH 16
+//Number of journal entries after which they are folded in the records
+#define JOURNAL_CHECKPOINT 64
+//Time in ms without command after which the journal is folded
+#define JOURNAL_IDLE 500
+//Maximum number of sections written by a batch create command
+#define BATCH_MAX 64
+
+//Folder receiving the records of a folder while it is compacted, and file
+// holding the progress of the compaction
+#define COMPACT_DIR "/_COMPACT"
+#define COMPACT_STATE "/_COMPACT/_STATE"
+//Number of records moved by each compaction slice
+#define COMPACT_SLICE 8
+//Phases of a compaction
+#define COMPACT_OUT 1
+#define COMPACT_BACK 2
+
+//Size of the chunks of the export stream. Two of them are buffered
+#ifndef EXPORT_CHUNK
+#define EXPORT_CHUNK 256
+#endif
+//Time in ms after which an export the host does not read is abandoned
+#define EXPORT_TIMEOUT 2000
+
+//Name of the preallocated file holding the raw vault, at the root of the
+// card. Once it exists, records are stored in its blocks instead of files
+#define RAW_NAME "_RAWVLT"
+//Maximum number of slots of the raw vault, one block each. The slots of a
+// bigger raw vault past this number are not used
+#ifndef RAW_SLOTS_MAX
+#define RAW_SLOTS_MAX 128
+#endif
+//Size of a raw vault slot header, the record follows it in the block
+#define RAW_HEADER 128
+
+//Name of the Bloom filter file of a folder
+#define BLOOM_NAME "_BLOOM"
+//Bits of a Bloom filter per entry of its folder. With BLOOM_HASHES hash
+// functions, 10 bits per entry give less than 2% of false positives
+#define BLOOM_BITS 10
+#define BLOOM_HASHES 3
+//Smallest and largest size in bytes of the bit array of a Bloom filter.
+// A filter is sized for twice the entries of its folder, and built again
+// twice as big once the folder outgrows it. Past BLOOM_MAX bytes the
+// false positives go up, 5% at 2,500 entries with 2KB
+#define BLOOM_MIN 32
+#ifndef BLOOM_MAX
+#define BLOOM_MAX 2048
+#endif
+//Size in bytes of the header of a Bloom filter file
+#define BLOOM_HEADER 6
+
+//Path of the manifest of the vault, a hash tree of all the records
+#define MANIFEST_NAME "/_MANIFST"
+//Number of leaves hashed together in a manifest group
+#define MANIFEST_FANOUT 16
+//Number of leaves of the manifest, one per record. The records past this
+// number are not covered by the manifest
+#define MANIFEST_LEAVES 2048
+#define MANIFEST_GROUPS (MANIFEST_LEAVES / MANIFEST_FANOUT)
+//Size of a manifest leaf, the record hash followed by its path
+#define MANIFEST_LEAF (SHA256_HASH_LENGTH + PATH_LENGTH)
+//Size of the manifest file header
+#define MANIFEST_HEADER 64
+//Time in ms between two records checked by the idle verifier
+#define VERIFY_INTERVAL 20
+//Number of folder digests kept in RAM for the sync
+#ifndef DIGEST_SLOTS
+#define DIGEST_SLOTS 8
+#endif
+
+//Size of the ring receiving the serial bytes while commands run
+#ifndef RECEIVE_SIZE
+#define RECEIVE_SIZE 256
+#endif
+//Transports of the management commands. USB serial, raw HID reports when
+// the USB type has a raw HID interface, and a loopback to test the packet
+// path. The passwords are typed with the keyboard interface, so the raw
+// HID transport needs a USB type with both, such as "All of the above"
+// (USB_EVERYTHING), or a custom type in the core usb_desc.h defining
+// KEYBOARD_INTERFACE and RAWHID_INTERFACE. The plain "Raw HID" type has no
+// keyboard
+#define TRANSPORT_CDC 0
+#define TRANSPORT_HID 1
+#define TRANSPORT_LOOPBACK 2
+//Size of the transport packets, the USB full speed packet and HID report
+// size
+#define TRANSPORT_PACKET 64
+//Number of times a raw HID report is sent before it is dropped
+#define HID_SEND_TRIES 3
+//Number of packets queued by the loopback transport
+#ifndef LOOPBACK_PACKETS
+#define LOOPBACK_PACKETS 4
+#endif
+//Number of write commands queued in the pipeline. The host can send
+// more commands only once one of them is written
+#define PIPE_SLOTS 4
+//States of a pipeline slot. Received, ready for the write stage, and
+// invalid, only answered with a \x00
+#define PIPE_RECEIVED 1
+#define PIPE_READY 2
+#define PIPE_INVALID 3
+
+//Number of latency buckets of the load metrics, and bits dropped from a
+// latency in us before it is bucketed
+#define METRICS_BUCKETS 16
+#define METRICS_SHIFT 6
+
+//Serial protocol v2 frames
+#define FRAME_SOF 0xA5
+//Maximum payload length of a frame. The received frame and the reply
+// being built each use this much RAM
+#ifndef FRAME_MAX
+#define FRAME_MAX 512
+#endif
+//Number of frames the host can send before waiting for their replies
+#define FRAME_WINDOW 8
+//Time in ms to wait for each byte of a frame
+#define FRAME_TIMEOUT 100
+//Flag of the frame length field for a compressed payload
+#define FRAME_PACKED 0x8000
+//Session options of FRAME_HELLO. Compressed frames
+#define HELLO_PACK 0x01
+//Window of the frame compression, and shortest and longest back references
+#define PACK_WINDOW 256
+#define PACK_MATCH_MIN 3
+#define PACK_MATCH_MAX (PACK_MATCH_MIN + 255)
+//Frame commands
+#define FRAME_HELLO 0x00
+#define FRAME_REPLY 0x80
+#define FRAME_MORE 0xFE
+#define FRAME_NAK 0xFF
+
+//Sources of the current folder listing
+#define LIST_DIRECTORY 0
+#define LIST_INDEX 1
+#define LIST_CATALOG 2
+
+#if RECORD_MAX > BLOCK_SIZE
+#error "A record has to fit in a single cache block"
+#endif
+#if MANIFEST_LEAVES % (MANIFEST_FANOUT * 8)
+#error "The manifest groups have to cover all the leaves, and fill bytes of flags"
+#endif
+#if RAW_HEADER + RECORD_MAX > BLOCK_SIZE
+#error "A record has to fit in a raw vault slot"
+#endif
+
+//Number of entries sent by each binary listing command
+#define LIST_PAGE 16
+//Listing cursors of the records of the raw vault, which have no directory
+// entry. The cursor is the slot number with this flag
+#define LIST_CURSOR_RAW 0x80000000
+//Listing cursor after the last entry
+#define LIST_CURSOR_END 0xFFFFFFFF
+
+//Types of directory entries returned by readDirEntry()
+#define ENTRY_END 0
+#define ENTRY_SKIP 1
+#define ENTRY_FILE 2
+#define ENTRY_FOLDER 3
+
+/*
+  Catalog file contents, encrypted with the AES key as a single CBC stream
+  [0] - 'C'
+  [1] - CATALOG_OVER if the vault has more entries than the catalog of
+        the board that wrote it can hold. No entries follow
+  [2 - 3] - Number of entries, little endian
+  [4 - 5] - With CATALOG_OVER, the CATALOG_MAX of that board
+  [6 - 15] - Reserved
+  Then the entries, CATALOG_ENTRY bytes each :
+  [0 - 11] - 8.3 name, null padded
+  [12 - 13] - Position of the parent folder in the catalog, little endian.
+              CATALOG_ROOT for the entries at the root of the vault
+  [14] - ENTRY_FILE or ENTRY_FOLDER
+  [15] - Tag. The record type of a file (second byte of the record)
+*/
+
+/*
+  Journal file contents, a sequence of entries :
+  [0] - Entry type. 'S' for a section update, 'R' for a full record image
+        and 'E' once all the record images of a checkpoint are written
+  [1] - Path length
+  [2] - Record type for a section update, 1 for a record image of a new
+        record
+  [3] - Section type for a section update
+  [4 - 5] - Data length, little endian
+  Then the path and the data, followed by the CRC-16 of the entry
+*/
+
+/*
+  Compaction state file contents
+  [0] - COMPACT_OUT while the records are moved out of the folder,
+        COMPACT_BACK once the folder has been recreated
+  [1 - 4] - Number of bytes moved so far, little endian
+  [5 - 8] - Time in us to scan the folder before the compaction, little
+            endian
+  [9] - Path length
+  Then the path of the folder
+*/
+
+/*
+  Raw vault slot contents, one BLOCK_SIZE block each
+  [0] - 'V'
+  [1] - 1 if the slot holds a record, 0 if it is free
+  [2 - 3] - Record length, little endian
+  [4 - 7] - Write sequence number, little endian. If a record is found in
+            two slots after a power loss, the highest one is kept
+  [8 - 11] - Number of writes of the slot, little endian
+  [12 - 15] - Path hash of the record, little endian
+  [16] - Path length
+  [17 - 80] - Path of the record
+  [RAW_HEADER - BLOCK_SIZE-1] - The record
+*/
+
+/*
+  Serial protocol v2 frame. A v1 command never starts with FRAME_SOF
+  [0] - FRAME_SOF
+  [1] - Sequence number. A reply has the sequence number of its command
+  [2] - Command. FRAME_REPLY | command for the reply of a command, or
+        FRAME_MORE for a part of a reply too long for a single frame.
+        FRAME_NAK asks the host to send again from the sequence number
+        given as payload. FRAME_HELLO starts a session at its sequence
+        number. Its payload is the HELLO_* options the host asks for, and
+        its reply gives the protocol version, FRAME_WINDOW, FRAME_MAX on
+        2 bytes and the options accepted for the session
+  [3 - 4] - Payload length, little endian, up to FRAME_MAX. FRAME_PACKED
+            is added when the payload is compressed
+  Then the payload, and the CRC-16 of bytes 1 to the end of the payload,
+  little endian. The payload of a command is the data of the same v1
+  command, and the payload of its reply is what the v1 command sends
+*/
+
+/*
+  Raw HID report, for the raw HID and loopback transports. Both protocols
+  are carried as a byte stream over the reports
+  [0] - Length of the data, up to TRANSPORT_PACKET-1
+  [1 - ...] - Data, then zeroes up to TRANSPORT_PACKET bytes
+*/
+
+/*
+  Compressed frame payload, in a session with HELLO_PACK. LZSS with a
+  PACK_WINDOW bytes window, each frame compressed on its own. It is made
+  of groups of a flags byte followed by up to 8 items. Bit i of the flags,
+  from the lowest, tells whether item i is :
+  1 - A literal byte
+  0 - A back reference on 2 bytes, the distance minus 1 and the length
+      minus PACK_MATCH_MIN. The bytes are copied one at a time, so the
+      length can be more than the distance
+  A frame is only sent compressed when this makes it shorter
+*/
+
+/*
+  Export stream. Each record of the vault, as stored on the card :
+  [0] - Path length
+  [1 - ...] - Path
+  Then the record length, little endian on 2 bytes, and the record.
+  It is sent in chunks of up to EXPORT_CHUNK bytes :
+  [0 - 3] - Offset of the chunk in the stream, little endian
+  [4 - 5] - Chunk length, little endian
+  Then the chunk, and the CRC-16 of the offset, length and chunk, little
+  endian. The last chunk is empty, its offset is the stream length.
+  When the host reads nothing for EXPORT_TIMEOUT ms, the export stops
+  without the empty chunk, and is resumed from the offset of the first
+  chunk missing
+*/
+
+/*
+  Sync digests, SHA-256 hashes the host compares with the ones it got at
+  the last sync to find the records changed on the device
+  Record digest - SHA-256 of the record as stored on the card, the
+                  manifest leaf
+  Entry digest - SHA-256 of the entry type, the name length, the name and
+                 the record or folder digest
+  Folder digest - SHA-256 of the XOR of the digests of its entries, so
+                  that it does not depend on the order of the directory
+*/
+
+/*
+  Manifest file contents
+  [0] - 'M'
+  [1] - Reserved
+  [2 - 3] - Number of leaves in use, little endian
+  [4 - 35] - Root of the tree. HMAC-SHA-256 of the group hashes, keyed
+             with the AES key
+  [36 - MANIFEST_HEADER-1] - Reserved
+  Then MANIFEST_GROUPS group hashes, SHA-256 of the MANIFEST_FANOUT leaves
+  of each group. Then MANIFEST_LEAVES leaves, MANIFEST_LEAF bytes each :
+  [0 - 31] - SHA-256 of the record
+  [32 - MANIFEST_LEAF-1] - Path of the record, null padded. All zeroes
+                           for a free leaf
+  A record has the first free leaf from its path hash modulo
+  MANIFEST_LEAVES, so that the leaves do not depend on the catalog
+*/
+
+/*
+  Bloom filter file contents
+  [0] - 'B'
+  [1] - Number of hash functions
+  [2 - 3] - Size of the bit array in bytes, little endian
+  [4 - 5] - Number of entries added to the filter, little endian
+  Then the bit array, holding the path hashes of the entries of the
+  folder. Vault metadata files are not part of the filter. The filter is
+  trusted as it is, so the _BLOOM file of a folder changed on a computer
+  has to be removed for the filter to be built again
+*/
+
+/*
+  Index file contents
+  [0] - 'I'
+  [1] - Reserved
+  [2 - 3] - Number of entries, little endian
+  [4 - INDEX_HEADER-1] - Prefix table. Position of the first entry in
+                         each first character bucket, see indexBucket()
+  Then the entries, sorted by name, INDEX_ENTRY bytes each :
+  [0 - 12] - Null terminated 8.3 name
+  [13] - ENTRY_FILE or ENTRY_FOLDER
+  [14 - 15] - Reserved
+*/
+
+/*
+  Globals
+*/
+//INPUTS contains the pin numbers associated with the touch input buttons
+//  Order is UP, DOWN, BACK, ENTER
+int INPUTS[] = {16,15,17,18};
+//THRESHOLDS contains the threshold value to consider a touch button "pressed"
+int THRESHOLDS[] = {510,520,590,730};
+//BUTTON_RELEASED contains the time of the last release seen by readButtonsHold()
+uint32_t BUTTON_RELEASED = 0;
+
+//MENU_LINES contains the number of lines to be displayed in a single screen
+const int MENU_LINES = 10;
+//CURRENT_DIR contains the current directory on the SD card
+File CURRENT_DIR;
+//CURRENT_PATH contains the path of CURRENT_DIR
+char CURRENT_PATH[PATH_LENGTH] = "/";
+//CURRENT_INDEX contains the sorted index of CURRENT_DIR, if it has one
+File CURRENT_INDEX;
+//INDEX_KEY and INDEX_CHECK contain the path hash and check of CURRENT_INDEX
+uint32_t INDEX_KEY = 0;
+uint32_t INDEX_CHECK = 0;
+//INDEX_COUNT contains the number of entries of CURRENT_INDEX, -1 if
+// CURRENT_DIR has no index and is listed in directory order
+int INDEX_COUNT = -1;
+//INDEX_TABLE contains the prefix table of CURRENT_INDEX
+uint16_t INDEX_TABLE[INDEX_BUCKETS] = {0};
+//LIST_SOURCE tells where the entries of CURRENT_DIR are listed from
+int LIST_SOURCE = LIST_DIRECTORY;
+//LIST_COUNT contains the number of entries of CURRENT_DIR, -1 if unknown
+int LIST_COUNT = -1;
+//LIST_ENTRY and LIST_SLOT remember the last entry found by listEntry() in
+// CURRENT_DIR and its directory slot, so that reading entries in order
+// does not scan the directory from the start each time
+int LIST_ENTRY = 0;
+int LIST_SLOT = 0;
+//CURRENT_POSITION defines the current position in the menu
+int CURRENT_POSITION = 0;
+
+//Initializes the LCD display
+Teensy3_ST7735 tft = Teensy3_ST7735(10, 9, 8);
+
+//PASSWORD contains the lock screen password
+int PASSWORD[PASS_LENGTH] = {0};
+
+//KEY defines the AES key to use
+byte KEY[KEYBITS/8] = {0};
+//CIPHER contains the AES key schedule, computed once at unlock
+AES CIPHER;
+//CLEARTEXT is the buffer used to store the unencrypted data
+byte CLEARTEXT[FIELD_MAX+1] = {0};
+//CRYPTED is the buffer containing the encrypted data
+byte CRYPTED[FIELD_MAX+1] = {0};
+
+//CATALOG contains the decrypted catalog while the device is unlocked
+byte CATALOG[CATALOG_MAX * CATALOG_ENTRY];
+//CATALOG_COUNT contains the number of catalog entries, -1 if not loaded
+int CATALOG_COUNT = -1;
+//CATALOG_VIEW contains the catalog positions of the entries of
+// CURRENT_DIR, sorted by name
+uint16_t CATALOG_VIEW[CATALOG_MAX];
+//CATALOG_LOAD_TIME contains the time in ms taken to load the catalog
+uint32_t CATALOG_LOAD_TIME = 0;
+//CATALOG_BUILD contains the state of the catalog build, the folder being
+// walked or a CATALOG_BUILD_ state. The build runs a step at a time from
+// the idle loop of the menu
+int CATALOG_BUILD = CATALOG_BUILD_IDLE;
+//CATALOG_BUILD_ENTRY contains the next directory entry of the folder being
+// walked, or the next slot of the raw vault
+int CATALOG_BUILD_ENTRY = 0;
+//CATALOG_BUILT contains the number of entries built so far. CATALOG_COUNT
+// stays -1 until the build is done
+int CATALOG_BUILT = 0;
+//CATALOG_BUILD_START contains the time the build started
+uint32_t CATALOG_BUILD_START = 0;
+
+//JOURNAL is the journal file, open while it holds updates
+File JOURNAL;
+//JOURNAL_PENDING contains the number of entries written since the last flush
+int JOURNAL_PENDING = 0;
+//JOURNAL_ENTRIES contains the number of section updates in the journal.
+// It never goes past JOURNAL_CHECKPOINT, the number of records a
+// checkpoint can fold
+int JOURNAL_ENTRIES = 0;
+//JOURNAL_LAST contains the time of the last journal entry
+uint32_t JOURNAL_LAST = 0;
+//JOURNAL_IMAGED is true when a checkpoint failed to write its record
+// images. No update is appended until they are written, since the
+// checkpoint only replays the images
+boolean JOURNAL_IMAGED = false;
+
+//COMPACT_FOLDER contains the path of the folder being compacted, empty
+// when no compaction is in progress. Read from COMPACT_STATE at unlock
+char COMPACT_FOLDER[PATH_LENGTH] = {0};
+
+//RAW_FIRST contains the first block of the raw vault on the card
+uint32_t RAW_FIRST = 0;
+//RAW_SLOTS contains the number of slots of the raw vault, 0 if there is none
+int RAW_SLOTS = 0;
+//RAW_HASH contains the path hash of the record of each slot
+uint32_t RAW_HASH[RAW_SLOTS_MAX] = {0};
+//RAW_PARENT contains the path hash of the folder of the record of each slot
+uint32_t RAW_PARENT[RAW_SLOTS_MAX] = {0};
+//RAW_WRITES contains the number of writes of each slot
+uint32_t RAW_WRITES[RAW_SLOTS_MAX] = {0};
+//RAW_LIVE is true for the slots holding a record
+boolean RAW_LIVE[RAW_SLOTS_MAX] = {0};
+//RAW_SEQUENCE contains the highest write sequence number of the slots
+uint32_t RAW_SEQUENCE = 0;
+//Record accesses that reach the card, and their total time in us
+uint32_t RECORD_LOADS = 0;
+uint32_t RECORD_LOAD_TIME = 0;
+uint32_t RECORD_STORES = 0;
+uint32_t RECORD_STORE_TIME = 0;
+
+//BLOOM contains the Bloom filter of the entries of the folder BLOOM_PATH,
+// in its first BLOOM_LENGTH bytes
+byte BLOOM[BLOOM_MAX] = {0};
+int BLOOM_LENGTH = 0;
+char BLOOM_PATH[PATH_LENGTH] = {0};
+//BLOOM_COUNT contains the number of entries added to BLOOM
+unsigned int BLOOM_COUNT = 0;
+//BLOOM_KEY contains the path hash of BLOOM_PATH, 0 if no filter is loaded
+uint32_t BLOOM_KEY = 0;
+//BLOOM_DIRTY is true when BLOOM has not been written to the card yet
+boolean BLOOM_DIRTY = false;
+//Bloom filter statistics. Missing paths told apart without the card, and
+// missing paths that still had to be looked up on the card
+uint32_t BLOOM_SKIPS = 0;
+uint32_t BLOOM_MISSES = 0;
+
+//MANIFEST_READY is true once the manifest is opened, while unlocked
+boolean MANIFEST_READY = false;
+//MANIFEST_BROKEN is true when the root of the manifest did not match at
+// unlock. The tree is then left as it is until it is rebuilt on request
+boolean MANIFEST_BROKEN = false;
+//MANIFEST_COUNT contains the number of manifest leaves in use
+int MANIFEST_COUNT = 0;
+//MANIFEST_STALE has a bit set for the groups whose hash has to be
+// recomputed, see groupFlag()
+byte MANIFEST_STALE[MANIFEST_GROUPS / 8] = {0};
+//VERIFY_PENDING has a bit set for the groups the idle verifier has to
+// check, which are all the groups after unlock, then the updated ones
+byte VERIFY_PENDING[MANIFEST_GROUPS / 8] = {0};
+//Group and leaf the idle verifier checks next
+int VERIFY_GROUP = 0;
+int VERIFY_LEAF = 0;
+//VERIFY_LAST contains the time of the last idle verifier step
+uint32_t VERIFY_LAST = 0;
+//Verifier statistics. Records checked, and mismatches found
+uint32_t VERIFY_CHECKED = 0;
+uint32_t VERIFY_ERRORS = 0;
+
+//DIGEST_KEY contains the path hashes of the folders in DIGEST, 0 if free
+uint32_t DIGEST_KEY[DIGEST_SLOTS] = {0};
+//DIGEST contains the last computed folder digests
+byte DIGEST[DIGEST_SLOTS][SHA256_HASH_LENGTH];
+//DIGEST_NEXT contains the digest slot replaced next
+int DIGEST_NEXT = 0;
+
+//SHOW_RECENT is true when the recently used records have to be shown, after
+// the device has been unlocked
+boolean SHOW_RECENT = false;
+//VAULT_CHANGED is true when a command changed the folders shown by the menu
+boolean VAULT_CHANGED = false;
+//UNLOCK_TIME contains the unlock time, until the first password is used
+uint32_t UNLOCK_TIME = 0;
+//TIME_TO_PASSWORD contains the time in ms from the last unlock to the
+// first password shown or typed
+uint32_t TIME_TO_PASSWORD = 0;
+
+//FRAME_DATA contains the data of the last command, null terminated. The
+// commands parse it in place
+char FRAME_DATA[FRAME_MAX+1];
+//FRAME_EXPECTED contains the sequence number of the next v2 command
+byte FRAME_EXPECTED = 0;
+//REPLY_DATA contains the reply being built for a v2 command
+byte REPLY_DATA[FRAME_MAX];
+int REPLY_LENGTH = 0;
+//REPLY_FRAMED is true while a v2 command runs, so that replies are framed
+boolean REPLY_FRAMED = false;
+//REPLY_SEQUENCE contains the sequence number of the running v2 command
+byte REPLY_SEQUENCE = 0;
+//REPLY_SPLIT is true once part of the reply has been sent in FRAME_MORE
+boolean REPLY_SPLIT = false;
+//REPLY_KEPT is true while REPLY_DATA holds the whole last reply, which is
+// sent again if the host sends the frame of its command again
+boolean REPLY_KEPT = false;
+byte REPLY_KEPT_SEQUENCE = 0;
+byte REPLY_KEPT_COMMAND = 0;
+//Frame statistics. Frames received, and damaged frames
+uint32_t FRAME_COUNT = 0;
+uint32_t FRAME_ERRORS = 0;
+//PACK_SESSION is true when the v2 session uses compressed frames
+boolean PACK_SESSION = false;
+//PACK_BUFFER contains a frame payload being compressed or uncompressed
+byte PACK_BUFFER[FRAME_MAX];
+//PACK_REPLY is false while the running command replies with ciphertext or
+// hashes, which do not compress, so that their frames are not searched
+boolean PACK_REPLY = true;
+//Compression statistics. Payload bytes received and sent in a compressed
+// session, before and after compression
+uint32_t PACK_RECEIVED_RAW = 0;
+uint32_t PACK_RECEIVED_WIRE = 0;
+uint32_t PACK_SENT_RAW = 0;
+uint32_t PACK_SENT_WIRE = 0;
+
+//COMMAND_MODE is true when the management commands are run
+boolean COMMAND_MODE = false;
+//COMMAND_CONNECTED is true while the host has the serial port open
+boolean COMMAND_CONNECTED = false;
+//TRANSPORT contains the transport of the management commands
+byte TRANSPORT = TRANSPORT_CDC;
+//TRANSMIT_PACKET contains the packet being gathered for the transport
+byte TRANSMIT_PACKET[TRANSPORT_PACKET];
+int TRANSMIT_LENGTH = 0;
+//LOOPBACK_QUEUE contains the reports sent on the loopback transport, not
+// received back yet
+byte LOOPBACK_QUEUE[LOOPBACK_PACKETS][TRANSPORT_PACKET];
+int LOOPBACK_HEAD = 0;
+int LOOPBACK_COUNT = 0;
+//Number of raw HID reports dropped after HID_SEND_TRIES timeouts
+uint32_t HID_SEND_FAILURES = 0;
+
+//RECEIVE_RING contains the bytes received and not read yet
+byte RECEIVE_RING[RECEIVE_SIZE];
+int RECEIVE_HEAD = 0;
+int RECEIVE_COUNT = 0;
+//PIPE_* contain the write commands in the pipeline. PIPE_HEAD is the
+// oldest slot, written next
+byte PIPE_COMMAND[PIPE_SLOTS];
+//PIPE_TIME contains the time in us each command was queued
+uint32_t PIPE_TIME[PIPE_SLOTS];
+char PIPE_PATH[PIPE_SLOTS][PATH_LENGTH];
+byte PIPE_FILE_TYPE[PIPE_SLOTS];
+byte PIPE_SECTION[PIPE_SLOTS];
+int PIPE_LENGTH[PIPE_SLOTS];
+byte PIPE_DATA[PIPE_SLOTS][FIELD_MAX];
+byte PIPE_STATE[PIPE_SLOTS];
+byte PIPE_SEQUENCE[PIPE_SLOTS];
+boolean PIPE_FRAMED[PIPE_SLOTS];
+int PIPE_HEAD = 0;
+int PIPE_COUNT = 0;
+//Pipeline statistics. Highest ring occupancy, write commands that waited
+// for a free slot, and stage runs with the sums of the ring, encrypt stage
+// and write stage occupancies at each of them
+int RECEIVE_PEAK = 0;
+uint32_t PIPE_STALLS = 0;
+uint32_t PIPE_SAMPLES = 0;
+uint32_t PIPE_RECEIVE_SUM = 0;
+uint32_t PIPE_ENCRYPT_SUM = 0;
+uint32_t PIPE_WRITE_SUM = 0;
+
+//Load metrics, since METRICS_START in ms. Commands completed, serial bytes
+// received and sent, and commands by latency bucket
+uint32_t METRICS_START = 0;
+uint32_t METRICS_COMMANDS = 0;
+uint32_t METRICS_RECEIVED = 0;
+uint32_t METRICS_SENT = 0;
+uint32_t METRICS_LATENCY[METRICS_BUCKETS] = {0};
+
+//EXPORT_BUFFER contains the chunk being sent and the chunk being read
+byte EXPORT_BUFFER[2][EXPORT_CHUNK+2];
+int EXPORT_LENGTH[2] = {0, 0};
+//EXPORT_FILL contains the index of the chunk being read
+int EXPORT_FILL = 0;
+//EXPORT_SENT contains the number of bytes of the other chunk already sent
+int EXPORT_SENT = 0;
+//EXPORT_POSITION contains the offset of the next byte of the export stream
+uint32_t EXPORT_POSITION = 0;
+//EXPORT_START contains the offset from which the stream is sent
+uint32_t EXPORT_START = 0;
+//EXPORT_ABORTED is true once the host stopped reading the export stream
+boolean EXPORT_ABORTED = false;
+//EXPORT_RUNNING is true while an export is sent, a record per call of
+// serialCommands(). The next commands wait for its end
+boolean EXPORT_RUNNING = false;
+//EXPORT_FOLDER and EXPORT_WALK contain the position of the export in the
+// walk of the vault
+char EXPORT_FOLDER[PATH_LENGTH];
+int EXPORT_WALK = 0;
+//EXPORT_TIME contains the time in us the export command was received
+uint32_t EXPORT_TIME = 0;
+
+//CACHE_DATA contains the blocks of the read cache
+byte CACHE_DATA[CACHE_SLOTS][BLOCK_SIZE];
+//CACHE_KEY contains the path hash of the file each block belongs to, and
+// CACHE_CHECK its path check, so that two paths with the same hash are
+// not mistaken for each other
+uint32_t CACHE_KEY[CACHE_SLOTS] = {0};
+uint32_t CACHE_CHECK[CACHE_SLOTS] = {0};
+//CACHE_BLOCK contains the block number of each block in its file
+unsigned int CACHE_BLOCK[CACHE_SLOTS] = {0};
+//CACHE_LENGTH contains the number of valid bytes in each block
+int CACHE_LENGTH[CACHE_SLOTS] = {0};
+//CACHE_USED contains the last use of each slot. 0 means the slot is empty
+uint32_t CACHE_USED[CACHE_SLOTS] = {0};
+//CACHE_CLOCK is incremented on each cache access, for LRU eviction
+uint32_t CACHE_CLOCK = 0;
+//Cache statistics
+uint32_t CACHE_HITS = 0;
+uint32_t CACHE_MISSES = 0;
+
+//PATH_CACHE_KEY and PATH_CACHE_CHECK contain the hash and check of each
+// resolved path
+uint32_t PATH_CACHE_KEY[PATH_CACHE_SLOTS] = {0};
+uint32_t PATH_CACHE_CHECK[PATH_CACHE_SLOTS] = {0};
+//PATH_CACHE_TYPE contains what each path resolved to. ENTRY_END means the
+// path does not exist
+byte PATH_CACHE_TYPE[PATH_CACHE_SLOTS] = {0};
+//PATH_CACHE_USED contains the last use of each slot. 0 means the slot is empty
+uint32_t PATH_CACHE_USED[PATH_CACHE_SLOTS] = {0};
+//Path cache statistics
+uint32_t PATH_HITS = 0;
+uint32_t PATH_MISSES = 0;
+
+//PREFETCH_NAME contains the decrypted usernames of the records around the
+// cursor. Slots are wiped when evicted and when the device is locked
+char PREFETCH_NAME[PREFETCH_SLOTS][FIELD_MAX+1];
+//PREFETCH_KEY contains the path hash of the record of each slot
+uint32_t PREFETCH_KEY[PREFETCH_SLOTS] = {0};
+//PREFETCH_TYPE contains the record type of each slot
+byte PREFETCH_TYPE[PREFETCH_SLOTS] = {0};
+//PREFETCH_USED contains the last use of each slot. 0 means the slot is empty
+uint32_t PREFETCH_USED[PREFETCH_SLOTS] = {0};
+//Cursor position and folder hash the neighbours have been prefetched for
+int PREFETCH_POSITION = -1;
+uint32_t PREFETCH_FOLDER = 0;
+//Prefetch cache statistics
+uint32_t PREFETCH_HITS = 0;
+uint32_t PREFETCH_MISSES = 0;
+
+
+
+/*
+  commandStart()
+    Starts the command mode. The management commands are then run from
+    the idle loop of the menu, between button presses, with the key and
+    caches already loaded by the unlock
+  Returns nothing
+*/
+void commandStart(void) {
+#ifdef RAWHID_INTERFACE
+  //Commands come in raw HID reports, the serial port is emulated
+  TRANSPORT = TRANSPORT_HID;
+#else
+  TRANSPORT = TRANSPORT_CDC;
+  Serial.begin(9600);
+  Serial.setTimeout(FRAME_TIMEOUT);
+#endif
+  RECEIVE_HEAD = 0;
+  RECEIVE_COUNT = 0;
+  TRANSMIT_LENGTH = 0;
+  PACK_SESSION = false;
+  COMMAND_CONNECTED = false;
+  COMMAND_MODE = true;
+}
+
+/*
+  commandStop()
+    Stops the command mode, once the queued write commands are written and
+    the journal is folded. An export being sent is abandoned
+  Returns nothing
+*/
+void commandStop(void) {
+  if (!COMMAND_MODE) return;
+  if (EXPORT_RUNNING) {
+    EXPORT_ABORTED = true;
+    exportFinish();
+  }
+  pipeFlush();
+  //The journal is not left for the next unlock
+  journalCheckpoint();
+  transportFlush();
+  if (TRANSPORT == TRANSPORT_CDC) Serial.end();
+  RECEIVE_COUNT = 0;
+  PACK_SESSION = false;
+  COMMAND_MODE = false;
+}
+
+/*
+  serialCommands()
+    Runs the next management command, if one has been received. Otherwise
+    runs a pipeline stage, or folds the journal once idle. Only one command,
+    or one record of an export, is run per call, so that the menu stays
+    responsive during a sync
+  Returns true if something was done, false if the command mode is idle
+*/
+boolean serialCommands(void) {
+  if (!COMMAND_MODE) return false;
+  
+  //The host is greeted each time it opens the serial port
+  boolean connected = (TRANSPORT != TRANSPORT_CDC) || Serial;
+  if (connected && !COMMAND_CONNECTED) {
+    transportWrite((byte *)"\x42\x42", 2);
+    transportFlush();
+  }
+  COMMAND_CONNECTED = connected;
+  
+  if (EXPORT_RUNNING) {
+    exportStep();
+    transportFlush();
+    return true;
+  }
+  
+  receivePump();
+  if (RECEIVE_COUNT == 0) {
+    transportFlush();
+    if (pipeStep()) return true;
+    if (JOURNAL && millis() - JOURNAL_LAST > JOURNAL_IDLE) {
+      journalCheckpoint();
+      return true;
+    }
+    return false;
+  }
+  
+  int command = serialRead();
+  if (command == FRAME_SOF) {
+    readFrame();
+  } else {
+    int length = serialRead();
+    if (length < 0) return true;
+    
+    //v1 commands are received in the frame buffer too
+    memset(FRAME_DATA, 0, length + 1);
+    for (int i=0; i<length; i++) {
+      int value = serialRead();
+      if (value < 0) break;
+      FRAME_DATA[i] = value;
+    }
+    
+    runCommand(command, FRAME_DATA, length);
+  }
+  transportFlush();
+  return true;
+}
+
+/*
+  runCommand()
+    Runs a command received on the serial line, in either protocol
+    command - The command number
+    data - The command data, null terminated
+    length - The length of the data
+  Returns nothing
+*/
+void runCommand(int command, char * data, int length) {
+  uint32_t start = micros();
+  //Other commands see the previous write commands. v2 reads do not wait
+  // for them, their replies can come first
+  if (!pipeQueued(command) && !(REPLY_FRAMED && pipeBypass(command))) pipeFlush();
+  
+  switch(command) {
+    case 1:
+      //Create command, encrypted and journaled by the pipeline stages
+    case 2:
+      //Create folder command, run by the write stage
+      pipeQueue(command, (byte *)data, length, 0, false);
+      break;
+    case 3:
+      //Sync clock command, the Unix time little endian on 4 bytes
+      if (length >= 4) setTime(readLong((byte *)data));
+      break;
+    case 4:
+      //Listings have to show the journaled records
+      journalCheckpoint();
+      listFolder(data);
+      break;
+    case 5:
+      sendStats();
+      break;
+    case 6:
+      //Compact folder command, one slice per command
+      compactFolder(data);
+      break;
+    case 7:
+      //Create raw vault command
+      rawFormat((byte)data[0]);
+      break;
+    case 8:
+      //Verify vault command, data[0] is 1 to rebuild the manifest first
+      journalCheckpoint();
+      verifyVault(length > 0 && data[0] == 1);
+      break;
+    case 9:
+      //Batch create command
+      batchCreate((byte *)data, length);
+      break;
+    case 10:
+      //Export command, from the given offset of the export stream
+      PACK_REPLY = false;
+      journalCheckpoint();
+      exportVault(length >= 4 ? readLong((byte *)data) : 0);
+      break;
+    case 11:
+      //Folder digests command
+      PACK_REPLY = false;
+      journalCheckpoint();
+      sendDigests(data);
+      break;
+    case 12:
+      //Binary listing command, one page per command
+      journalCheckpoint();
+      if (length < 4) {
+        reply('\x00');
+      } else {
+        listPage(data + 4, readLong((byte *)data));
+      }
+      break;
+    case 13:
+      //Ping command, the data is sent back
+      for (int i=0; i<length; i++) reply(data[i]);
+      break;
+    case 14:
+      //Load metrics command, reset if data[0] is 1
+      sendMetrics(length > 0 && data[0] == 1);
+      break;
+    case 15:
+      //Loopback transport test command
+      loopbackTest((byte)data[0]);
+      break;
+    default:
+      break;
+  }
+  //The write commands are counted once written, an export once sent
+  if (!pipeQueued(command) && !EXPORT_RUNNING) metricsAdd(start);
+}
+
+/*
+  metricsAdd()
+    Counts a completed command in the load metrics
+    start - The time in us the command was received
+  Returns nothing
+*/
+void metricsAdd(uint32_t start) {
+  uint32_t latency = (micros() - start) >> METRICS_SHIFT;
+  int bucket = 0;
+  while (latency > 1 && bucket < METRICS_BUCKETS - 1) {
+    latency >>= 1;
+    bucket++;
+  }
+  METRICS_LATENCY[bucket]++;
+  METRICS_COMMANDS++;
+}
+
+/*
+  sendMetrics()
+    Sends the load metrics on the serial line, one value per line. The
+    host gets the command and byte rates by dividing by the time
+    reset - true to start new metrics once sent
+  Sends the time in ms since the metrics started, the commands completed,
+  the bytes received and sent, then the METRICS_BUCKETS latency counts.
+  Bucket 0 counts the commands done in less than 2 << METRICS_SHIFT us,
+  and each next bucket up to twice as long
+  Returns nothing
+*/
+void sendMetrics(boolean reset) {
+  replyLine((uint32_t)(millis() - METRICS_START));
+  replyLine(METRICS_COMMANDS);
+  replyLine(METRICS_RECEIVED);
+  replyLine(METRICS_SENT);
+  for (int i=0; i<METRICS_BUCKETS; i++) replyLine(METRICS_LATENCY[i]);
+  if (reset) {
+    METRICS_START = millis();
+    METRICS_COMMANDS = 0;
+    METRICS_RECEIVED = 0;
+    METRICS_SENT = 0;
+    for (int i=0; i<METRICS_BUCKETS; i++) METRICS_LATENCY[i] = 0;
+  }
+}
+
+/*
+  exportVault()
+    Sends the records of the vault as they are stored on the card, so
+    that the sections stay encrypted. The chunks are read from the card
+    while the previous one is being sent. An interrupted export is resumed
+    by asking for the offset of the first chunk missing. The records are
+    sent by exportStep(), a record per call
+    start - The offset of the stream to start from
+  Sends a \x01 on the serial line, then the export stream chunks
+  Sends a \x00 if a compaction is in progress
+  Returns nothing
+*/
+void exportVault(uint32_t start) {
+  //The records of a folder being compacted are not at their place
+  if (COMPACT_FOLDER[0]) {
+    reply('\x00');
+    return;
+  }
+  reply('\x01');
+  EXPORT_START = start;
+  EXPORT_POSITION = 0;
+  EXPORT_FILL = 0;
+  EXPORT_LENGTH[0] = 0;
+  EXPORT_LENGTH[1] = 0;
+  EXPORT_SENT = 0;
+  EXPORT_ABORTED = false;
+  //The vault is walked without recursion, the records of the raw vault
+  // come last
+  strcpy(EXPORT_FOLDER, "/");
+  EXPORT_WALK = 0;
+  EXPORT_TIME = micros();
+  EXPORT_RUNNING = true;
+}
+
+/*
+  exportStep()
+    Adds the next record of the vault to the export stream, or ends the
+    stream after the last one
+  Returns nothing
+*/
+void exportStep(void) {
+  char path[PATH_LENGTH];
+  int type = ENTRY_END;
+  exportPump();
+  while (!EXPORT_ABORTED && (type = vaultWalk(EXPORT_FOLDER, &EXPORT_WALK, path)) == ENTRY_FOLDER);
+  if (type == ENTRY_FILE) {
+    exportRecord(path);
+  } else {
+    exportFinish();
+  }
+}
+
+/*
+  exportFinish()
+    Ends the export stream, then the reply of the export command
+  Returns nothing
+*/
+void exportFinish(void) {
+  if (EXPORT_LENGTH[EXPORT_FILL] > 0) exportChunk();
+  //The empty chunk ends the stream
+  exportChunk();
+  exportWait();
+  wipe((byte *)EXPORT_BUFFER, sizeof(EXPORT_BUFFER));
+  EXPORT_RUNNING = false;
+  if (REPLY_FRAMED) {
+    replyFinish(10);
+    PACK_REPLY = true;
+  }
+  metricsAdd(EXPORT_TIME);
+}
+
+/*
+  exportRecord()
+    Adds a record to the export stream. A record before the start offset
+    is skipped without being read
+    path - The path of the record
+  Returns nothing
+*/
+void exportRecord(char * path) {
+  byte data[BLOCK_SIZE];
+  int raw = rawFind(pathHash(path));
+  if (raw >= 0) {
+    if (!rawRead(raw, data)) return;
+    int length = min(data[2] | (data[3] << 8), RECORD_MAX);
+    exportHeader(path, length);
+    exportBytes(data + RAW_HEADER, length);
+    wipe(data, sizeof(data));
+    return;
+  }
+  
+  File content = SD.open(path);
+  if (!content) return;
+  int length = min(content.size(), (uint32_t)RECORD_MAX);
+  uint32_t size = 1 + strlen(path) + 2 + length;
+  if (EXPORT_POSITION + size <= EXPORT_START) {
+    EXPORT_POSITION += size;
+  } else {
+    exportHeader(path, length);
+    while (length > 0) {
+      int read = content.read(data, min(length, BLOCK_SIZE));
+      if (read <= 0) {
+        //Keeps the stream offsets right
+        memset(data, 0, BLOCK_SIZE);
+        read = min(length, BLOCK_SIZE);
+      }
+      exportBytes(data, read);
+      length -= read;
+    }
+  }
+  content.close();
+  wipe(data, sizeof(data));
+}
+
+/*
+  exportHeader()
+    Adds the header of a record to the export stream
+    path - The path of the record
+    length - The length of the record
+  Returns nothing
+*/
+void exportHeader(char * path, int length) {
+  byte header[2] = { (byte)strlen(path), 0 };
+  exportBytes(header, 1);
+  exportBytes((byte *)path, header[0]);
+  header[0] = length & 0xFF;
+  header[1] = length >> 8;
+  exportBytes(header, 2);
+}
+
+/*
+  exportBytes()
+    Adds data to the export stream. Data before the start offset is
+    dropped, full chunks are sent
+    data - The data
+    length - The length of the data
+  Returns nothing
+*/
+void exportBytes(byte * data, int length) {
+  if (EXPORT_ABORTED) return;
+  for (int i=0; i<length; i++) {
+    if (EXPORT_POSITION >= EXPORT_START) {
+      if (EXPORT_LENGTH[EXPORT_FILL] == EXPORT_CHUNK) exportChunk();
+      EXPORT_BUFFER[EXPORT_FILL][EXPORT_LENGTH[EXPORT_FILL]++] = data[i];
+    }
+    EXPORT_POSITION++;
+  }
+  exportPump();
+}
+
+/*
+  exportChunk()
+    Waits for the chunk being sent to be sent, then starts sending the
+    chunk just read
+  Returns nothing
+*/
+void exportChunk(void) {
+  int other = 1 - EXPORT_FILL;
+  if (!exportWait()) return;
+  EXPORT_LENGTH[other] = 0;
+  EXPORT_SENT = 0;
+  
+  byte header[6];
+  int length = EXPORT_LENGTH[EXPORT_FILL];
+  writeLong(header, EXPORT_POSITION - length);
+  header[4] = length & 0xFF;
+  header[5] = length >> 8;
+  unsigned int crc = crc16(crc16(0xFFFF, header, 6), EXPORT_BUFFER[EXPORT_FILL], length);
+  for (int i=0; i<6; i++) reply(header[i]);
+  
+  //The chunk and its CRC are sent by exportPump()
+  EXPORT_BUFFER[EXPORT_FILL][length] = crc & 0xFF;
+  EXPORT_BUFFER[EXPORT_FILL][length + 1] = crc >> 8;
+  EXPORT_LENGTH[EXPORT_FILL] = length + 2;
+  EXPORT_FILL = other;
+  exportPump();
+}
+
+/*
+  exportWait()
+    Waits for the chunk being sent to be sent. The export is abandoned
+    if nothing can be sent for EXPORT_TIMEOUT ms
+  Returns true if the chunk has been sent
+*/
+boolean exportWait(void) {
+  int sending = 1 - EXPORT_FILL;
+  uint32_t last = millis();
+  while (!EXPORT_ABORTED && EXPORT_SENT < EXPORT_LENGTH[sending]) {
+    int sent = EXPORT_SENT;
+    exportPump();
+    if (EXPORT_SENT != sent) {
+      last = millis();
+    } else if (millis() - last > EXPORT_TIMEOUT) {
+      EXPORT_ABORTED = true;
+    }
+  }
+  return !EXPORT_ABORTED;
+}
+
+/*
+  exportPump()
+    Sends as much of the chunk being sent as the USB buffer can take
+    without waiting, so that reading the card goes on meanwhile. Framed
+    replies are paced the same way, since a frame written to a full USB
+    buffer would be dropped rather than keep the export waiting
+  Returns nothing
+*/
+void exportPump(void) {
+  int sending = 1 - EXPORT_FILL;
+  int length = EXPORT_LENGTH[sending] - EXPORT_SENT;
+  if (length <= 0) return;
+  if (TRANSPORT == TRANSPORT_CDC) {
+    length = min(length, Serial.availableForWrite());
+  }
+  for (int i=0; i<length; i++) reply(EXPORT_BUFFER[sending][EXPORT_SENT++]);
+}
+
+/*
+  pipeQueued()
+    Tells whether a command is a write command run by the pipeline
+    command - The command number
+  Returns true for the create and create folder commands
+*/
+boolean pipeQueued(int command) {
+  return (command == 1 || command == 2);
+}
+
+/*
+  pipeBypass()
+    Tells whether a v2 command only reads the vault, so that it can be run
+    before the write commands still in the pipeline
+    command - The command number
+  Returns true for the listing, stats and digests commands
+*/
+boolean pipeBypass(int command) {
+  return (command == 4 || command == 5 || command == 11 || command == 12);
+}
+
+/*
+  pipeQueue()
+    Queues a write command in the pipeline. A create command is encrypted,
+    then journaled and acknowledged, by the next pipeline stages, while
+    the following commands are received. When the pipeline is full, the
+    stages are run until a slot is free, and the host has to wait as no
+    more bytes are received meanwhile
+    command - The command number
+    data - The command data
+    length - The length of the data
+    sequence - The sequence number of the v2 frame of the command
+    framed - true if the command came in a v2 frame
+  Returns nothing
+*/
+void pipeQueue(int command, byte * data, int length, byte sequence, boolean framed) {
+  if (PIPE_COUNT == PIPE_SLOTS) PIPE_STALLS++;
+  while (PIPE_COUNT == PIPE_SLOTS) pipeStep();
+  int slot = (PIPE_HEAD + PIPE_COUNT) % PIPE_SLOTS;
+  PIPE_COUNT++;
+  PIPE_COMMAND[slot] = command;
+  PIPE_TIME[slot] = micros();
+  PIPE_SEQUENCE[slot] = sequence;
+  PIPE_FRAMED[slot] = framed;
+  
+  if (command == 2) {
+    //The folder path, null terminated
+    int path_len = strnlen((char *)data, length);
+    PIPE_STATE[slot] = (path_len < PATH_LENGTH) ? PIPE_READY : PIPE_INVALID;
+    if (path_len < PATH_LENGTH) {
+      memcpy(PIPE_PATH[slot], data, path_len);
+      PIPE_PATH[slot][path_len] = '\x00';
+    }
+    return;
+  }
+  
+  int path_len = data[0];
+  if (length < 4 || path_len >= PATH_LENGTH || path_len + 4 > length) {
+    PIPE_STATE[slot] = PIPE_INVALID;
+    return;
+  }
+  int field_len = min(data[path_len+3], FIELD_MAX);
+  field_len = min(field_len, length - path_len - 4);
+  memcpy(PIPE_PATH[slot], data + 1, path_len);
+  PIPE_PATH[slot][path_len] = '\x00';
+  PIPE_FILE_TYPE[slot] = data[path_len+1];
+  PIPE_SECTION[slot] = data[path_len+2];
+  PIPE_LENGTH[slot] = field_len;
+  memcpy(PIPE_DATA[slot], data + path_len + 4, field_len);
+  wipe(data, length);
+  PIPE_STATE[slot] = PIPE_RECEIVED;
+}
+
+/*
+  pipeWaiting()
+    Tells whether a v2 command is still in the pipeline
+    sequence - The sequence number of the command frame
+  Returns true if the command has not been written yet
+*/
+boolean pipeWaiting(byte sequence) {
+  for (int i=0; i<PIPE_COUNT; i++) {
+    int slot = (PIPE_HEAD + i) % PIPE_SLOTS;
+    if (PIPE_FRAMED[slot] && PIPE_SEQUENCE[slot] == sequence) return true;
+  }
+  return false;
+}
+
+/*
+  pipeStep()
+    Runs one stage of the pipeline. The oldest command is written once it
+    is ready, otherwise the next received command is encrypted
+  Returns true if a stage was run
+*/
+boolean pipeStep(void) {
+  if (PIPE_COUNT == 0) return false;
+  PIPE_SAMPLES++;
+  PIPE_RECEIVE_SUM += RECEIVE_COUNT;
+  for (int i=0; i<PIPE_COUNT; i++) {
+    int state = PIPE_STATE[(PIPE_HEAD + i) % PIPE_SLOTS];
+    if (state == PIPE_RECEIVED) PIPE_ENCRYPT_SUM++;
+    if (state != PIPE_RECEIVED) PIPE_WRITE_SUM++;
+  }
+  
+  int slot = PIPE_HEAD;
+  if (PIPE_STATE[slot] != PIPE_RECEIVED) {
+    //Write stage
+    if (PIPE_FRAMED[slot]) replyStart(PIPE_SEQUENCE[slot]);
+    if (PIPE_STATE[slot] == PIPE_INVALID) {
+      reply('\x00');
+    } else if (PIPE_COMMAND[slot] == 2) {
+      makeDir(PIPE_PATH[slot]);
+    } else {
+      updateFile(PIPE_PATH[slot], PIPE_FILE_TYPE[slot], PIPE_SECTION[slot],
+                 PIPE_LENGTH[slot], PIPE_DATA[slot]);
+    }
+    if (PIPE_FRAMED[slot]) replyFinish(PIPE_COMMAND[slot]);
+    wipe(PIPE_DATA[slot], FIELD_MAX);
+    metricsAdd(PIPE_TIME[slot]);
+    PIPE_HEAD = (PIPE_HEAD + 1) % PIPE_SLOTS;
+    PIPE_COUNT--;
+    return true;
+  }
+  
+  //Encrypt stage, on the oldest command not encrypted yet
+  for (int i=0; i<PIPE_COUNT; i++) {
+    slot = (PIPE_HEAD + i) % PIPE_SLOTS;
+    if (PIPE_STATE[slot] != PIPE_RECEIVED) continue;
+    PIPE_LENGTH[slot] = encryptView(&CIPHER, PIPE_DATA[slot], PIPE_LENGTH[slot], PIPE_DATA[slot]);
+    PIPE_STATE[slot] = PIPE_READY;
+    break;
+  }
+  return true;
+}
+
+/*
+  pipeFlush()
+    Runs the pipeline stages until all the queued commands are journaled
+  Returns nothing
+*/
+void pipeFlush(void) {
+  while (pipeStep());
+}
+
+/*
+  receivePump()
+    Moves the bytes received by USB to the receive ring, so that the host
+    can go on sending while the pipeline stages run
+  Returns nothing
+*/
+void receivePump(void) {
+  byte packet[TRANSPORT_PACKET];
+  int length;
+  while (RECEIVE_SIZE - RECEIVE_COUNT >= TRANSPORT_PACKET &&
+         (length = transportReceive(packet)) > 0) {
+    for (int i=0; i<length; i++) {
+      RECEIVE_RING[(RECEIVE_HEAD + RECEIVE_COUNT) % RECEIVE_SIZE] = packet[i];
+      RECEIVE_COUNT++;
+    }
+  }
+  if (RECEIVE_COUNT > RECEIVE_PEAK) RECEIVE_PEAK = RECEIVE_COUNT;
+}
+
+/*
+  transportReceive()
+    Receives a packet from the current transport, without waiting
+    packet - A TRANSPORT_PACKET bytes buffer receiving the packet data
+  Returns the length of the packet, 0 if none was received
+*/
+int transportReceive(byte * packet) {
+  byte report[TRANSPORT_PACKET];
+  int length = 0;
+  switch (TRANSPORT) {
+    case TRANSPORT_CDC:
+      length = min(Serial.available(), TRANSPORT_PACKET);
+      if (length > 0) length = Serial.readBytes((char *)packet, length);
+      return length;
+#ifdef RAWHID_INTERFACE
+    case TRANSPORT_HID:
+      if (RawHID.recv(report, 0) <= 0) return 0;
+      break;
+#endif
+    case TRANSPORT_LOOPBACK:
+      if (LOOPBACK_COUNT == 0) return 0;
+      memcpy(report, LOOPBACK_QUEUE[LOOPBACK_HEAD], TRANSPORT_PACKET);
+      LOOPBACK_HEAD = (LOOPBACK_HEAD + 1) % LOOPBACK_PACKETS;
+      LOOPBACK_COUNT--;
+      break;
+    default:
+      return 0;
+  }
+  //Report, the first byte gives the length of the data
+  length = min(report[0], TRANSPORT_PACKET - 1);
+  memcpy(packet, report + 1, length);
+  return length;
+}
+
+/*
+  transportWrite()
+    Sends data on the current transport. The data is gathered in packets,
+    sent when full or by transportFlush()
+    data - The data
+    length - The length of the data
+  Returns nothing
+*/
+void transportWrite(byte * data, int length) {
+  int room = TRANSPORT_PACKET - (TRANSPORT == TRANSPORT_CDC ? 0 : 1);
+  for (int i=0; i<length; i++) {
+    if (TRANSMIT_LENGTH == room) transportFlush();
+    TRANSMIT_PACKET[TRANSMIT_LENGTH++] = data[i];
+  }
+  METRICS_SENT += length;
+}
+
+/*
+  transportFlush()
+    Sends the packet being gathered, if any
+  Returns nothing
+*/
+void transportFlush(void) {
+  if (TRANSMIT_LENGTH == 0) return;
+  byte report[TRANSPORT_PACKET] = {0};
+  report[0] = TRANSMIT_LENGTH;
+  memcpy(report + 1, TRANSMIT_PACKET, min(TRANSMIT_LENGTH, TRANSPORT_PACKET - 1));
+  switch (TRANSPORT) {
+    case TRANSPORT_CDC:
+      Serial.write(TRANSMIT_PACKET, TRANSMIT_LENGTH);
+      break;
+#ifdef RAWHID_INTERFACE
+    case TRANSPORT_HID:
+      //The host may not poll in time, the report is sent again before it
+      // is dropped
+      for (int i=0; RawHID.send(report, FRAME_TIMEOUT) <= 0; i++) {
+        if (i == HID_SEND_TRIES - 1) {
+          HID_SEND_FAILURES++;
+          break;
+        }
+      }
+      break;
+#endif
+    case TRANSPORT_LOOPBACK:
+      //The oldest packet is dropped when the queue is full
+      if (LOOPBACK_COUNT == LOOPBACK_PACKETS) {
+        LOOPBACK_HEAD = (LOOPBACK_HEAD + 1) % LOOPBACK_PACKETS;
+        LOOPBACK_COUNT--;
+      }
+      memcpy(LOOPBACK_QUEUE[(LOOPBACK_HEAD + LOOPBACK_COUNT) % LOOPBACK_PACKETS], report, TRANSPORT_PACKET);
+      LOOPBACK_COUNT++;
+      break;
+  }
+  TRANSMIT_LENGTH = 0;
+}
+
+/*
+  loopbackTest()
+    Sends packets through the loopback transport, which encodes them as
+    raw HID reports, and checks that they are received back unchanged
+    packets - The number of packets to send
+  Sends a \x01 on the serial line if all the packets came back, \x00 if
+  not, then the time taken in us and the number of bytes sent
+  Returns nothing
+*/
+void loopbackTest(int packets) {
+  byte sent[TRANSPORT_PACKET];
+  byte received[TRANSPORT_PACKET];
+  boolean valid = true;
+  uint32_t bytes = 0;
+  
+  //Replies already gathered go to the host first
+  transportFlush();
+  byte transport = TRANSPORT;
+  TRANSPORT = TRANSPORT_LOOPBACK;
+  LOOPBACK_COUNT = 0;
+  uint32_t start = micros();
+  for (int packet=0; packet<packets; packet++) {
+    int length = 1 + packet % (TRANSPORT_PACKET - 1);
+    for (int i=0; i<length; i++) sent[i] = packet + i;
+    transportWrite(sent, length);
+    transportFlush();
+    if (transportReceive(received) != length || memcmp(sent, received, length)) valid = false;
+    bytes += length;
+  }
+  uint32_t elapsed = micros() - start;
+  TRANSPORT = transport;
+  METRICS_SENT -= bytes;
+  
+  reply(valid ? '\x01' : '\x00');
+  replyLine(elapsed);
+  replyLine(bytes);
+}
+
+/*
+  serialRead()
+    Waits for a byte on the serial line, running the pipeline stages
+    meanwhile
+  Returns the byte, or -1 if none came within FRAME_TIMEOUT ms
+*/
+int serialRead(void) {
+  uint32_t start = millis();
+  receivePump();
+  while (RECEIVE_COUNT == 0) {
+    transportFlush();
+    //The time spent in a stage is not counted, the bytes were waiting
+    if (pipeStep()) {
+      start = millis();
+    } else if (millis() - start > FRAME_TIMEOUT) {
+      return -1;
+    }
+    receivePump();
+  }
+  byte value = RECEIVE_RING[RECEIVE_HEAD];
+  RECEIVE_HEAD = (RECEIVE_HEAD + 1) % RECEIVE_SIZE;
+  RECEIVE_COUNT--;
+  METRICS_RECEIVED++;
+  return value;
+}
+
+/*
+  readFrame()
+    Reads a v2 frame once its FRAME_SOF byte has been received, runs its
+    command and sends the framed reply. Commands are run in sequence
+    order, so that the host can send a window of frames without waiting
+    for their replies
+  Returns nothing
+*/
+void readFrame(void) {
+  byte header[4];
+  byte check[2];
+  for (int i=0; i<4; i++) {
+    int value = serialRead();
+    if (value < 0) {
+      frameReject();
+      return;
+    }
+    header[i] = value;
+  }
+  int length = (header[2] | (header[3] << 8)) & ~FRAME_PACKED;
+  if (length > FRAME_MAX) {
+    frameReject();
+    return;
+  }
+  for (int i=0; i<length+2; i++) {
+    int value = serialRead();
+    if (value < 0) {
+      frameReject();
+      return;
+    }
+    if (i < length) FRAME_DATA[i] = value;
+    else check[i - length] = value;
+  }
+  FRAME_DATA[length] = '\x00';
+  unsigned int crc = crc16(crc16(0xFFFF, header, 4), (byte *)FRAME_DATA, length);
+  if ((unsigned int)(check[0] | (check[1] << 8)) != crc) {
+    frameReject();
+    return;
+  }
+  if (PACK_SESSION) PACK_RECEIVED_WIRE += length;
+  if (header[3] & (FRAME_PACKED >> 8)) {
+    //The payload is uncompressed back in FRAME_DATA
+    int unpacked = PACK_SESSION ? packDecode((byte *)FRAME_DATA, length, PACK_BUFFER, FRAME_MAX) : -1;
+    if (unpacked < 0) {
+      FRAME_ERRORS++;
+      frameNak();
+      return;
+    }
+    memcpy(FRAME_DATA, PACK_BUFFER, unpacked);
+    length = unpacked;
+    FRAME_DATA[length] = '\x00';
+  }
+  if (PACK_SESSION) PACK_RECEIVED_RAW += length;
+  FRAME_COUNT++;
+  
+  byte sequence = header[0];
+  int command = header[1];
+  if (!pipeQueued(command) && !pipeBypass(command)) pipeFlush();
+  if (command == FRAME_HELLO) {
+    //Starts a new session at this sequence number
+    byte options = (length > 0) ? (FRAME_DATA[0] & HELLO_PACK) : 0;
+    byte hello[5] = {2, FRAME_WINDOW, FRAME_MAX & 0xFF, FRAME_MAX >> 8, options};
+    FRAME_EXPECTED = sequence + 1;
+    PACK_SESSION = false;
+    sendFrame(sequence, FRAME_REPLY | command, hello, sizeof(hello));
+    PACK_SESSION = (options & HELLO_PACK);
+    return;
+  }
+  if (sequence != FRAME_EXPECTED) {
+    if ((byte)(FRAME_EXPECTED - sequence) > FRAME_WINDOW) {
+      frameNak();
+    } else if (pipeWaiting(sequence)) {
+      //Still in the pipeline, its reply is sent once it is written
+    } else if (REPLY_KEPT && REPLY_KEPT_SEQUENCE == sequence) {
+      //Its reply was lost, it is sent again without running it twice
+      sendFrame(sequence, FRAME_REPLY | REPLY_KEPT_COMMAND, REPLY_DATA, REPLY_LENGTH);
+    } else {
+      //Already run, and its reply is not kept anymore
+      sendFrame(sequence, FRAME_REPLY | command, NULL, 0);
+    }
+    return;
+  }
+  FRAME_EXPECTED++;
+  
+  if (pipeQueued(command)) {
+    //The reply is sent by the write stage of the pipeline
+    pipeQueue(command, (byte *)FRAME_DATA, length, sequence, true);
+    return;
+  }
+  replyStart(sequence);
+  runCommand(command, FRAME_DATA, length);
+  //An export ends its reply once sent
+  if (EXPORT_RUNNING) return;
+  replyFinish(command);
+  PACK_REPLY = true;
+}
+
+/*
+  frameReject()
+    Drops a damaged frame. The rest of the frame is skipped, then the host
+    is asked to send again from the expected sequence number
+  Returns nothing
+*/
+void frameReject(void) {
+  FRAME_ERRORS++;
+  while (serialRead() >= 0);
+  frameNak();
+}
+
+/*
+  frameNak()
+    Asks the host to send the frames again, from the expected sequence
+    number
+  Returns nothing
+*/
+void frameNak(void) {
+  byte expected = FRAME_EXPECTED;
+  sendFrame(expected, FRAME_NAK, &expected, 1);
+}
+
+/*
+  sendFrame()
+    Sends a v2 frame on the serial line, compressed in a session with
+    HELLO_PACK when PACK_REPLY is true and this makes it shorter
+    sequence - The sequence number
+    command - The frame command
+    data - The payload
+    length - The length of the payload, up to FRAME_MAX
+  Returns nothing
+*/
+void sendFrame(byte sequence, byte command, byte * data, int length) {
+  unsigned int field = length;
+  if (PACK_SESSION && PACK_REPLY && length > 0) {
+    PACK_SENT_RAW += length;
+    int packed = packEncode(data, length, PACK_BUFFER, length - 1);
+    if (packed >= 0) {
+      data = PACK_BUFFER;
+      length = packed;
+      field = length | FRAME_PACKED;
+    }
+    PACK_SENT_WIRE += length;
+  }
+  byte header[5] = {FRAME_SOF, sequence, command, (byte)(field & 0xFF), (byte)(field >> 8)};
+  unsigned int crc = crc16(crc16(0xFFFF, header + 1, 4), data, length);
+  byte check[2] = {(byte)(crc & 0xFF), (byte)(crc >> 8)};
+  transportWrite(header, 5);
+  transportWrite(data, length);
+  transportWrite(check, 2);
+}
+
+/*
+  packEncode()
+    Compresses a frame payload
+    data - The payload
+    length - The length of the payload
+    packed - A buffer receiving the compressed payload
+    limit - The size of the buffer
+  Returns the length of the compressed payload, or -1 if it does not fit
+*/
+int packEncode(byte * data, int length, byte * packed, int limit) {
+  int output = 0;
+  int flags = 0;
+  int item = 8;
+  int position = 0;
+  while (position < length) {
+    if (item == 8) {
+      if (output >= limit) return -1;
+      flags = output;
+      packed[output++] = 0;
+      item = 0;
+    }
+    //Longest match in the window
+    int best = 0;
+    int distance = 0;
+    for (int back=1; back<=min(position, PACK_WINDOW); back++) {
+      int match = 0;
+      while (match < PACK_MATCH_MAX && position + match < length &&
+             data[position + match] == data[position - back + match]) {
+        match++;
+      }
+      if (match > best) {
+        best = match;
+        distance = back;
+      }
+    }
+    if (best >= PACK_MATCH_MIN) {
+      if (output + 2 > limit) return -1;
+      packed[output++] = distance - 1;
+      packed[output++] = best - PACK_MATCH_MIN;
+      position += best;
+    } else {
+      if (output + 1 > limit) return -1;
+      packed[flags] |= 1 << item;
+      packed[output++] = data[position++];
+    }
+    item++;
+  }
+  return output;
+}
+
+/*
+  packDecode()
+    Uncompresses a frame payload
+    packed - The compressed payload
+    length - The length of the compressed payload
+    data - A buffer receiving the payload
+    limit - The size of the buffer
+  Returns the length of the payload, or -1 if the compressed payload is
+  invalid or the payload does not fit
+*/
+int packDecode(byte * packed, int length, byte * data, int limit) {
+  int output = 0;
+  int position = 0;
+  while (position < length) {
+    byte flags = packed[position++];
+    for (int item=0; item<8 && position<length; item++) {
+      if (flags & (1 << item)) {
+        if (output >= limit) return -1;
+        data[output++] = packed[position++];
+      } else {
+        if (position + 2 > length) return -1;
+        int distance = packed[position] + 1;
+        int match = packed[position + 1] + PACK_MATCH_MIN;
+        position += 2;
+        if (distance > output || output + match > limit) return -1;
+        for (int i=0; i<match; i++, output++) data[output] = data[output - distance];
+      }
+    }
+  }
+  return output;
+}
+
+/*
+  replyStart()
+    Starts the framed reply of a v2 command
+    sequence - The sequence number of the command frame
+  Returns nothing
+*/
+void replyStart(byte sequence) {
+  REPLY_FRAMED = true;
+  REPLY_SEQUENCE = sequence;
+  REPLY_LENGTH = 0;
+  REPLY_SPLIT = false;
+  REPLY_KEPT = false;
+}
+
+/*
+  replyFinish()
+    Sends the last frame of the reply of a v2 command. A reply sent in a
+    single frame is kept in REPLY_DATA until the next reply starts
+    command - The command number
+  Returns nothing
+*/
+void replyFinish(byte command) {
+  sendFrame(REPLY_SEQUENCE, FRAME_REPLY | command, REPLY_DATA, REPLY_LENGTH);
+  REPLY_FRAMED = false;
+  REPLY_KEPT = !REPLY_SPLIT;
+  REPLY_KEPT_SEQUENCE = REPLY_SEQUENCE;
+  REPLY_KEPT_COMMAND = command;
+}
+
+/*
+  reply()
+    Sends a byte of a command reply. In a v2 command, the reply is
+    buffered to be sent as a frame, and a full buffer is sent as a
+    FRAME_MORE frame
+    value - The byte to send
+  Returns nothing
+*/
+void reply(byte value) {
+  if (!REPLY_FRAMED) {
+    transportWrite(&value, 1);
+    return;
+  }
+  if (REPLY_LENGTH == FRAME_MAX) {
+    sendFrame(REPLY_SEQUENCE, FRAME_MORE, REPLY_DATA, REPLY_LENGTH);
+    REPLY_LENGTH = 0;
+    REPLY_SPLIT = true;
+  }
+  REPLY_DATA[REPLY_LENGTH++] = value;
+}
+
+/*
+  replyText()
+    Sends a string as part of a command reply
+    text - The string to send
+  Returns nothing
+*/
+void replyText(const char * text) {
+  while (*text) reply(*text++);
+}
+
+/*
+  replyLine()
+    Sends a line of a command reply, as Serial.println() does
+    text - The line to send
+  Returns nothing
+*/
+void replyLine(const char * text) {
+  replyText(text);
+  replyText("\r\n");
+}
+
+/*
+  replyLine()
+    Sends a number on its own line, as part of a command reply
+    value - The number to send
+  Returns nothing
+*/
+void replyLine(uint32_t value) {
+  char text[12];
+  snprintf(text, sizeof(text), "%lu", (unsigned long)value);
+  replyLine(text);
+}
+
+/*
+  replyLine()
+    Sends a signed number on its own line, as part of a command reply
+    value - The number to send
+  Returns nothing
+*/
+void replyLine(int32_t value) {
+  char text[12];
+  snprintf(text, sizeof(text), "%ld", (long)value);
+  replyLine(text);
+}
+
+/*
+  makeDir()
+    Creates a folder on the SD card
+    path - The path for the folder
+    Sends a \x01 on the serial line if the creation is successfull
+    Sends a \x00 if it fails
+  Returns nothing
+*/
+void makeDir(char * path){
+  if (compactBusy(path) || !pathMissing(path)) {
+    reply('\x00');
+  }else{
+    char parent[PATH_LENGTH];
+    char name[13];
+    char * component;
+    
+    boolean created = SD.mkdir(path);
+    //mkdir also creates the missing parent folders, even when it fails
+    // further down the path
+    pathForgetMissing();
+    if (!created) {
+      strcpy(parent, "/");
+      component = path;
+      while ((component = nextComponent(component, name))) {
+        cacheInvalidate(pathHash(parent));
+        char child[PATH_LENGTH];
+        joinPath(parent, name, child);
+        strcpy(parent, child);
+      }
+      reply('\x00');
+      return;
+    }
+    pathRemember(path, ENTRY_FOLDER);
+    
+    if (catalogAdd(path, ENTRY_FOLDER, 0) >= 0) catalogSave();
+    digestForget(path);
+    VAULT_CHANGED = true;
+    
+    //Add each folder of the path to the filter and the index of its parent
+    strcpy(parent, "/");
+    component = path;
+    while ((component = nextComponent(component, name))) {
+      cacheInvalidate(pathHash(parent));
+      indexInsert(parent, name, ENTRY_FOLDER);
+      char child[PATH_LENGTH];
+      joinPath(parent, name, child);
+      bloomAdd(child);
+      strcpy(parent, child);
+    }
+    bloomGrow();
+    bloomSave();
+    reply('\x01');
+  }
+}
+
+/*
+  listFolder()
+    Lists the current folder and outputs the result in the serial
+    path - A string with the folder name
+  A \x01 is sent to the serial line at the end of the procedure.
+  Returns nothing
+*/
+void listFolder(char * path) {
+  File folder = SD.open(path);
+  if (folder.isDirectory()) {
+    while( File content = folder.openNextFile()) {
+      if (vaultFile(content.name())) {
+        //Vault metadata
+      }else if (content.isDirectory()) {
+        replyText(content.name());
+        replyLine("/");
+      }else{
+        replyLine(content.name());
+      }
+      content.close();
+    }
+    //The records of the raw vault have no directory entry
+    char record_path[PATH_LENGTH];
+    uint32_t key = pathHash(path);
+    for (int slot=0; slot<RAW_SLOTS; slot++) {
+      if (RAW_LIVE[slot] && RAW_PARENT[slot] == key && rawPath(slot, record_path)) {
+        replyLine(baseName(record_path));
+      }
+    }
+  }else{
+    reply('\x00'); //Command NOK, folder is a file
+  }
+  folder.close();
+}
+
+/*
+  listPage()
+    Sends a page of the entries of a folder in binary form, from the
+    directory blocks in the block cache. The cursor is the index of the
+    directory entry to start from, so pages stay valid when entries are
+    added to the folder
+    path - The path of the folder
+    cursor - The cursor returned by the previous page, 0 for the first one
+  Sends a \x01 on the serial line, the number of entries, then each entry
+  as type, directory entry index and size on 4 bytes, name length and
+  name, then the cursor of the next page, little endian. The cursor is
+  LIST_CURSOR_END after the last page
+  Sends a \x00 if the path is not a folder
+  Returns nothing
+*/
+void listPage(char * path, uint32_t cursor) {
+  byte entries[LIST_PAGE * 22];
+  char name[13];
+  int length = 0;
+  int count = 0;
+  if (pathLookup(path) != ENTRY_FOLDER) {
+    reply('\x00');
+    return;
+  }
+  
+  uint32_t key = pathHash(path);
+  uint32_t check = pathCheck(path);
+  if (cursor < LIST_CURSOR_RAW) {
+    File directory = SD.open(path);
+    if (!directory) {
+      reply('\x00');
+      return;
+    }
+    int type = ENTRY_SKIP;
+    while (count < LIST_PAGE &&
+           (type = readDirEntry(directory, key, check, cursor, name)) != ENTRY_END) {
+      if (type != ENTRY_SKIP) {
+        entries[length] = type;
+        writeLong(entries + length + 1, cursor);
+        writeLong(entries + length + 5, readDirSize(directory, key, check, cursor));
+        entries[length + 9] = strlen(name);
+        memcpy(entries + length + 10, name, strlen(name));
+        length += 10 + strlen(name);
+        count++;
+      }
+      cursor++;
+    }
+    directory.close();
+    if (type == ENTRY_END) cursor = LIST_CURSOR_RAW;
+  }
+  
+  //The records of the raw vault have no directory entry
+  char record_path[PATH_LENGTH];
+  byte block[BLOCK_SIZE];
+  while (cursor >= LIST_CURSOR_RAW && cursor != LIST_CURSOR_END && count < LIST_PAGE) {
+    int slot = cursor - LIST_CURSOR_RAW;
+    cursor = (slot + 1 < RAW_SLOTS) ? cursor + 1 : LIST_CURSOR_END;
+    if (slot >= RAW_SLOTS || !RAW_LIVE[slot] || RAW_PARENT[slot] != key ||
+        !rawPath(slot, record_path) || !rawRead(slot, block)) continue;
+    char * record_name = baseName(record_path);
+    entries[length] = ENTRY_FILE;
+    writeLong(entries + length + 1, LIST_CURSOR_RAW + slot);
+    writeLong(entries + length + 5, min(block[2] | (block[3] << 8), RECORD_MAX));
+    entries[length + 9] = strlen(record_name);
+    memcpy(entries + length + 10, record_name, strlen(record_name));
+    length += 10 + strlen(record_name);
+    count++;
+  }
+  wipe(block, sizeof(block));
+  
+  reply('\x01');
+  reply(count);
+  for (int i=0; i<length; i++) reply(entries[i]);
+  byte next[4];
+  writeLong(next, cursor);
+  for (int i=0; i<4; i++) reply(next[i]);
+}
+
+/*
+  sendStats()
+    Sends the cache counters on the serial line, one per line
+    Order is block cache hits, block cache misses, path cache hits,
+    path cache misses, catalog entries, catalog load time in ms,
+    prefetch cache hits, prefetch cache misses, record loads from the
+    card, their total time in us, record stores, their total time in us,
+    missing paths found by the Bloom filters, missing paths looked up on
+    the card, records checked by the verifier, mismatches found, time in
+    ms from unlock to the first password, v2 frames received, damaged
+    v2 frames, highest receive ring occupancy, write commands that waited
+    for the pipeline, pipeline stage runs, then the sums of the receive
+    ring, encrypt stage and write stage occupancies over these runs, then
+    the payload bytes received and sent in compressed sessions, before and
+    after compression, then the raw HID reports dropped
+  Returns nothing
+*/
+void sendStats(void) {
+  replyLine(CACHE_HITS);
+  replyLine(CACHE_MISSES);
+  replyLine(PATH_HITS);
+  replyLine(PATH_MISSES);
+  replyLine((int32_t)CATALOG_COUNT);
+  replyLine(CATALOG_LOAD_TIME);
+  replyLine(PREFETCH_HITS);
+  replyLine(PREFETCH_MISSES);
+  replyLine(RECORD_LOADS);
+  replyLine(RECORD_LOAD_TIME);
+  replyLine(RECORD_STORES);
+  replyLine(RECORD_STORE_TIME);
+  replyLine(BLOOM_SKIPS);
+  replyLine(BLOOM_MISSES);
+  replyLine(VERIFY_CHECKED);
+  replyLine(VERIFY_ERRORS);
+  replyLine(TIME_TO_PASSWORD);
+  replyLine(FRAME_COUNT);
+  replyLine(FRAME_ERRORS);
+  replyLine((int32_t)RECEIVE_PEAK);
+  replyLine(PIPE_STALLS);
+  replyLine(PIPE_SAMPLES);
+  replyLine(PIPE_RECEIVE_SUM);
+  replyLine(PIPE_ENCRYPT_SUM);
+  replyLine(PIPE_WRITE_SUM);
+  replyLine(PACK_RECEIVED_RAW);
+  replyLine(PACK_RECEIVED_WIRE);
+  replyLine(PACK_SENT_RAW);
+  replyLine(PACK_SENT_WIRE);
+  replyLine(HID_SEND_FAILURES);
+}
+
+/*
+  updateFile()
+    Writes a section in a record file, creating the file if needed. The
+    update is appended to the journal, and written to the record file at
+    the next checkpoint
+    path - The path of the record file
+    file_type - The type of record, used if the file has to be created
+    section_type - The type of section to write
+    data_len - The length of the section data
+    data - The section data, which can contain any byte value
+  Sends a \x01 on the serial line if the section has been journaled
+  Sends a \x00 if it fails
+  Returns nothing
+*/
+void updateFile(char * path, int file_type, int section_type, int data_len, byte * data) {
+  char parent[PATH_LENGTH];
+  parentPath(path, parent);
+  if (strlen(path) >= PATH_LENGTH || pathLookup(parent) != ENTRY_FOLDER) {
+    reply('\x00');
+    return;
+  }
+  if (!journalAppend('S', path, file_type, section_type, data_len, data)) {
+    reply('\x00');
+    return;
+  }
+  reply('\x01');
+}
+
+/*
+  batchCreate()
+    Writes many sections from a single command. The data is a list of
+    sections, each as a create command: path length, path, record type,
+    section type, data length and cleartext data.
+    The sections are sorted by path, so that the parent folder of each
+    folder is checked once and the sections of a record are journaled
+    together and folded in the record by the same checkpoint. The order of
+    the sections of a record is kept. The AES key schedule computed at
+    unlock is used for the whole batch
+    data - The list of sections
+    length - The length of the list
+  Sends a \x01 on the serial line if all the sections have been journaled
+  Sends a \x00 if some failed, then the number of journaled sections
+  Returns nothing
+*/
+void batchCreate(byte * data, int length) {
+  int offset[BATCH_MAX];
+  int count = 0;
+  boolean failed = false;
+  
+  //Each section needs at least its 4 length and type bytes
+  int position = 0;
+  while (position + 4 <= length) {
+    int path_len = data[position];
+    if (path_len + 4 > length - position) break;
+    int end = position + path_len + 4 + data[position + path_len + 3];
+    if (end > length) break;
+    if (count == BATCH_MAX || path_len >= PATH_LENGTH ||
+        data[position + path_len + 3] > FIELD_MAX) {
+      failed = true;
+    } else {
+      offset[count++] = position;
+    }
+    position = end;
+  }
+  if (position != length) failed = true;
+  
+  //Insertion sort, which keeps the order of the sections of a record
+  for (int i=1; i<count; i++) {
+    int current = offset[i];
+    int j = i;
+    while (j > 0 && batchCompare(data, offset[j-1], current) > 0) {
+      offset[j] = offset[j-1];
+      j--;
+    }
+    offset[j] = current;
+  }
+  
+  char path[PATH_LENGTH];
+  char parent[PATH_LENGTH];
+  char checked[PATH_LENGTH] = {0};
+  boolean folder = false;
+  int stored = 0;
+  for (int i=0; i<count; i++) {
+    byte * section = data + offset[i];
+    int path_len = section[0];
+    memcpy(path, section + 1, path_len);
+    path[path_len] = '\x00';
+    parentPath(path, parent);
+    if (strcmp(parent, checked)) {
+      strcpy(checked, parent);
+      folder = (pathLookup(parent) == ENTRY_FOLDER);
+    }
+    if (!folder) {
+      failed = true;
+      continue;
+    }
+    
+    //A record starts a new checkpoint if its sections would not fit in
+    // the current one
+    if (i == 0 || batchCompare(data, offset[i-1], offset[i])) {
+      int sections = 1;
+      while (i + sections < count && !batchCompare(data, offset[i], offset[i + sections])) {
+        sections++;
+      }
+      if (JOURNAL_ENTRIES + sections > JOURNAL_CHECKPOINT) journalCheckpoint();
+    }
+    
+    //Encrypted straight from the command data
+    int crypted = encryptView(&CIPHER, section + path_len + 4, section[path_len + 3], CRYPTED);
+    if (journalAppend('S', path, section[path_len + 1], section[path_len + 2],
+                      crypted, CRYPTED)) {
+      stored++;
+    } else {
+      failed = true;
+    }
+  }
+  wipe(data, length);
+  
+  reply(failed ? '\x00' : '\x01');
+  replyLine((int32_t)stored);
+}
+
+/*
+  batchCompare()
+    Compares the paths of two sections of a batch create command. Case is
+    ignored, as it is by the FAT names and pathHash()
+    data - The list of sections
+    first - The offset of the first section
+    second - The offset of the second section
+  Returns a negative value, zero or a positive value as strcmp() does
+*/
+int batchCompare(byte * data, int first, int second) {
+  int length = min(data[first], data[second]);
+  for (int i=1; i<=length; i++) {
+    int result = toupper(data[first + i]) - toupper(data[second + i]);
+    if (result) return result;
+  }
+  return data[first] - data[second];
+}
+
+/*
+  journalAppend()
+    Appends an entry to the journal. The journal is flushed every
+    JOURNAL_BATCH entries and folded every JOURNAL_CHECKPOINT entries, so
+    a power loss can only lose the entries since the last flush
+    type - The entry type
+    path - The path of the record
+    file_type - The record type, or the new record flag for an image
+    section_type - The section type
+    data_len - The length of the data
+    data - The section data or the record image
+  Returns true if the entry has been written. Section updates are refused
+  while the images of a failed checkpoint cannot be written, or while a
+  full journal cannot be folded
+*/
+boolean journalAppend(int type, const char * path, int file_type, int section_type, int data_len, byte * data) {
+  if (type == 'S' && (((JOURNAL_IMAGED || JOURNAL_ENTRIES >= JOURNAL_CHECKPOINT) &&
+                       !journalCheckpoint()) || compactBusy(path))) return false;
+  if (!JOURNAL) {
+    JOURNAL = SD.open(JOURNAL_NAME, FILE_WRITE);
+    if (!JOURNAL) return false;
+    pathRemember(JOURNAL_NAME, ENTRY_FILE);
+  }
+  byte header[6];
+  header[0] = type;
+  header[1] = strlen(path);
+  header[2] = file_type;
+  header[3] = section_type;
+  header[4] = data_len & 0xFF;
+  header[5] = data_len >> 8;
+  unsigned int crc = crc16(0xFFFF, header, 6);
+  crc = crc16(crc, (byte *)path, header[1]);
+  crc = crc16(crc, data, data_len);
+  byte footer[2] = { (byte)(crc & 0xFF), (byte)(crc >> 8) };
+  
+  int written = JOURNAL.write(header, 6);
+  written += JOURNAL.write((byte *)path, header[1]);
+  written += JOURNAL.write(data, data_len);
+  written += JOURNAL.write(footer, 2);
+  JOURNAL_LAST = millis();
+  if (++JOURNAL_PENDING >= JOURNAL_BATCH) {
+    JOURNAL.flush();
+    JOURNAL_PENDING = 0;
+  }
+  if (type == 'S' && ++JOURNAL_ENTRIES >= JOURNAL_CHECKPOINT) {
+    journalCheckpoint();
+  }
+  return (written == 6 + header[1] + data_len + 2);
+}
+
+/*
+  journalRead()
+    Reads the journal entry at the current position of the journal file
+    header - A 6 bytes buffer receiving the entry header
+    path - A PATH_LENGTH bytes buffer receiving the path
+    data - A RECORD_MAX bytes buffer receiving the data
+  Returns the entry type, or 0 at the end of the journal or if the entry
+  is incomplete
+*/
+int journalRead(byte * header, char * path, byte * data) {
+  byte footer[2];
+  if (JOURNAL.read(header, 6) != 6) return 0;
+  int path_len = header[1];
+  int data_len = header[4] | (header[5] << 8);
+  if (path_len >= PATH_LENGTH || data_len > RECORD_MAX) return 0;
+  if (JOURNAL.read((byte *)path, path_len) != path_len) return 0;
+  path[path_len] = '\x00';
+  if (JOURNAL.read(data, data_len) != data_len) return 0;
+  if (JOURNAL.read(footer, 2) != 2) return 0;
+  unsigned int crc = crc16(0xFFFF, header, 6);
+  crc = crc16(crc, (byte *)path, path_len);
+  crc = crc16(crc, data, data_len);
+  if (footer[0] != (crc & 0xFF) || footer[1] != (crc >> 8)) return 0;
+  return header[0];
+}
+
+/*
+  journalCheckpoint()
+    Folds the journal in the record files, then removes it.
+    First, the section updates of each record are applied to the record
+    read from the card, and the resulting record images are appended to
+    the journal, followed by an 'E' entry. Then the images are written to
+    the record files. If this is interrupted, the images are written again
+    on the next checkpoint, and if the images were not complete the card
+    was not modified yet and they are computed again. Incomplete entries
+    at the end of the journal are ignored. If a record cannot be written,
+    the journal is kept and its images are written on the next checkpoint.
+    journalAppend() keeps at most JOURNAL_CHECKPOINT section updates in
+    the journal, so that every record can be folded
+  Returns true if the journal has been folded, or if there is none
+*/
+boolean journalCheckpoint(void) {
+  byte header[6];
+  char path[PATH_LENGTH];
+  byte data[RECORD_MAX];
+  
+  if (!JOURNAL) {
+    if (pathLookup(JOURNAL_NAME) != ENTRY_FILE) return true;
+    JOURNAL = SD.open(JOURNAL_NAME, FILE_WRITE);
+    if (!JOURNAL) return false;
+  }
+  JOURNAL.flush();
+  
+  //Find the end of the valid entries, and whether the images are complete
+  boolean imaged = false;
+  uint32_t end = 0;
+  int type;
+  JOURNAL_ENTRIES = 0;
+  JOURNAL.seek(0);
+  while ((type = journalRead(header, path, data))) {
+    if (type == 'E') imaged = true;
+    if (type == 'S') JOURNAL_ENTRIES++;
+    end = JOURNAL.position();
+  }
+  
+  if (!imaged) {
+    byte record[RECORD_MAX];
+    uint32_t done[JOURNAL_CHECKPOINT];
+    int done_count = 0;
+    uint32_t offset = 0;
+    while (offset < end) {
+      uint32_t start = offset;
+      JOURNAL.seek(offset);
+      type = journalRead(header, path, data);
+      offset = JOURNAL.position();
+      if (type != 'S') continue;
+      
+      //Each record is folded once, with all its updates in order
+      uint32_t key = pathHash(path);
+      boolean folded = false;
+      for (int i=0; i<done_count; i++) {
+        if (done[i] == key) folded = true;
+      }
+      if (folded) continue;
+      //Cannot happen as long as journalAppend() bounds the journal. The
+      // journal is kept whole rather than folded in part
+      if (done_count >= JOURNAL_CHECKPOINT) return false;
+      done[done_count++] = key;
+      
+      //A record missing from the Bloom filter of its folder is new, and
+      // is not looked up on the card
+      boolean created = pathMissing(path);
+      int length = created ? 0 : loadRecord(path, record);
+      if (length < 2) created = true;
+      if (created) {
+        record[0] = 0x42;
+        record[1] = header[2];
+        length = 2;
+      }
+      char record_path[PATH_LENGTH];
+      strcpy(record_path, path);
+      uint32_t scan = start;
+      while (scan < end) {
+        JOURNAL.seek(scan);
+        type = journalRead(header, path, data);
+        scan = JOURNAL.position();
+        if (type == 'S' && pathHash(path) == key) {
+          int data_len = header[4] | (header[5] << 8);
+          int new_length = spliceSection(record, length, header[3], data_len, data);
+          if (new_length > 0) length = new_length;
+        }
+      }
+      JOURNAL.seek(end);
+      //Without its 'E' entry, the images are computed again next time
+      if (!journalAppend('R', record_path, created ? 1 : 0, 0, length, record)) return false;
+      end = JOURNAL.position();
+    }
+    JOURNAL.seek(end);
+    journalAppend('E', "", 0, 0, 0, data);
+    JOURNAL.flush();
+    end = JOURNAL.position();
+  }
+  
+  //The filters have to know the new records before they exist
+  uint32_t offset = 0;
+  while (offset < end) {
+    JOURNAL.seek(offset);
+    type = journalRead(header, path, data);
+    if (!type) break;
+    offset = JOURNAL.position();
+    if (type == 'R' && header[2]) bloomAdd(path);
+  }
+  bloomSave();
+  
+  //Write the record images
+  boolean created = false;
+  boolean failed = false;
+  offset = 0;
+  while (offset < end) {
+    JOURNAL.seek(offset);
+    type = journalRead(header, path, data);
+    if (!type) break;
+    offset = JOURNAL.position();
+    if (type != 'R') continue;
+    int length = header[4] | (header[5] << 8);
+    if (!storeRecord(path, data, length)) {
+      failed = true;
+      continue;
+    }
+    if (header[2] && length >= 2) {
+      char parent[PATH_LENGTH];
+      parentPath(path, parent);
+      catalogAdd(path, ENTRY_FILE, data[1]);
+      indexInsert(parent, baseName(path), ENTRY_FILE);
+      created = true;
+    }
+    manifestUpdate(path, data, length);
+  }
+  if (created) {
+    catalogSave();
+    VAULT_CHANGED = true;
+    //Now that the new records exist, a full filter can be built again
+    bloomGrow();
+    bloomSave();
+  }
+  //Done before the journal is removed, so that a power loss replays it
+  manifestCommit();
+  
+  if (failed) {
+    //Writing the images again is harmless, the journal is kept for the
+    // next checkpoint, retried once the journal has been idle again
+    JOURNAL.flush();
+    JOURNAL_IMAGED = true;
+    JOURNAL_LAST = millis();
+    return false;
+  }
+  JOURNAL.close();
+  SD.remove(JOURNAL_NAME);
+  pathForget(JOURNAL_NAME);
+  JOURNAL_PENDING = 0;
+  JOURNAL_ENTRIES = 0;
+  JOURNAL_IMAGED = false;
+  return true;
+}
+
+/*
+  crc16()
+    Updates a CRC-16 (CCITT) with new data
+    crc - The current CRC value, 0xFFFF to start a new one
+    data - The data
+    length - The length of the data
+  Returns the updated CRC
+*/
+unsigned int crc16(unsigned int crc, byte * data, int length) {
+  for (int i=0; i<length; i++) {
+    crc ^= (unsigned int)data[i] << 8;
+    for (int bit=0; bit<8; bit++) {
+      crc = (crc & 0x8000) ? ((crc << 1) ^ 0x1021) : (crc << 1);
+    }
+    crc &= 0xFFFF;
+  }
+  return crc;
+}
+
+/*
+  spliceSection()
+    Replaces a section of a record in memory, or appends it if the record
+    does not contain it yet. The following sections are moved so that the
+    new section can be of a different size than the old one
+    record - The record buffer, RECORD_MAX bytes long
+    length - The current length of the record
+    section_type - The type of the section to write
+    data_len - The length of the section data
+    data - The section data
+  Returns the new length of the record, or -1 if it would not fit
+*/
+int spliceSection(byte * record, int length, int section_type, int data_len, byte * data) {
+  int offset = 2;
+  boolean found = false;
+  while (offset + 1 < length) {
+    if (record[offset] == section_type) {
+      found = true;
+      break;
+    }
+    offset += (record[offset+1]+2); // go to next header offset
+  }
+  int old_len = 0;
+  if (found) {
+    old_len = record[offset+1]+2;
+    if (offset + old_len > length) old_len = length - offset;
+  } else {
+    //Drop any truncated section at the end of the record
+    if (offset > length) offset = length;
+    length = offset;
+  }
+  int new_length = length - old_len + data_len + 2;
+  if (new_length > RECORD_MAX) return -1;
+  memmove(record + offset + data_len + 2, record + offset + old_len, length - offset - old_len);
+  record[offset] = (byte)section_type;
+  record[offset+1] = (byte)data_len;
+  memcpy(record + offset + 2, data, data_len);
+  return new_length;
+}
+
+/*
+  loadRecord()
+    Reads a whole record in memory, through the block cache. The record
+    is read from the raw vault if it is there, from its file otherwise
+    path - The path of the record file
+    record - A RECORD_MAX bytes buffer
+  Returns the length of the record, 0 if the file does not exist
+*/
+int loadRecord(char * path, byte * record) {
+  uint32_t key = pathHash(path);
+  uint32_t check = pathCheck(path);
+  int slot = cacheLookup(key, check, 0);
+  if (slot < 0) {
+    uint32_t start = micros();
+    int raw = rawFind(key);
+    if (raw >= 0) {
+      byte block[BLOCK_SIZE];
+      if (!rawRead(raw, block)) return 0;
+      int length = min(block[2] | (block[3] << 8), RECORD_MAX);
+      slot = cacheStore(key, check, 0, block + RAW_HEADER, length);
+    } else {
+      if (pathLookup(path) != ENTRY_FILE) return 0;
+      File file = SD.open(path);
+      if (!file) return 0;
+      slot = cacheFill(file, key, check, 0);
+      file.close();
+    }
+    RECORD_LOADS++;
+    RECORD_LOAD_TIME += micros() - start;
+  }
+  int length = min(CACHE_LENGTH[slot], RECORD_MAX);
+  memcpy(record, CACHE_DATA[slot], length);
+  return length;
+}
+
+/*
+  recordTag()
+    Reads the record type of a record from its 2 bytes header, which is
+    not encrypted, without reading the rest of the record in the cache
+    path - The path of the record
+    raw - True if the record is in the raw vault
+  Returns the record type, 0 if the record cannot be read
+*/
+int recordTag(char * path, boolean raw) {
+  uint32_t key = pathHash(path);
+  int slot = cacheLookup(key, pathCheck(path), 0);
+  if (slot >= 0) return (CACHE_LENGTH[slot] >= 2) ? CACHE_DATA[slot][1] : 0;
+  if (raw) {
+    //A raw vault slot is a single block
+    byte block[BLOCK_SIZE];
+    int position = rawFind(key);
+    if (position < 0 || !rawRead(position, block)) return 0;
+    return ((block[2] | (block[3] << 8)) >= 2) ? block[RAW_HEADER + 1] : 0;
+  }
+  byte header[2];
+  File file = SD.open(path);
+  if (!file) return 0;
+  int length = file.read(header, 2);
+  file.close();
+  return (length == 2) ? header[1] : 0;
+}
+
+/*
+  recordRead()
+    Reads a record without going through the block cache. A record that
+    is already cached is copied from the cache
+    path - The path of the record
+    block - A BLOCK_SIZE bytes buffer receiving the record contents
+  Returns the length of the record, 0 if the record cannot be read
+*/
+int recordRead(char * path, byte * block) {
+  uint32_t key = pathHash(path);
+  int slot = cacheLookup(key, pathCheck(path), 0);
+  int length = 0;
+  if (slot >= 0) {
+    length = min(CACHE_LENGTH[slot], RECORD_MAX);
+    memcpy(block, CACHE_DATA[slot], length);
+    return length;
+  }
+  int raw = rawFind(key);
+  if (raw >= 0) {
+    if (!rawRead(raw, block)) return 0;
+    length = min(block[2] | (block[3] << 8), RECORD_MAX);
+    memmove(block, block + RAW_HEADER, length);
+  } else if (pathLookup(path) == ENTRY_FILE) {
+    File file = SD.open(path);
+    if (!file) return 0;
+    length = file.read(block, RECORD_MAX);
+    file.close();
+    if (length < 0) length = 0;
+  }
+  return length;
+}
+
+/*
+  storeRecord()
+    Replaces a record file with the given contents. Once the slots of the
+    raw vault are full, records are stored as files again
+    path - The path of the record file
+    record - The record contents
+    length - The length of the record
+  Returns true if the whole record has been written
+*/
+boolean storeRecord(char * path, byte * record, int length) {
+  uint32_t start = micros();
+  int written = 0;
+  int previous = RAW_SLOTS > 0 ? rawFind(pathHash(path)) : -1;
+  if (RAW_SLOTS > 0 && rawFree() >= 0) {
+    //A record stored as a file moves into the raw vault. Records already
+    // in a slot have no file, so their path is not walked
+    boolean moved = previous < 0 && pathLookup(path) == ENTRY_FILE;
+    if (!rawStore(path, record, length)) return false;
+    if (moved) SD.remove(path);
+    written = length;
+  } else {
+    //Opening with FILE_REWRITE truncates the old record, so the path is
+    // walked once instead of once for a remove and once for the open
+    File file = SD.open(path, FILE_REWRITE);
+    if (!file) return false;
+    written = file.write(record, length);
+    file.close();
+    //The file now holds the newest version, the slot would shadow it
+    if (previous >= 0 && written == length) rawRelease(previous);
+  }
+  pathRemember(path, ENTRY_FILE);
+  RECORD_STORES++;
+  RECORD_STORE_TIME += micros() - start;
+  
+  //Write through the cache so that the record is not read back from the
+  // card, and drop the cached directory as the file entry has changed
+  uint32_t key = pathHash(path);
+  cacheInvalidate(key);
+  cacheStore(key, pathCheck(path), 0, record, length);
+  prefetchForget(key);
+  digestForget(path);
+  char parent[PATH_LENGTH];
+  parentPath(path, parent);
+  cacheInvalidate(pathHash(parent));
+  return (written == length);
+}
+
+/*
+  rawFormat()
+    Creates the raw vault, as a contiguous file at the root of the card
+    whose blocks are then written directly, without going through FAT.
+    Existing record files are moved in the raw vault when rewritten.
+    The journal is folded first, and the current folder is opened again
+    once the file is made, so that its listing is read again
+    slots - The number of slots of the raw vault
+  Sends a \x01 on the serial line if the raw vault has been created
+  Sends a \x00 if it fails
+  Returns nothing
+*/
+void rawFormat(int slots) {
+  SdFile root;
+  SdFile file;
+  if (RAW_SLOTS > 0 || slots <= 0 || slots > RAW_SLOTS_MAX || !journalCheckpoint()) {
+    reply('\x00');
+    return;
+  }
+  boolean created = root.openRoot(&SD.volume) &&
+                    file.createContiguous(&root, RAW_NAME, (uint32_t)slots * BLOCK_SIZE);
+  file.close();
+  root.close();
+  pathForget("/" RAW_NAME);
+  cacheInvalidate(pathHash("/"));
+  openFolder(CURRENT_PATH);
+  if (!created) {
+    reply('\x00');
+    return;
+  }
+  
+  //The blocks of a new file hold whatever was there before
+  if (rawOpen() != slots) {
+    reply('\x00');
+    return;
+  }
+  for (int slot=0; slot<slots; slot++) {
+    RAW_WRITES[slot] = 0;
+    rawRelease(slot);
+  }
+  RAW_SEQUENCE = 0;
+  RAW_SLOTS = slots;
+  VAULT_CHANGED = true;
+  reply('\x01');
+}
+
+/*
+  rawMount()
+    Loads the slot headers of the raw vault in RAM at boot, if there is
+    one. The blocks are read with the card and volume of the SD library.
+    When a power loss left a record in two slots, the oldest copy is
+    released
+  Returns nothing
+*/
+void rawMount(void) {
+  byte block[BLOCK_SIZE];
+  uint32_t sequence[RAW_SLOTS_MAX];
+  RAW_SLOTS = 0;
+  if (pathLookup("/" RAW_NAME) != ENTRY_FILE) return;
+  int slots = rawOpen();
+  for (int slot=0; slot<slots; slot++) {
+    RAW_LIVE[slot] = false;
+    RAW_WRITES[slot] = 0;
+    sequence[slot] = 0;
+    if (!rawRead(slot, block) || block[0] != 'V') continue;
+    RAW_LIVE[slot] = (block[1] == 1);
+    sequence[slot] = readLong(block+4);
+    RAW_WRITES[slot] = readLong(block+8);
+    RAW_HASH[slot] = readLong(block+12);
+    char path[PATH_LENGTH];
+    memcpy(path, block + 17, min(block[16], PATH_LENGTH-1));
+    path[min(block[16], PATH_LENGTH-1)] = '\x00';
+    char parent[PATH_LENGTH];
+    parentPath(path, parent);
+    RAW_PARENT[slot] = pathHash(parent);
+    if (sequence[slot] > RAW_SEQUENCE) RAW_SEQUENCE = sequence[slot];
+  }
+  for (int slot=0; slot<slots; slot++) {
+    for (int other=0; other<slot; other++) {
+      if (!RAW_LIVE[slot] || !RAW_LIVE[other] || RAW_HASH[slot] != RAW_HASH[other]) continue;
+      rawRelease(sequence[slot] < sequence[other] ? slot : other);
+    }
+  }
+  RAW_SLOTS = slots;
+}
+
+/*
+  rawOpen()
+    Finds the blocks of the raw vault file on the card
+  Returns the number of slots of the raw vault, 0 if it cannot be used
+*/
+int rawOpen(void) {
+  SdFile root;
+  SdFile file;
+  uint32_t first = 0;
+  uint32_t last = 0;
+  if (!root.openRoot(&SD.volume) || !file.open(&root, RAW_NAME, O_READ)) {
+    root.close();
+    return 0;
+  }
+  int slots = min(file.fileSize() / BLOCK_SIZE, (uint32_t)RAW_SLOTS_MAX);
+  if (!file.contiguousRange(&first, &last) || last + 1 - first < (uint32_t)slots) {
+    //The file has been fragmented, its blocks cannot be written directly
+    slots = 0;
+  }
+  file.close();
+  root.close();
+  RAW_FIRST = first;
+  return slots;
+}
+
+/*
+  rawFind()
+    Looks for a record in the raw vault
+    key - The path hash of the record
+  Returns the slot holding the record, or -1 if it is not in the raw vault
+*/
+int rawFind(uint32_t key) {
+  for (int slot=0; slot<RAW_SLOTS; slot++) {
+    if (RAW_LIVE[slot] && RAW_HASH[slot] == key) return slot;
+  }
+  return -1;
+}
+
+/*
+  rawStore()
+    Writes a record in the raw vault. The record goes to the free slot
+    with the fewest writes, then its previous slot is released, so that
+    a power loss during the write leaves the previous version intact
+    path - The path of the record
+    record - The record contents
+    length - The length of the record
+  Returns true if the record has been written
+*/
+boolean rawStore(char * path, byte * record, int length) {
+  byte block[BLOCK_SIZE];
+  uint32_t key = pathHash(path);
+  int previous = rawFind(key);
+  int slot = rawFree();
+  int path_length = strlen(path);
+  if (slot < 0 || length > RECORD_MAX || path_length >= PATH_LENGTH) return false;
+  
+  memset(block, 0, BLOCK_SIZE);
+  block[0] = 'V';
+  block[1] = 1;
+  block[2] = length & 0xFF;
+  block[3] = length >> 8;
+  writeLong(block+4, ++RAW_SEQUENCE);
+  writeLong(block+8, RAW_WRITES[slot] + 1);
+  writeLong(block+12, key);
+  block[16] = path_length;
+  memcpy(block + 17, path, path_length);
+  memcpy(block + RAW_HEADER, record, length);
+  if (!rawWrite(slot, block)) return false;
+  RAW_WRITES[slot]++;
+  RAW_LIVE[slot] = true;
+  RAW_HASH[slot] = key;
+  char parent[PATH_LENGTH];
+  parentPath(path, parent);
+  RAW_PARENT[slot] = pathHash(parent);
+  
+  if (previous >= 0) rawRelease(previous);
+  return true;
+}
+
+/*
+  rawFree()
+    Finds the free slot of the raw vault with the fewest writes
+  Returns the slot, or -1 if all the slots hold a record
+*/
+int rawFree(void) {
+  int slot = -1;
+  for (int i=0; i<RAW_SLOTS; i++) {
+    if (!RAW_LIVE[i] && (slot < 0 || RAW_WRITES[i] < RAW_WRITES[slot])) slot = i;
+  }
+  return slot;
+}
+
+/*
+  rawRelease()
+    Marks a slot of the raw vault as free, clearing the record it held
+    slot - The slot to release
+  Returns nothing
+*/
+void rawRelease(int slot) {
+  byte block[BLOCK_SIZE];
+  memset(block, 0, BLOCK_SIZE);
+  block[0] = 'V';
+  writeLong(block+8, RAW_WRITES[slot] + 1);
+  if (rawWrite(slot, block)) RAW_WRITES[slot]++;
+  RAW_LIVE[slot] = false;
+}
+
+/*
+  rawPath()
+    Reads the path of the record held by a raw vault slot
+    slot - The slot
+    path - A PATH_LENGTH bytes buffer receiving the path
+  Returns true if the slot holds a record
+*/
+boolean rawPath(int slot, char * path) {
+  byte block[BLOCK_SIZE];
+  if (!rawRead(slot, block) || block[0] != 'V' || block[1] != 1) return false;
+  int length = min(block[16], PATH_LENGTH-1);
+  memcpy(path, block + 17, length);
+  path[length] = '\x00';
+  return true;
+}
+
+/*
+  rawRead()
+    Reads the block of a raw vault slot
+    slot - The slot
+    block - A BLOCK_SIZE bytes buffer
+  Returns true if the block has been read
+*/
+boolean rawRead(int slot, byte * block) {
+  return SD.card.readBlock(RAW_FIRST + slot, block);
+}
+
+/*
+  rawWrite()
+    Writes the block of a raw vault slot
+    slot - The slot
+    block - The BLOCK_SIZE bytes block contents
+  Returns true if the block has been written
+*/
+boolean rawWrite(int slot, byte * block) {
+  return SD.card.writeBlock(RAW_FIRST + slot, block);
+}
+
+/*
+  compactFolder()
+    Runs a slice of the compaction of a folder. The records of the folder
+    are moved to COMPACT_DIR, the folder is recreated so that its directory
+    has no deleted entries left, then the records are moved back in name
+    order, each one written in the next free clusters. The progress is
+    kept in COMPACT_STATE, so that an interrupted compaction resumes from
+    where it stopped when the command is sent again
+    path - The path of the folder, which cannot contain folders
+  Sends \x02 on the serial line if the compaction is not finished, \x01
+  once it is finished, or \x00 if the folder cannot be compacted or a
+  record could not be moved. Then
+  sends the number of bytes moved, and the time in us to scan the folder
+  before and after the compaction, one per line
+  Returns nothing
+*/
+void compactFolder(char * path) {
+  char folder[PATH_LENGTH];
+  char from[PATH_LENGTH];
+  char to[PATH_LENGTH];
+  char name[13];
+  byte state[9];
+  uint32_t after = 0;
+  
+  //The records have to be on the card before they are moved, and no
+  // journal entry may be left to write them back during the compaction
+  if (!journalCheckpoint()) {
+    reply('\x00');
+    return;
+  }
+  
+  if (!COMPACT_FOLDER[0] || !compactLoad(state, folder)) {
+    if (strcmp(path, "/") == 0 || pathLookup(path) != ENTRY_FOLDER || !compactAllowed(path)) {
+      reply('\x00');
+      return;
+    }
+    strncpy(folder, path, PATH_LENGTH-1);
+    folder[PATH_LENGTH-1] = '\x00';
+    memset(state, 0, sizeof(state));
+    state[0] = COMPACT_OUT;
+    writeLong(state+5, scanTime(folder));
+    SD.mkdir(COMPACT_DIR);
+    pathForgetMissing();
+    //The index and the filter are rebuilt once the records are back, and
+    // the folder has to be empty to be removed
+    joinPath(folder, INDEX_NAME, from);
+    SD.remove(from);
+    pathForget(from);
+    joinPath(folder, BLOOM_NAME, from);
+    SD.remove(from);
+    pathForget(from);
+    if (BLOOM_KEY == pathHash(folder)) {
+      BLOOM_KEY = 0;
+      BLOOM_DIRTY = false;
+    }
+    compactSave(state, folder);
+  } else if (pathHash(folder) != pathHash(path)) {
+    //Another folder compaction has to be finished first
+    reply('\x00');
+    return;
+  }
+  
+  //The current folder handles must not point to a removed folder
+  if (pathHash(folder) == pathHash(CURRENT_PATH)) {
+    CURRENT_DIR.close();
+    CURRENT_INDEX.close();
+  }
+  
+  uint32_t moved = readLong(state+1);
+  int count = 0;
+  boolean failed = false;
+  if (state[0] == COMPACT_OUT) {
+    while (count < COMPACT_SLICE && compactNext(folder, name)) {
+      joinPath(folder, name, from);
+      joinPath(COMPACT_DIR, name, to);
+      long length = moveFile(from, to);
+      if (length < 0) {
+        failed = true;
+        break;
+      }
+      moved += length;
+      count++;
+    }
+    if (!failed && count < COMPACT_SLICE) {
+      //The folder is empty, the new directory gets a single fresh cluster
+      SD.rmdir(folder);
+      SD.mkdir(folder);
+      cacheInvalidate(pathHash(folder));
+      state[0] = COMPACT_BACK;
+    }
+  }
+  if (!failed && state[0] == COMPACT_BACK) {
+    while (count < COMPACT_SLICE && compactNext(COMPACT_DIR, name)) {
+      joinPath(COMPACT_DIR, name, from);
+      joinPath(folder, name, to);
+      long length = moveFile(from, to);
+      if (length < 0) {
+        failed = true;
+        break;
+      }
+      moved += length;
+      count++;
+    }
+    if (!failed && count < COMPACT_SLICE) {
+      indexBuild(folder);
+      after = scanTime(folder);
+      SD.remove(COMPACT_STATE);
+      SD.rmdir(COMPACT_DIR);
+      pathForget(COMPACT_STATE);
+      pathForget(COMPACT_DIR);
+      COMPACT_FOLDER[0] = '\x00';
+      state[0] = 0;
+    }
+  }
+  writeLong(state+1, moved);
+  if (state[0]) compactSave(state, folder);
+  if (pathHash(folder) == pathHash(CURRENT_PATH)) {
+    openFolder(CURRENT_PATH);
+    VAULT_CHANGED = true;
+  }
+  
+  //A failed move leaves its source in place, the compaction resumes from
+  // it when the command is sent again
+  reply(failed ? '\x00' : state[0] ? '\x02' : '\x01');
+  replyLine(moved);
+  replyLine(readLong(state+5));
+  replyLine(after);
+}
+
+/*
+  compactAllowed()
+    Checks that a folder only holds records, as the compaction does not
+    move folders
+    path - The path of the folder
+  Returns true if the folder can be compacted
+*/
+boolean compactAllowed(char * path) {
+  char name[13];
+  File folder = SD.open(path);
+  if (!folder) return false;
+  uint32_t key = pathHash(path);
+  uint32_t check = pathCheck(path);
+  int type;
+  for (int i = 0; (type = readDirEntry(folder, key, check, i, name)) != ENTRY_END; i++) {
+    if (type == ENTRY_FOLDER) break;
+  }
+  folder.close();
+  return (type == ENTRY_END);
+}
+
+/*
+  compactNext()
+    Selects the next record to move during a compaction, which is the
+    first one in name order so that the directory ends up sorted
+    path - The path of the folder to move the record from
+    name - A 13 bytes buffer receiving the name of the record
+  Returns true if a record has been found, false if the folder is empty
+*/
+boolean compactNext(const char * path, char * name) {
+  char entry[13];
+  File folder = SD.open(path);
+  if (!folder) return false;
+  uint32_t key = pathHash(path);
+  uint32_t check = pathCheck(path);
+  boolean found = false;
+  int type;
+  for (int i = 0; (type = readDirEntry(folder, key, check, i, entry)) != ENTRY_END; i++) {
+    if (type != ENTRY_FILE) continue;
+    if (!found || strcmp(entry, name) < 0) {
+      strcpy(name, entry);
+      found = true;
+    }
+  }
+  folder.close();
+  return found;
+}
+
+/*
+  compactLoad()
+    Reads the progress of an interrupted compaction
+    state - A 9 bytes buffer receiving the state header
+    folder - A PATH_LENGTH bytes buffer receiving the folder path
+  Returns true if a compaction is in progress
+*/
+boolean compactLoad(byte * state, char * folder) {
+  if (pathLookup(COMPACT_STATE) != ENTRY_FILE) return false;
+  File file = SD.open(COMPACT_STATE);
+  if (!file) return false;
+  int length = 0;
+  if (file.read(state, 9) == 9) length = file.read();
+  if (length <= 0 || length >= PATH_LENGTH || file.read((byte *)folder, length) != length) {
+    file.close();
+    return false;
+  }
+  folder[length] = '\x00';
+  file.close();
+  return (state[0] == COMPACT_OUT || state[0] == COMPACT_BACK);
+}
+
+/*
+  compactOpen()
+    Reads the folder of an interrupted compaction once the device is
+    unlocked, so that the writes are checked against it without reading
+    the card
+  Returns nothing
+*/
+void compactOpen(void) {
+  byte state[9];
+  if (!compactLoad(state, COMPACT_FOLDER)) COMPACT_FOLDER[0] = '\x00';
+}
+
+/*
+  compactSave()
+    Writes the progress of a compaction, and keeps its folder in
+    COMPACT_FOLDER
+    state - The 9 bytes state header
+    folder - The path of the folder being compacted
+  Returns nothing
+*/
+void compactSave(byte * state, char * folder) {
+  strcpy(COMPACT_FOLDER, folder);
+  SD.remove(COMPACT_STATE);
+  File file = SD.open(COMPACT_STATE, FILE_WRITE);
+  if (!file) return;
+  pathRemember(COMPACT_STATE, ENTRY_FILE);
+  file.write(state, 9);
+  file.write((byte)strlen(folder));
+  file.write((byte *)folder, strlen(folder));
+  file.close();
+}
+
+/*
+  moveFile()
+    Moves a file by copying it to its new path, then removing the old one.
+    A copy left by an interrupted move is replaced. The old file is only
+    removed once the whole copy has been written
+    from - The current path of the file
+    to - The new path of the file
+  Returns the number of bytes moved, or -1 if the copy failed
+*/
+long moveFile(char * from, char * to) {
+  byte buffer[FIELD_MAX];
+  uint32_t moved = 0;
+  File source = SD.open(from);
+  if (!source) return -1;
+  File destination = SD.open(to, FILE_REWRITE);
+  if (!destination) {
+    source.close();
+    return -1;
+  }
+  int length;
+  while ((length = source.read(buffer, sizeof(buffer))) > 0) {
+    moved += destination.write(buffer, length);
+  }
+  destination.close();
+  boolean copied = (moved == source.size());
+  source.close();
+  pathForget(to);
+  if (!copied) return -1;
+  SD.remove(from);
+  
+  pathForget(from);
+  pathForget(to);
+  cacheInvalidate(pathHash(from));
+  cacheInvalidate(pathHash(to));
+  char parent[PATH_LENGTH];
+  parentPath(from, parent);
+  cacheInvalidate(pathHash(parent));
+  parentPath(to, parent);
+  cacheInvalidate(pathHash(parent));
+  return (long)moved;
+}
+
+/*
+  compactBusy()
+    Tells whether a path is in the folder being compacted. Its records are
+    moved out and back, so nothing can be written in it until the
+    compaction is finished
+    path - The path of a record or folder
+  Returns true if the path cannot be written
+*/
+boolean compactBusy(const char * path) {
+  char parent[PATH_LENGTH];
+  char child[PATH_LENGTH];
+  if (!COMPACT_FOLDER[0]) return false;
+  strcpy(parent, path);
+  while (parent[0] && strcmp(parent, "/") != 0) {
+    if (pathSame(parent, COMPACT_FOLDER)) return true;
+    strcpy(child, parent);
+    parentPath(child, parent);
+  }
+  return false;
+}
+
+/*
+  scanTime()
+    Measures the time taken to go through all the entries of a folder
+    with openNextFile(), which also reads the deleted entries
+    path - The path of the folder
+  Returns the scan time in us
+*/
+uint32_t scanTime(char * path) {
+  uint32_t start = micros();
+  File folder = SD.open(path);
+  if (folder) {
+    while (File content = folder.openNextFile()) {
+      content.close();
+    }
+    folder.close();
+  }
+  return micros() - start;
+}
+
+/*
+  readLong()
+    Reads a little endian 32 bits value
+    data - The 4 bytes of the value
+  Returns the value
+*/
+uint32_t readLong(byte * data) {
+  return (uint32_t)data[0] | ((uint32_t)data[1] << 8) |
+         ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+/*
+  writeLong()
+    Writes a little endian 32 bits value
+    data - A 4 bytes buffer
+    value - The value to write
+  Returns nothing
+*/
+void writeLong(byte * data, uint32_t value) {
+  for (int i=0; i<4; i++) data[i] = (value >> (i*8)) & 0xFF;
+}
+
+/*
+  pathHash()
+    Computes a hash of a path on the SD card, used as a cache key.
+    Paths are case insensitive and leading or trailing slashes are
+    ignored, so that "/dir/" and "DIR" give the same hash
+    path - The path to hash
+  Returns the hash of the path
+*/
+uint32_t pathHash(const char * path) {
+  uint32_t hash = 2166136261UL; // FNV-1a
+  while (*path == '/') path++;
+  for (; *path; path++) {
+    if (*path == '/' && path[1] == '\x00') break;
+    hash ^= (byte)toupper(*path);
+    hash *= 16777619UL;
+  }
+  return hash;
+}
+
+/*
+  pathCheck()
+    Computes a second hash of a path, independent from pathHash(). The
+    caches keep it along with the path hash, so that two paths with the
+    same hash are told apart. Paths are folded as in pathHash()
+    path - The path to hash
+  Returns the check of the path
+*/
+uint32_t pathCheck(const char * path) {
+  uint32_t check = 5381; // djb2
+  while (*path == '/') path++;
+  for (; *path; path++) {
+    if (*path == '/' && path[1] == '\x00') break;
+    check = (check * 33) ^ (byte)toupper(*path);
+  }
+  return check;
+}
+
+/*
+  nextComponent()
+    Extracts the next folder or file name of a path
+    path - The remaining part of the path
+    name - A 13 bytes buffer receiving the upper case name
+  Returns a pointer to the rest of the path, or NULL if there is no
+  more component
+*/
+char * nextComponent(char * path, char * name) {
+  while (*path == '/') path++;
+  int length = 0;
+  while (path[length] && path[length] != '/') length++;
+  if (length == 0) return NULL;
+  for (int i=0; i<12; i++) {
+    name[i] = (i < length) ? toupper(path[i]) : '\x00';
+  }
+  name[12] = '\x00';
+  return path + length;
+}
+
+/*
+  baseName()
+    Finds the last component of a path
+    path - The path of a file
+  Returns a pointer to the name of the file in path
+*/
+char * baseName(char * path) {
+  char * name = strrchr(path, '/');
+  return name ? name + 1 : path;
+}
+
+/*
+  pathLookup()
+    Resolves a path on the SD card, going through the path cache. Every
+    SD.exists() or SD.open() call walks all the folders of the path from
+    the root, so resolving the same path twice is avoided
+    path - The path to resolve
+  Returns ENTRY_FILE, ENTRY_FOLDER, or ENTRY_END if the path does not exist
+*/
+int pathLookup(const char * path) {
+  uint32_t key = pathHash(path);
+  uint32_t check = pathCheck(path);
+  for (int i=0; i<PATH_CACHE_SLOTS; i++) {
+    if (PATH_CACHE_USED[i] && PATH_CACHE_KEY[i] == key && PATH_CACHE_CHECK[i] == check) {
+      PATH_CACHE_USED[i] = ++CACHE_CLOCK;
+      PATH_HITS++;
+      return PATH_CACHE_TYPE[i];
+    }
+  }
+  PATH_MISSES++;
+  int type = ENTRY_END;
+  if (rawFind(key) >= 0) {
+    type = ENTRY_FILE;
+  } else {
+    File file = SD.open(path);
+    if (file) {
+      type = file.isDirectory() ? ENTRY_FOLDER : ENTRY_FILE;
+      file.close();
+    }
+  }
+  pathRemember(path, type);
+  return type;
+}
+
+/*
+  pathRemember()
+    Stores the type of a path in the path cache
+    path - The path
+    type - ENTRY_FILE, ENTRY_FOLDER, or ENTRY_END if it does not exist
+  Returns nothing
+*/
+void pathRemember(const char * path, int type) {
+  uint32_t key = pathHash(path);
+  uint32_t check = pathCheck(path);
+  int slot = 0;
+  for (int i=0; i<PATH_CACHE_SLOTS; i++) {
+    if (PATH_CACHE_USED[i] && PATH_CACHE_KEY[i] == key && PATH_CACHE_CHECK[i] == check) {
+      slot = i;
+      break;
+    }
+    if (PATH_CACHE_USED[i] < PATH_CACHE_USED[slot]) slot = i;
+  }
+  PATH_CACHE_KEY[slot] = key;
+  PATH_CACHE_CHECK[slot] = check;
+  PATH_CACHE_TYPE[slot] = type;
+  PATH_CACHE_USED[slot] = ++CACHE_CLOCK;
+}
+
+/*
+  pathForget()
+    Drops a path from the path cache, when it is removed
+    path - The path
+  Returns nothing
+*/
+void pathForget(const char * path) {
+  uint32_t key = pathHash(path);
+  for (int i=0; i<PATH_CACHE_SLOTS; i++) {
+    if (PATH_CACHE_KEY[i] == key) PATH_CACHE_USED[i] = 0;
+  }
+}
+
+/*
+  pathForgetMissing()
+    Drops all the paths known not to exist from the path cache, when
+    something is created that can make them valid
+  Returns nothing
+*/
+void pathForgetMissing(void) {
+  for (int i=0; i<PATH_CACHE_SLOTS; i++) {
+    if (PATH_CACHE_TYPE[i] == ENTRY_END) PATH_CACHE_USED[i] = 0;
+  }
+}
+
+/*
+  parentPath()
+    Extracts the folder part of a path
+    path - The path of a file or folder
+    parent - A PATH_LENGTH bytes buffer receiving the parent folder path
+  Returns nothing
+*/
+void parentPath(const char * path, char * parent) {
+  strncpy(parent, path, PATH_LENGTH-1);
+  parent[PATH_LENGTH-1] = '\x00';
+  int i = strlen(parent) - 1;
+  while (i > 0 && parent[i] == '/') i--; // ignore a trailing slash
+  while (i > 0 && parent[i] != '/') i--;
+  parent[i] = '\x00';
+  if (i == 0) strcpy(parent, "/");
+}
+
+/*
+  joinPath()
+    Builds the path of an entry of a folder
+    folder - The path of the folder
+    name - The name of the entry
+    path - A PATH_LENGTH bytes buffer receiving the path of the entry
+  Returns nothing
+*/
+void joinPath(const char * folder, const char * name, char * path) {
+  int length = strlen(folder);
+  if (length > 0 && folder[length-1] == '/') {
+    snprintf(path, PATH_LENGTH, "%s%s", folder, name);
+  } else {
+    snprintf(path, PATH_LENGTH, "%s/%s", folder, name);
+  }
+}
+
+/*
+  vaultWalk()
+    Walks all the entries of the vault, one per call, each folder before
+    its contents and the records of the raw vault last. Only the current
+    folder and the position in it are kept between calls, so that the
+    walk does not recurse
+    folder - A PATH_LENGTH bytes buffer with the folder being walked, set
+             to "/" to start the walk
+    position - The position in the folder, set to 0 to start the walk
+    path - A PATH_LENGTH bytes buffer receiving the path of the entry
+  Returns ENTRY_FILE or ENTRY_FOLDER, or ENTRY_END after the last entry
+*/
+int vaultWalk(char * folder, int * position, char * path) {
+  char name[13];
+  while (folder[0]) {
+    File directory = SD.open(folder);
+    uint32_t key = pathHash(folder);
+    uint32_t check = pathCheck(folder);
+    int type = directory ? ENTRY_SKIP : ENTRY_END;
+    while (type == ENTRY_SKIP) type = readDirEntry(directory, key, check, (*position)++, name);
+    if (directory) directory.close();
+    if (type != ENTRY_END) {
+      joinPath(folder, name, path);
+      if (type == ENTRY_FOLDER) {
+        strcpy(folder, path);
+        *position = 0;
+      }
+      return type;
+    }
+    if (strcmp(folder, "/") == 0) {
+      //The records of the raw vault have no directory entry
+      folder[0] = '\x00';
+      *position = 0;
+    } else {
+      //Go on with the entry following the folder in its parent
+      strcpy(path, folder);
+      parentPath(path, folder);
+      *position = vaultFind(folder, baseName(path)) + 1;
+    }
+  }
+  while (*position < RAW_SLOTS) {
+    int slot = (*position)++;
+    if (RAW_LIVE[slot] && rawPath(slot, path)) return ENTRY_FILE;
+  }
+  return ENTRY_END;
+}
+
+/*
+  vaultFind()
+    Finds the position of an entry in its folder
+    folder - The path of the folder
+    name - The name of the entry
+  Returns the position of the entry, or of the last entry of the folder
+  if it is not found
+*/
+int vaultFind(char * folder, char * name) {
+  char entry[13];
+  File directory = SD.open(folder);
+  if (!directory) return 0;
+  uint32_t key = pathHash(folder);
+  uint32_t check = pathCheck(folder);
+  int type;
+  int i;
+  for (i = 0; (type = readDirEntry(directory, key, check, i, entry)) != ENTRY_END; i++) {
+    if (type != ENTRY_SKIP && strcasecmp(entry, name) == 0) break;
+  }
+  directory.close();
+  return (type == ENTRY_END) ? i - 1 : i;
+}
+
+/*
+  pathSame()
+    Compares two paths the way pathHash() folds them
+    path - The first path
+    other - The second path
+  Returns true if they are the same path
+*/
+boolean pathSame(const char * path, const char * other) {
+  while (*path == '/') path++;
+  while (*other == '/') other++;
+  return strcasecmp(path, other) == 0;
+}
+
+/*
+  pathMissing()
+    Tells whether a path does not exist. The Bloom filter of the folder
+    is checked first, so that creating a new entry does not need a
+    lookup on the card that is bound to fail
+    path - The path
+  Returns true if the path does not exist
+*/
+boolean pathMissing(char * path) {
+  if (rawFind(pathHash(path)) >= 0) return false;
+  if (bloomAbsent(path)) {
+    BLOOM_SKIPS++;
+    return true;
+  }
+  if (pathLookup(path) != ENTRY_END) return false;
+  BLOOM_MISSES++;
+  return true;
+}
+
+/*
+  bloomAbsent()
+    Checks a path against the Bloom filter of its folder
+    path - The path
+  Returns true if the path is not in the folder, false if it may be
+*/
+boolean bloomAbsent(char * path) {
+  char parent[PATH_LENGTH];
+  char * name = baseName(path);
+  if (name[0] == '\x00' || vaultFile(name)) return false;
+  parentPath(path, parent);
+  if (!bloomLoad(parent)) return false;
+  uint32_t hash = pathHash(path);
+  for (int i=0; i<BLOOM_HASHES; i++) {
+    unsigned int bit = bloomBit(hash, i);
+    if (!(BLOOM[bit / 8] & (1 << (bit % 8)))) return true;
+  }
+  return false;
+}
+
+/*
+  bloomAdd()
+    Adds a path to the Bloom filter of its folder. The filter is written
+    to the card by bloomSave()
+    path - The path of the new entry
+  Returns nothing
+*/
+void bloomAdd(char * path) {
+  char parent[PATH_LENGTH];
+  char * name = baseName(path);
+  if (name[0] == '\x00' || vaultFile(name)) return;
+  parentPath(path, parent);
+  if (!bloomLoad(parent)) return;
+  bloomSet(pathHash(path));
+  BLOOM_COUNT++;
+  BLOOM_DIRTY = true;
+}
+
+/*
+  bloomBit()
+    Gives the position of a bit of a path hash in the loaded Bloom filter,
+    using double hashing
+    hash - The path hash
+    i - The number of the hash function
+  Returns the position of the bit
+*/
+unsigned int bloomBit(uint32_t hash, int i) {
+  uint32_t step = ((hash >> 17) | (hash << 15)) | 1;
+  return (hash + i * step) % ((uint32_t)BLOOM_LENGTH * 8);
+}
+
+/*
+  bloomSet()
+    Sets the bits of a path hash in the loaded Bloom filter
+    hash - The path hash
+  Returns nothing
+*/
+void bloomSet(uint32_t hash) {
+  for (int i=0; i<BLOOM_HASHES; i++) {
+    unsigned int bit = bloomBit(hash, i);
+    BLOOM[bit / 8] |= (1 << (bit % 8));
+  }
+}
+
+/*
+  bloomLoad()
+    Loads the Bloom filter of a folder in RAM. The filter is built from
+    the directory if the folder does not have one yet
+    folder - The path of the folder
+  Returns true if the filter is loaded, false if the folder does not exist
+*/
+boolean bloomLoad(char * folder) {
+  uint32_t key = pathHash(folder);
+  if (BLOOM_KEY != 0 && BLOOM_KEY == key) return true;
+  bloomSave();
+  BLOOM_KEY = 0;
+  
+  char path[PATH_LENGTH];
+  byte header[BLOOM_HEADER];
+  joinPath(folder, BLOOM_NAME, path);
+  if (pathLookup(path) == ENTRY_FILE) {
+    File file = SD.open(path);
+    boolean loaded = file && file.read(header, BLOOM_HEADER) == BLOOM_HEADER &&
+                     header[0] == 'B' && header[1] == BLOOM_HASHES;
+    int length = header[2] | (header[3] << 8);
+    loaded = loaded && length >= BLOOM_MIN && length <= BLOOM_MAX &&
+             file.size() == (uint32_t)(BLOOM_HEADER + length) &&
+             file.read(BLOOM, length) == length;
+    file.close();
+    if (loaded) {
+      strcpy(BLOOM_PATH, folder);
+      BLOOM_KEY = key;
+      BLOOM_LENGTH = length;
+      BLOOM_COUNT = header[4] | (header[5] << 8);
+      return true;
+    }
+  }
+  if (!bloomBuild(folder)) return false;
+  bloomSave();
+  return true;
+}
+
+/*
+  bloomBuild()
+    Builds the Bloom filter of a folder from its directory, sized for
+    twice its entries
+    folder - The path of the folder
+  Returns true if the filter is loaded, false if the folder does not exist
+*/
+boolean bloomBuild(char * folder) {
+  File directory = SD.open(folder);
+  if (!directory || !directory.isDirectory()) {
+    directory.close();
+    return false;
+  }
+  BLOOM_KEY = 0;
+  char name[13];
+  char entry[PATH_LENGTH];
+  int type;
+  uint32_t key = pathHash(folder);
+  uint32_t check = pathCheck(folder);
+  //The entries are counted first, to size the filter
+  unsigned int count = 0;
+  for (int i = 0; (type = readDirEntry(directory, key, check, i, name)) != ENTRY_END; i++) {
+    if (type != ENTRY_SKIP && !vaultFile(name)) count++;
+  }
+  BLOOM_LENGTH = BLOOM_MIN;
+  while (BLOOM_LENGTH < BLOOM_MAX && (uint32_t)BLOOM_LENGTH * 8 < (uint32_t)count * 2 * BLOOM_BITS) {
+    BLOOM_LENGTH *= 2;
+  }
+  if (BLOOM_LENGTH > BLOOM_MAX) BLOOM_LENGTH = BLOOM_MAX;
+  memset(BLOOM, 0, BLOOM_LENGTH);
+  BLOOM_COUNT = 0;
+  for (int i = 0; (type = readDirEntry(directory, key, check, i, name)) != ENTRY_END; i++) {
+    if (type == ENTRY_SKIP || vaultFile(name)) continue;
+    joinPath(folder, name, entry);
+    bloomSet(pathHash(entry));
+    BLOOM_COUNT++;
+  }
+  directory.close();
+  strcpy(BLOOM_PATH, folder);
+  BLOOM_KEY = key;
+  BLOOM_DIRTY = true;
+  return true;
+}
+
+/*
+  bloomGrow()
+    Builds the loaded Bloom filter again, twice as big, once its folder
+    has more entries than it was sized for. Only called once the entries
+    added to the filter exist on the card, as it is built from the
+    directory
+  Returns nothing
+*/
+void bloomGrow(void) {
+  if (BLOOM_KEY == 0 || BLOOM_LENGTH >= BLOOM_MAX ||
+      BLOOM_COUNT * BLOOM_BITS <= (uint32_t)BLOOM_LENGTH * 8) return;
+  char folder[PATH_LENGTH];
+  strcpy(folder, BLOOM_PATH);
+  bloomBuild(folder);
+}
+
+/*
+  bloomSave()
+    Writes the loaded Bloom filter to the card if it has changed
+  Returns nothing
+*/
+void bloomSave(void) {
+  if (!BLOOM_DIRTY || BLOOM_KEY == 0) return;
+  char path[PATH_LENGTH];
+  joinPath(BLOOM_PATH, BLOOM_NAME, path);
+  boolean created = (pathLookup(path) != ENTRY_FILE);
+  File file = SD.open(path, FILE_REWRITE);
+  if (!file) return;
+  pathRemember(path, ENTRY_FILE);
+  byte header[BLOOM_HEADER] = {'B', BLOOM_HASHES, (byte)(BLOOM_LENGTH & 0xFF), (byte)(BLOOM_LENGTH >> 8),
+                               (byte)(BLOOM_COUNT & 0xFF), (byte)((BLOOM_COUNT >> 8) & 0xFF)};
+  file.write(header, BLOOM_HEADER);
+  file.write(BLOOM, BLOOM_LENGTH);
+  file.close();
+  //A new file changes the directory of the folder
+  if (created) cacheInvalidate(BLOOM_KEY);
+  BLOOM_DIRTY = false;
+}
+
+/*
+  cacheLookup()
+    Looks for a block in the read cache
+    key - The path hash of the file
+    check - The path check of the file
+    block - The block number in the file
+  Returns the cache slot holding the block, or -1 if it is not cached
+*/
+int cacheLookup(uint32_t key, uint32_t check, unsigned int block) {
+  for (int i=0; i<CACHE_SLOTS; i++) {
+    if (CACHE_USED[i] && CACHE_KEY[i] == key && CACHE_CHECK[i] == check && CACHE_BLOCK[i] == block) {
+      CACHE_USED[i] = ++CACHE_CLOCK;
+      CACHE_HITS++;
+      return i;
+    }
+  }
+  return -1;
+}
+
+/*
+  cacheEvict()
+    Selects the slot to use for a new block, which is either an empty slot
+    or the least recently used one
+  Returns the selected cache slot
+*/
+int cacheEvict(void) {
+  int slot = 0;
+  for (int i=1; i<CACHE_SLOTS; i++) {
+    if (CACHE_USED[i] < CACHE_USED[slot]) slot = i;
+  }
+  return slot;
+}
+
+/*
+  cacheFill()
+    Reads a block from the SD card into the cache
+    file - The file to read the block from
+    key - The path hash of the file
+    check - The path check of the file
+    block - The block number in the file
+  Returns the cache slot holding the block
+*/
+int cacheFill(File file, uint32_t key, uint32_t check, unsigned int block) {
+  int slot = cacheEvict();
+  int length = 0;
+  if (file.seek((uint32_t)block * BLOCK_SIZE)) {
+    length = file.read(CACHE_DATA[slot], BLOCK_SIZE);
+  }
+  if (length < 0) length = 0;
+  CACHE_KEY[slot] = key;
+  CACHE_CHECK[slot] = check;
+  CACHE_BLOCK[slot] = block;
+  CACHE_LENGTH[slot] = length;
+  CACHE_USED[slot] = ++CACHE_CLOCK;
+  CACHE_MISSES++;
+  return slot;
+}
+
+/*
+  cacheStore()
+    Puts data that has just been written to the SD card in the cache
+    key - The path hash of the file
+    check - The path check of the file
+    block - The block number in the file
+    data - The block contents
+    length - The length of the data, up to BLOCK_SIZE
+  Returns the cache slot holding the block
+*/
+int cacheStore(uint32_t key, uint32_t check, unsigned int block, byte * data, int length) {
+  int slot = cacheEvict();
+  memcpy(CACHE_DATA[slot], data, length);
+  CACHE_KEY[slot] = key;
+  CACHE_CHECK[slot] = check;
+  CACHE_BLOCK[slot] = block;
+  CACHE_LENGTH[slot] = length;
+  CACHE_USED[slot] = ++CACHE_CLOCK;
+  return slot;
+}
+
+/*
+  cacheInvalidate()
+    Drops all the cached blocks of a file. The blocks of another file with
+    the same path hash are dropped too, which is only a cache miss
+    key - The path hash of the file
+  Returns nothing
+*/
+void cacheInvalidate(uint32_t key) {
+  for (int i=0; i<CACHE_SLOTS; i++) {
+    if (CACHE_KEY[i] == key) CACHE_USED[i] = 0;
+  }
+}
+
+/*
+  readDirSize()
+    Reads the size of a file from its directory entry, through the block
+    cache
+    folder - A File object pointing to the folder
+    key - The path hash of the folder
+    check - The path check of the folder
+    index - The index of the 32 bytes entry in the directory
+  Returns the file size, 0 for folders
+*/
+uint32_t readDirSize(File folder, uint32_t key, uint32_t check, int index) {
+  unsigned int block = index / (BLOCK_SIZE/32);
+  int offset = (index % (BLOCK_SIZE/32)) * 32;
+  int slot = cacheLookup(key, check, block);
+  if (slot < 0) slot = cacheFill(folder, key, check, block);
+  if (CACHE_LENGTH[slot] < offset + 32) return 0;
+  return readLong(CACHE_DATA[slot] + offset + 28);
+}
+
+/*
+  readDirEntry()
+    Reads an entry of a directory through the block cache. This avoids
+    the openNextFile() calls, which read the directory from the card and
+    allocate a new file handle for every entry
+    folder - A File object pointing to the folder
+    key - The path hash of the folder
+    check - The path check of the folder
+    index - The index of the 32 bytes entry in the directory
+    name - A 13 bytes buffer receiving the 8.3 name of the entry
+  Returns ENTRY_END after the last entry, ENTRY_SKIP for deleted or
+  special entries, ENTRY_FILE or ENTRY_FOLDER otherwise
+*/
+int readDirEntry(File folder, uint32_t key, uint32_t check, int index, char * name) {
+  unsigned int block = index / (BLOCK_SIZE/32);
+  int offset = (index % (BLOCK_SIZE/32)) * 32;
+  int slot = cacheLookup(key, check, block);
+  if (slot < 0) slot = cacheFill(folder, key, check, block);
+  if (CACHE_LENGTH[slot] < offset + 32) return ENTRY_END;
+  
+  byte * entry = CACHE_DATA[slot] + offset;
+  byte attributes = entry[11];
+  if (entry[0] == 0x00) return ENTRY_END;
+  if (entry[0] == 0xE5 || entry[0] == '.') return ENTRY_SKIP; //Deleted, . and ..
+  if ((attributes & 0x0F) == 0x0F) return ENTRY_SKIP; //Long file name part
+  if (attributes & 0x08) return ENTRY_SKIP; //Volume label
+  
+  int length = 0;
+  for (int i=0; i<8 && entry[i] != ' '; i++) name[length++] = entry[i];
+  if (entry[8] != ' ') {
+    name[length++] = '.';
+    for (int i=8; i<11 && entry[i] != ' '; i++) name[length++] = entry[i];
+  }
+  name[length] = '\x00';
+  if (vaultFile(name)) return ENTRY_SKIP; //Vault metadata
+  return (attributes & 0x10) ? ENTRY_FOLDER : ENTRY_FILE;
+}
+
+/*
+  vaultFile()
+    Tells the files the vault keeps for itself apart from the records.
+    Only the names used by the vault are hidden, records whose name starts
+    with '_' are listed like any other
+    name - The name of a directory entry
+  Returns true for the vault metadata
+*/
+boolean vaultFile(const char * name) {
+  if (name[0] != '_') return false;
+  return !strcasecmp(name, INDEX_NAME) || !strcasecmp(name, BLOOM_NAME) ||
+         !strcasecmp(name, RAW_NAME) || !strcasecmp(name, CATALOG_NAME + 1) ||
+         !strcasecmp(name, JOURNAL_NAME + 1) || !strcasecmp(name, COMPACT_DIR + 1) ||
+         !strcasecmp(name, MANIFEST_NAME + 1);
+}
+
+/*
+  prefetchIdle()
+    Decrypts the header of one of the records around the cursor into the
+    prefetch cache. Called while waiting for a button, so that a single
+    record is handled per call to keep the buttons responsive
+  Returns nothing
+*/
+void prefetchIdle(void) {
+  uint32_t folder = pathHash(CURRENT_PATH);
+  if (PREFETCH_POSITION == CURRENT_POSITION && PREFETCH_FOLDER == folder) return;
+  
+  char path[PATH_LENGTH];
+  int count = listCount();
+  int around[PREFETCH_SLOTS] = {0, 1, -1};
+  for (int i=0; i<PREFETCH_SLOTS && count > 0; i++) {
+    int position = ((CURRENT_POSITION + around[i]) % count + count) % count;
+    if (getEntry(position, path) != ENTRY_FILE) continue;
+    if (prefetchSlot(pathHash(path)) >= 0) continue;
+    prefetchLoad(path);
+    return;
+  }
+  PREFETCH_POSITION = CURRENT_POSITION;
+  PREFETCH_FOLDER = folder;
+}
+
+/*
+  prefetchLoad()
+    Reads a record and decrypts its username into the prefetch cache,
+    in place of the least recently used slot. The record is read around
+    the block cache, so that reading ahead does not evict the folder
+    blocks
+    path - The path of the record
+  Returns nothing
+*/
+void prefetchLoad(char * path) {
+  byte record[BLOCK_SIZE];
+  int length = recordRead(path, record);
+  int slot = 0;
+  for (int i=1; i<PREFETCH_SLOTS; i++) {
+    if (PREFETCH_USED[i] < PREFETCH_USED[slot]) slot = i;
+  }
+  wipe((byte *)PREFETCH_NAME[slot], FIELD_MAX+1);
+  PREFETCH_KEY[slot] = pathHash(path);
+  PREFETCH_TYPE[slot] = (length >= 2 && record[0] == 0x42) ? record[1] : 0;
+  //Only the username is decrypted ahead, the other sections are secrets
+  if (PREFETCH_TYPE[slot] == 0x01) {
+    readSection(record, length, 0x01, PREFETCH_NAME[slot]);
+  }
+  PREFETCH_USED[slot] = ++CACHE_CLOCK;
+}
+
+/*
+  prefetchSlot()
+    Looks for a record in the prefetch cache
+    key - The path hash of the record
+  Returns the slot holding the record, or -1 if it is not cached
+*/
+int prefetchSlot(uint32_t key) {
+  for (int i=0; i<PREFETCH_SLOTS; i++) {
+    if (PREFETCH_USED[i] && PREFETCH_KEY[i] == key) {
+      PREFETCH_USED[i] = ++CACHE_CLOCK;
+      return i;
+    }
+  }
+  return -1;
+}
+
+/*
+  prefetchLookup()
+    Gets the username of a record from the prefetch cache
+    path - The path of the record
+    username - A FIELD_MAX+1 bytes buffer receiving the username
+  Returns true if the username was prefetched
+*/
+boolean prefetchLookup(char * path, char * username) {
+  int slot = prefetchSlot(pathHash(path));
+  if (slot < 0 || PREFETCH_TYPE[slot] != 0x01) {
+    PREFETCH_MISSES++;
+    return false;
+  }
+  memcpy(username, PREFETCH_NAME[slot], FIELD_MAX+1);
+  PREFETCH_HITS++;
+  return true;
+}
+
+/*
+  prefetchForget()
+    Drops a record from the prefetch cache, when it is rewritten
+    key - The path hash of the record
+  Returns nothing
+*/
+void prefetchForget(uint32_t key) {
+  for (int i=0; i<PREFETCH_SLOTS; i++) {
+    if (PREFETCH_KEY[i] == key) {
+      wipe((byte *)PREFETCH_NAME[i], FIELD_MAX+1);
+      PREFETCH_USED[i] = 0;
+    }
+  }
+}
+
+/*
+  prefetchWipe()
+    Clears the whole prefetch cache
+  Returns nothing
+*/
+void prefetchWipe(void) {
+  for (int i=0; i<PREFETCH_SLOTS; i++) {
+    wipe((byte *)PREFETCH_NAME[i], FIELD_MAX+1);
+    PREFETCH_KEY[i] = 0;
+    PREFETCH_TYPE[i] = 0;
+    PREFETCH_USED[i] = 0;
+  }
+  PREFETCH_POSITION = -1;
+}
+
+/*
+  indexBucket()
+    Gives the prefix table bucket of a name. Buckets follow the character
+    order so that the prefix table stays sorted
+    name - An 8.3 name
+  Returns the bucket number, from 0 to INDEX_BUCKETS-1
+*/
+int indexBucket(char * name) {
+  int c = (byte)toupper(name[0]);
+  if (c <= ' ') return 0;
+  if (c - ' ' >= INDEX_BUCKETS) return INDEX_BUCKETS - 1;
+  return c - ' ';
+}
+
+/*
+  indexInsert()
+    Adds an entry to the sorted index of a folder. The index is built from
+    the folder contents if it does not exist yet
+    folder - The path of the folder
+    name - The name of the new entry
+    type - ENTRY_FILE or ENTRY_FOLDER
+  Returns nothing
+*/
+void indexInsert(char * folder, char * name, int type) {
+  char path[PATH_LENGTH];
+  joinPath(folder, INDEX_NAME, path);
+  if (pathLookup(path) != ENTRY_FILE) {
+    //The new entry is already in the folder, so it is part of the build
+    indexBuild(folder);
+  } else {
+    File index = SD.open(path, FILE_WRITE);
+    if (!index) return;
+    indexAdd(index, name, type);
+    index.close();
+  }
+  cacheInvalidate(pathHash(path));
+  if (pathHash(folder) == pathHash(CURRENT_PATH)) openFolder(CURRENT_PATH);
+}
+
+/*
+  indexBuild()
+    Creates the sorted index of a folder from its directory
+    folder - The path of the folder
+  Returns nothing
+*/
+void indexBuild(char * folder) {
+  char path[PATH_LENGTH];
+  char name[13];
+  char other[13];
+  joinPath(folder, INDEX_NAME, path);
+  File directory = SD.open(folder);
+  if (!directory) return;
+  
+  //The entries are sorted in RAM by reference, reading their names back
+  // through the block cache, then the index is written in one pass
+  uint32_t key = pathHash(folder);
+  uint32_t check = pathCheck(folder);
+  cacheInvalidate(key);
+  uint16_t sorted[INDEX_SORT_MAX];
+  int count = 0;
+  int overflow = -1;
+  int type;
+  for (int i = 0; (type = indexName(directory, key, check, i, name)) != ENTRY_END; i++) {
+    if (type == ENTRY_SKIP) continue;
+    if (count == INDEX_SORT_MAX) {
+      if (overflow < 0) overflow = i;
+      continue;
+    }
+    count = indexSort(directory, key, check, sorted, count, i, name, other);
+  }
+  //The records of the raw vault have no directory entry
+  for (int slot=0; slot<RAW_SLOTS && count < INDEX_SORT_MAX; slot++) {
+    if (RAW_LIVE[slot] && RAW_PARENT[slot] == key &&
+        indexName(directory, key, check, INDEX_RAW | slot, name) != ENTRY_END) {
+      count = indexSort(directory, key, check, sorted, count, INDEX_RAW | slot, name, other);
+    }
+  }
+  
+  File index = SD.open(path, FILE_REWRITE);
+  if (!index) {
+    directory.close();
+    return;
+  }
+  pathRemember(path, ENTRY_FILE);
+  //The header is written again once the prefix table is known, as the
+  // entries cannot be written past the end of the file
+  byte header[INDEX_HEADER] = {0};
+  index.write(header, INDEX_HEADER);
+  header[0] = 'I';
+  header[2] = count & 0xFF;
+  header[3] = count >> 8;
+  int bucket = 0;
+  for (int i=0; i<count; i++) {
+    char entry[INDEX_ENTRY] = {0};
+    type = indexName(directory, key, check, sorted[i], entry);
+    entry[13] = type;
+    //The prefix table holds the position of the first entry of each bucket
+    for (; bucket <= indexBucket(entry); bucket++) {
+      header[4+bucket*2] = i & 0xFF;
+      header[5+bucket*2] = i >> 8;
+    }
+    index.write((byte *)entry, INDEX_ENTRY);
+  }
+  for (; bucket < INDEX_BUCKETS; bucket++) {
+    header[4+bucket*2] = count & 0xFF;
+    header[5+bucket*2] = count >> 8;
+  }
+  index.seek(0);
+  index.write(header, INDEX_HEADER);
+  
+  //Folders too large to be sorted in RAM get their last entries inserted
+  // one by one
+  if (overflow >= 0) {
+    for (int i = overflow; (type = readDirEntry(directory, key, check, i, name)) != ENTRY_END; i++) {
+      if (type != ENTRY_SKIP) indexAdd(index, name, type);
+    }
+  }
+  for (int slot=0; slot<RAW_SLOTS; slot++) {
+    if (RAW_LIVE[slot] && RAW_PARENT[slot] == key && !indexSorted(sorted, count, INDEX_RAW | slot) &&
+        indexName(directory, key, check, INDEX_RAW | slot, name) != ENTRY_END) {
+      indexAdd(index, name, ENTRY_FILE);
+    }
+  }
+  index.close();
+  directory.close();
+}
+
+/*
+  indexSort()
+    Inserts an entry reference at its sorted position, with a binary search
+    directory - The folder being indexed
+    key - The path hash of the folder
+    check - The path check of the folder
+    sorted - The references sorted so far
+    count - The number of sorted references
+    reference - The directory entry number, or INDEX_RAW with a raw vault slot
+    name - The name of the entry, in upper case as read by indexName()
+    other - A 13 bytes buffer used to read the compared names
+  Returns the new number of sorted references
+*/
+int indexSort(File directory, uint32_t key, uint32_t check, uint16_t * sorted, int count, int reference, char * name, char * other) {
+  int low = 0;
+  int high = count;
+  while (low < high) {
+    int middle = (low + high) / 2;
+    indexName(directory, key, check, sorted[middle], other);
+    int order = strcmp(other, name);
+    if (order == 0) return count; //Already indexed
+    if (order < 0) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  memmove(sorted + low + 1, sorted + low, (count - low) * sizeof(uint16_t));
+  sorted[low] = reference;
+  return count + 1;
+}
+
+/*
+  indexName()
+    Reads the name of an entry referenced by indexSort(), in upper case as
+    it is stored in the index
+    directory - The folder being indexed
+    key - The path hash of the folder
+    check - The path check of the folder
+    reference - The directory entry number, or INDEX_RAW with a raw vault slot
+    name - A 13 bytes buffer receiving the name
+  Returns ENTRY_FILE or ENTRY_FOLDER, or ENTRY_END if it cannot be read
+*/
+int indexName(File directory, uint32_t key, uint32_t check, int reference, char * name) {
+  int type = ENTRY_FILE;
+  if (reference & INDEX_RAW) {
+    char record_path[PATH_LENGTH];
+    if (!rawPath(reference & ~INDEX_RAW, record_path)) return ENTRY_END;
+    strncpy(name, baseName(record_path), 12);
+    name[12] = '\x00';
+  } else {
+    type = readDirEntry(directory, key, check, reference, name);
+  }
+  for (int i=0; name[i]; i++) name[i] = toupper(name[i]);
+  return type;
+}
+
+/*
+  indexSorted()
+    Tells if a reference is part of the sorted references
+    sorted - The sorted references
+    count - The number of sorted references
+    reference - The reference to look for
+  Returns true if it is
+*/
+boolean indexSorted(uint16_t * sorted, int count, int reference) {
+  for (int i=0; i<count; i++) {
+    if (sorted[i] == reference) return true;
+  }
+  return false;
+}
+
+/*
+  indexAdd()
+    Inserts an entry at its sorted position in an open index file. The
+    position is found with a binary search, then the following entries
+    are moved one slot further
+    index - The index file, opened for writing
+    name - The name of the entry
+    type - ENTRY_FILE or ENTRY_FOLDER
+  Returns nothing
+*/
+void indexAdd(File index, char * name, int type) {
+  byte header[INDEX_HEADER];
+  char entry[INDEX_ENTRY];
+  char key[13] = {0};
+  for (int i=0; i<12 && name[i]; i++) key[i] = toupper(name[i]);
+  
+  index.seek(0);
+  if (index.read(header, INDEX_HEADER) != INDEX_HEADER) return;
+  int count = header[2] | (header[3] << 8);
+  
+  //Find the insertion point
+  int low = 0;
+  int high = count;
+  while (low < high) {
+    int middle = (low + high) / 2;
+    index.seek(INDEX_HEADER + (uint32_t)middle * INDEX_ENTRY);
+    index.read((byte *)entry, INDEX_ENTRY);
+    int order = strncmp(entry, key, 13);
+    if (order == 0) return; //Already indexed
+    if (order < 0) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  
+  //Move the following entries, starting from the end of the file
+  byte buffer[8 * INDEX_ENTRY];
+  int end = count;
+  while (end > low) {
+    int start = max(low, end - 8);
+    int length = (end - start) * INDEX_ENTRY;
+    index.seek(INDEX_HEADER + (uint32_t)start * INDEX_ENTRY);
+    index.read(buffer, length);
+    index.seek(INDEX_HEADER + (uint32_t)(start + 1) * INDEX_ENTRY);
+    index.write(buffer, length);
+    end = start;
+  }
+  
+  memset(entry, 0, INDEX_ENTRY);
+  memcpy(entry, key, 13);
+  entry[13] = type;
+  index.seek(INDEX_HEADER + (uint32_t)low * INDEX_ENTRY);
+  index.write((byte *)entry, INDEX_ENTRY);
+  
+  //Update the entry count and the prefix table
+  count++;
+  header[2] = count & 0xFF;
+  header[3] = count >> 8;
+  for (int b = indexBucket(key) + 1; b < INDEX_BUCKETS; b++) {
+    int position = header[4+b*2] | (header[5+b*2] << 8);
+    position++;
+    header[4+b*2] = position & 0xFF;
+    header[5+b*2] = position >> 8;
+  }
+  index.seek(0);
+  index.write(header, INDEX_HEADER);
+}
+
+/*
+  openFolder()
+    Makes a folder the current folder, and loads its index if it has one
+    path - The path of the folder
+  Returns nothing
+*/
+void openFolder(const char * path) {
+  char index_path[PATH_LENGTH];
+  char folder_path[PATH_LENGTH];
+  strcpy(folder_path, path);
+  CURRENT_DIR.close();
+  CURRENT_INDEX.close();
+  CURRENT_DIR = SD.open(folder_path);
+  strcpy(CURRENT_PATH, folder_path);
+  LIST_COUNT = -1;
+  LIST_ENTRY = 0;
+  LIST_SLOT = 0;
+  INDEX_COUNT = -1;
+  LIST_SOURCE = LIST_DIRECTORY;
+  
+  //List from the catalog when it is loaded
+  if (CATALOG_COUNT >= 0) {
+    int folder = CATALOG_ROOT;
+    if (strcmp(CURRENT_PATH, "/") != 0) folder = catalogFind(CURRENT_PATH);
+    if (folder >= 0) {
+      LIST_COUNT = catalogView(folder);
+      LIST_SOURCE = LIST_CATALOG;
+      return;
+    }
+  }
+  
+  joinPath(CURRENT_PATH, INDEX_NAME, index_path);
+  if (pathLookup(index_path) != ENTRY_FILE) {
+    //The records of the raw vault are only listed through an index
+    if (RAW_SLOTS == 0) return;
+    indexBuild(CURRENT_PATH);
+  }
+  CURRENT_INDEX = SD.open(index_path);
+  if (!CURRENT_INDEX) return;
+  INDEX_KEY = pathHash(index_path);
+  INDEX_CHECK = pathCheck(index_path);
+  int slot = cacheLookup(INDEX_KEY, INDEX_CHECK, 0);
+  if (slot < 0) slot = cacheFill(CURRENT_INDEX, INDEX_KEY, INDEX_CHECK, 0);
+  if (CACHE_LENGTH[slot] < INDEX_HEADER || CACHE_DATA[slot][0] != 'I') return;
+  byte * header = CACHE_DATA[slot];
+  INDEX_COUNT = header[2] | (header[3] << 8);
+  for (int b=0; b<INDEX_BUCKETS; b++) {
+    INDEX_TABLE[b] = header[4+b*2] | (header[5+b*2] << 8);
+  }
+  LIST_COUNT = INDEX_COUNT;
+  LIST_SOURCE = LIST_INDEX;
+}
+
+/*
+  listCount()
+  Returns the number of entries in the current folder
+*/
+int listCount(void) {
+  if (LIST_COUNT < 0) {
+    char name[13];
+    uint32_t key = pathHash(CURRENT_PATH);
+    uint32_t check = pathCheck(CURRENT_PATH);
+    int type;
+    LIST_COUNT = 0;
+    for (int i = 0; (type = readDirEntry(CURRENT_DIR, key, check, i, name)) != ENTRY_END; i++) {
+      if (type != ENTRY_SKIP) LIST_COUNT++;
+    }
+  }
+  return LIST_COUNT;
+}
+
+/*
+  listEntry()
+    Reads an entry of the current folder, in sorted order if the folder
+    has an index, or in directory order otherwise
+    position - The position of the entry in the folder
+    name - A 13 bytes buffer receiving the name of the entry
+  Returns ENTRY_FILE or ENTRY_FOLDER, or ENTRY_END if there is no such entry
+*/
+int listEntry(int position, char * name) {
+  if (position < 0) return ENTRY_END;
+  if (LIST_SOURCE == LIST_CATALOG) {
+    if (position >= LIST_COUNT) return ENTRY_END;
+    byte * entry = CATALOG + CATALOG_VIEW[position] * CATALOG_ENTRY;
+    memcpy(name, entry, 12);
+    name[12] = '\x00';
+    return entry[14];
+  }
+  if (LIST_SOURCE == LIST_INDEX) {
+    if (position >= INDEX_COUNT) return ENTRY_END;
+    uint32_t offset = INDEX_HEADER + (uint32_t)position * INDEX_ENTRY;
+    int slot = cacheLookup(INDEX_KEY, INDEX_CHECK, offset / BLOCK_SIZE);
+    if (slot < 0) slot = cacheFill(CURRENT_INDEX, INDEX_KEY, INDEX_CHECK, offset / BLOCK_SIZE);
+    if (CACHE_LENGTH[slot] < (int)(offset % BLOCK_SIZE) + INDEX_ENTRY) return ENTRY_END;
+    byte * entry = CACHE_DATA[slot] + offset % BLOCK_SIZE;
+    memcpy(name, entry, 12);
+    name[12] = '\x00';
+    return entry[13];
+  }
+  
+  uint32_t key = pathHash(CURRENT_PATH);
+  uint32_t check = pathCheck(CURRENT_PATH);
+  if (position < LIST_ENTRY) {
+    LIST_ENTRY = 0;
+    LIST_SLOT = 0;
+  }
+  int type;
+  while ((type = readDirEntry(CURRENT_DIR, key, check, LIST_SLOT, name)) != ENTRY_END) {
+    if (type != ENTRY_SKIP) {
+      if (LIST_ENTRY == position) return type;
+      LIST_ENTRY++;
+    }
+    LIST_SLOT++;
+  }
+  return ENTRY_END;
+}
+
+/*
+  jumpLetter()
+    Finds the first entry of the next or previous first letter in the
+    current folder, using the prefix table of the index or a binary search
+    of the catalog view. Folders without either jump by a page
+    position - The position of the selected entry
+    direction - 1 to go to the next letter, -1 for the previous one
+  Returns the new position
+*/
+int jumpLetter(int position, int direction) {
+  char name[13];
+  int count = listCount();
+  if (count == 0) return 0;
+  if (LIST_SOURCE == LIST_DIRECTORY) {
+    position += direction * MENU_LINES;
+    if (position >= count) return 0;
+    if (position < 0) return count - 1;
+    return position;
+  }
+  if (direction > 0) {
+    if (listEntry(position, name) == ENTRY_END) return 0;
+    int bucket = indexBucket(name) + 1;
+    if (bucket >= INDEX_BUCKETS) return 0;
+    int start = bucketStart(bucket);
+    return (start >= count) ? 0 : start;
+  }
+  position--;
+  if (position < 0) position = count - 1;
+  if (listEntry(position, name) == ENTRY_END) return 0;
+  return bucketStart(indexBucket(name));
+}
+
+/*
+  bucketStart()
+    Finds the first entry of the current folder in a prefix bucket
+    bucket - The bucket number, see indexBucket()
+  Returns the position of the first entry of the bucket or after it
+*/
+int bucketStart(int bucket) {
+  if (LIST_SOURCE == LIST_INDEX) return INDEX_TABLE[bucket];
+  char name[13];
+  int low = 0;
+  int high = LIST_COUNT;
+  while (low < high) {
+    int middle = (low + high) / 2;
+    listEntry(middle, name);
+    if (indexBucket(name) < bucket) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+/*
+  catalogLoad()
+    Decrypts the catalog in RAM, once the device is unlocked. The catalog
+    build is started if it does not exist yet
+  Returns nothing
+*/
+void catalogLoad(void) {
+  uint32_t start = millis();
+  CATALOG_COUNT = -1;
+  File file = SD.open(CATALOG_NAME);
+  boolean build = !file;
+  if (file) {
+    byte iv [N_BLOCK] = {0};
+    byte header [CATALOG_ENTRY];
+    if (file.read(header, CATALOG_ENTRY) == CATALOG_ENTRY) {
+      CIPHER.cbc_decrypt (header, header, CATALOG_ENTRY / N_BLOCK, iv);
+      int count = header[2] | (header[3] << 8);
+      int length = count * CATALOG_ENTRY;
+      if (header[0] == 'C' && header[1] == CATALOG_OVER) {
+        //Only a board with more RAM than the one that gave up tries again
+        build = (header[4] | (header[5] << 8)) < CATALOG_MAX;
+      } else if (header[0] == 'C' && count <= CATALOG_MAX && file.read(CATALOG, length) == length) {
+        //A catalog too big for the RAM is not used, folders are browsed
+        // from their index instead
+        CIPHER.cbc_decrypt (CATALOG, CATALOG, length / N_BLOCK, iv);
+        CATALOG_COUNT = count;
+      }
+    }
+    wipe(header, sizeof(header));
+    file.close();
+  }
+  if (build) catalogStart();
+  CATALOG_LOAD_TIME = millis() - start;
+}
+
+/*
+  catalogSave()
+    Encrypts the catalog and writes it on the SD card
+  Returns nothing
+*/
+void catalogSave(void) {
+  if (CATALOG_COUNT < 0) return;
+  File file = SD.open(CATALOG_NAME, FILE_REWRITE);
+  if (!file) return;
+  pathRemember(CATALOG_NAME, ENTRY_FILE);
+  
+  byte iv [N_BLOCK] = {0};
+  byte buffer [4 * CATALOG_ENTRY] = {0};
+  buffer[0] = 'C';
+  buffer[2] = CATALOG_COUNT & 0xFF;
+  buffer[3] = CATALOG_COUNT >> 8;
+  CIPHER.cbc_encrypt (buffer, buffer, CATALOG_ENTRY / N_BLOCK, iv);
+  file.write(buffer, CATALOG_ENTRY);
+  
+  int length = CATALOG_COUNT * CATALOG_ENTRY;
+  for (int offset = 0; offset < length; offset += sizeof(buffer)) {
+    int chunk = min((int)sizeof(buffer), length - offset);
+    CIPHER.cbc_encrypt (CATALOG + offset, buffer, chunk / N_BLOCK, iv);
+    file.write(buffer, chunk);
+  }
+  wipe(buffer, sizeof(buffer));
+  file.close();
+}
+
+/*
+  catalogStart()
+    Starts building the catalog from the SD card. Folders are browsed from
+    their index until the build is done
+  Returns nothing
+*/
+void catalogStart(void) {
+  CATALOG_COUNT = -1;
+  CATALOG_BUILD = -1;
+  CATALOG_BUILD_ENTRY = 0;
+  CATALOG_BUILT = 0;
+  CATALOG_BUILD_START = millis();
+}
+
+/*
+  catalogStep()
+    Adds up to CATALOG_STEP entries to the catalog being built, walking
+    all the folders of the SD card. Each folder added to the catalog is
+    walked in turn, then the raw vault. The catalog is saved and used once
+    the build is done
+  Returns true if a build step was run, false if no build is running
+*/
+boolean catalogStep(void) {
+  char path[PATH_LENGTH];
+  char name[13];
+  if (CATALOG_BUILD == CATALOG_BUILD_IDLE) return false;
+  //The entries built so far are only seen by the build
+  CATALOG_COUNT = CATALOG_BUILT;
+  
+  int folder = CATALOG_BUILD;
+  while (folder >= 0 && folder < CATALOG_COUNT && CATALOG[folder * CATALOG_ENTRY + 14] != ENTRY_FOLDER) {
+    folder++;
+  }
+  if (folder != CATALOG_BUILD_RAW && folder < CATALOG_COUNT) {
+    catalogPath(folder < 0 ? CATALOG_ROOT : folder, path);
+    File directory = SD.open(path);
+    uint32_t key = pathHash(path);
+    uint32_t check = pathCheck(path);
+    int type = ENTRY_END;
+    int added = 0;
+    while (directory && added < CATALOG_STEP &&
+           (type = readDirEntry(directory, key, check, CATALOG_BUILD_ENTRY, name)) != ENTRY_END) {
+      CATALOG_BUILD_ENTRY++;
+      if (type == ENTRY_SKIP) continue;
+      if (CATALOG_COUNT >= CATALOG_MAX) {
+        //Too many entries for the RAM
+        directory.close();
+        catalogOver();
+        return true;
+      }
+      byte * entry = CATALOG + CATALOG_COUNT * CATALOG_ENTRY;
+      memset(entry, 0, CATALOG_ENTRY);
+      memcpy(entry, name, strlen(name));
+      unsigned int parent = (folder < 0) ? CATALOG_ROOT : folder;
+      entry[12] = parent & 0xFF;
+      entry[13] = parent >> 8;
+      entry[14] = type;
+      if (type == ENTRY_FILE) {
+        char record_path[PATH_LENGTH];
+        joinPath(path, name, record_path);
+        entry[15] = recordTag(record_path, false);
+      }
+      CATALOG_COUNT++;
+      added++;
+    }
+    if (directory) directory.close();
+    CATALOG_BUILD = folder;
+    if (type == ENTRY_END) {
+      //Go on with the next folder, or with the raw vault after the last one
+      CATALOG_BUILD = (folder + 1 < CATALOG_COUNT) ? folder + 1 : CATALOG_BUILD_RAW;
+      CATALOG_BUILD_ENTRY = 0;
+    }
+  } else if (CATALOG_BUILD_ENTRY < RAW_SLOTS) {
+    //The records of the raw vault have no directory entry
+    CATALOG_BUILD = CATALOG_BUILD_RAW;
+    int slot = CATALOG_BUILD_ENTRY++;
+    if (RAW_LIVE[slot] && rawPath(slot, path)) {
+      //A full catalog is dropped, which ends the build
+      if (catalogAdd(path, ENTRY_FILE, recordTag(path, true)) < 0) return true;
+    }
+  } else {
+    //The catalog is complete, the menu lists from it from now on
+    CATALOG_BUILD = CATALOG_BUILD_IDLE;
+    catalogSave();
+    CATALOG_LOAD_TIME = millis() - CATALOG_BUILD_START;
+    VAULT_CHANGED = true;
+    return true;
+  }
+  CATALOG_BUILT = CATALOG_COUNT;
+  CATALOG_COUNT = -1;
+  return true;
+}
+
+/*
+  catalogOver()
+    Drops the catalog once the vault has more entries than CATALOG_MAX.
+    A marker is written in its place, so that the catalog is not built
+    again on every unlock. Folders are then browsed from their index
+  Returns nothing
+*/
+void catalogOver(void) {
+  catalogWipe();
+  File file = SD.open(CATALOG_NAME, FILE_REWRITE);
+  if (!file) return;
+  pathRemember(CATALOG_NAME, ENTRY_FILE);
+  byte iv [N_BLOCK] = {0};
+  byte header [CATALOG_ENTRY] = {0};
+  header[0] = 'C';
+  header[1] = CATALOG_OVER;
+  header[4] = CATALOG_MAX & 0xFF;
+  header[5] = CATALOG_MAX >> 8;
+  CIPHER.cbc_encrypt (header, header, CATALOG_ENTRY / N_BLOCK, iv);
+  file.write(header, CATALOG_ENTRY);
+  file.close();
+}
+
+/*
+  catalogWipe()
+    Clears the decrypted catalog from RAM, when the device is locked, and
+    stops its build
+  Returns nothing
+*/
+void catalogWipe(void) {
+  wipe(CATALOG, sizeof(CATALOG));
+  CATALOG_COUNT = -1;
+  CATALOG_BUILD = CATALOG_BUILD_IDLE;
+}
+
+/*
+  catalogPath()
+    Builds the path of a catalog entry from its parents
+    position - The position of the entry in the catalog
+    path - A PATH_LENGTH bytes buffer receiving the path
+  Returns nothing
+*/
+void catalogPath(unsigned int position, char * path) {
+  char tail[PATH_LENGTH] = "";
+  char name[13];
+  int depth = 0;
+  while (position != CATALOG_ROOT && position < (unsigned int)CATALOG_COUNT && depth++ < PATH_LENGTH/2) {
+    byte * entry = CATALOG + position * CATALOG_ENTRY;
+    memcpy(name, entry, 12);
+    name[12] = '\x00';
+    snprintf(path, PATH_LENGTH, "/%s%s", name, tail);
+    strcpy(tail, path);
+    position = entry[12] | (entry[13] << 8);
+  }
+  if (tail[0] == '\x00') {
+    strcpy(path, "/");
+  } else {
+    strcpy(path, tail);
+  }
+}
+
+/*
+  catalogChild()
+    Looks for an entry of a folder in the catalog
+    parent - The catalog position of the folder, or CATALOG_ROOT
+    name - The upper case name of the entry
+  Returns the catalog position of the entry, or -1 if it is not found
+*/
+int catalogChild(unsigned int parent, char * name) {
+  for (int i=0; i<CATALOG_COUNT; i++) {
+    byte * entry = CATALOG + i * CATALOG_ENTRY;
+    if ((unsigned int)(entry[12] | (entry[13] << 8)) == parent && strncmp((char *)entry, name, 12) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/*
+  catalogFind()
+    Looks for a path in the catalog, without accessing the SD card
+    path - The path to look for
+  Returns the catalog position of the entry, or -1 if it is not found
+*/
+int catalogFind(char * path) {
+  char name[13];
+  int position = -1;
+  unsigned int parent = CATALOG_ROOT;
+  while ((path = nextComponent(path, name))) {
+    position = catalogChild(parent, name);
+    if (position < 0) return -1;
+    parent = position;
+  }
+  return position;
+}
+
+/*
+  catalogAdd()
+    Adds a path to the catalog, along with its missing parent folders
+    path - The path of the new entry
+    type - ENTRY_FILE or ENTRY_FOLDER
+    tag - The record type for a file
+  Returns the catalog position of the entry, or -1 if the catalog is not
+  loaded or is full. A build in progress is started again, as the folders
+  already walked may have changed
+*/
+int catalogAdd(char * path, int type, int tag) {
+  char name[13];
+  char next[13];
+  int position = -1;
+  unsigned int parent = CATALOG_ROOT;
+  if (CATALOG_COUNT < 0) {
+    if (CATALOG_BUILD != CATALOG_BUILD_IDLE) catalogStart();
+    return -1;
+  }
+  while ((path = nextComponent(path, name))) {
+    position = catalogChild(parent, name);
+    if (position < 0) {
+      if (CATALOG_COUNT >= CATALOG_MAX) {
+        //The vault outgrew the catalog, which is dropped so that it is
+        // not used while out of date
+        catalogOver();
+        return -1;
+      }
+      position = CATALOG_COUNT++;
+      byte * entry = CATALOG + position * CATALOG_ENTRY;
+      boolean last = (nextComponent(path, next) == NULL);
+      memset(entry, 0, CATALOG_ENTRY);
+      memcpy(entry, name, strlen(name));
+      entry[12] = parent & 0xFF;
+      entry[13] = parent >> 8;
+      entry[14] = last ? type : ENTRY_FOLDER;
+      entry[15] = last ? tag : 0;
+    }
+    parent = position;
+  }
+  return position;
+}
+
+/*
+  catalogView()
+    Fills CATALOG_VIEW with the entries of a folder, sorted by name
+    folder - The catalog position of the folder, or CATALOG_ROOT
+  Returns the number of entries of the folder
+*/
+int catalogView(unsigned int folder) {
+  int count = 0;
+  for (int i=0; i<CATALOG_COUNT; i++) {
+    byte * entry = CATALOG + i * CATALOG_ENTRY;
+    if ((unsigned int)(entry[12] | (entry[13] << 8)) != folder) continue;
+    //Insertion sort, the view is built once per folder
+    int j = count++;
+    while (j > 0 && strncmp((char *)CATALOG + CATALOG_VIEW[j-1] * CATALOG_ENTRY, (char *)entry, 12) > 0) {
+      CATALOG_VIEW[j] = CATALOG_VIEW[j-1];
+      j--;
+    }
+    CATALOG_VIEW[j] = i;
+  }
+  return count;
+}
+
+/*
+  sendDigests()
+    Sends the digest of a folder and of each of its entries, so that the
+    host can find the records changed since the last sync by going down
+    the folders whose digest changed
+    path - The path of the folder
+  Sends a \x01 on the serial line, the folder digest, then each entry as
+  type, name length, name and digest
+  Sends a \x00 if the path is not a folder
+  Returns nothing
+*/
+void sendDigests(char * path) {
+  byte digest[SHA256_HASH_LENGTH];
+  char name[13];
+  char child[PATH_LENGTH];
+  if (pathLookup(path) != ENTRY_FOLDER) {
+    reply('\x00');
+    return;
+  }
+  reply('\x01');
+  digestFolder(path, digest);
+  for (int i=0; i<SHA256_HASH_LENGTH; i++) reply(digest[i]);
+  
+  File directory = SD.open(path);
+  uint32_t key = pathHash(path);
+  uint32_t check = pathCheck(path);
+  int type;
+  for (int i = 0; directory && (type = readDirEntry(directory, key, check, i, name)) != ENTRY_END; i++) {
+    if (type == ENTRY_SKIP) continue;
+    joinPath(path, name, child);
+    digestEntry(child, type, digest);
+    reply(type);
+    reply(strlen(name));
+    replyText(name);
+    for (int j=0; j<SHA256_HASH_LENGTH; j++) reply(digest[j]);
+  }
+  if (directory) directory.close();
+  for (int slot=0; slot<RAW_SLOTS; slot++) {
+    if (!RAW_LIVE[slot] || RAW_PARENT[slot] != key || !rawPath(slot, child)) continue;
+    digestEntry(child, ENTRY_FILE, digest);
+    reply(ENTRY_FILE);
+    reply(strlen(baseName(child)));
+    replyText(baseName(child));
+    for (int j=0; j<SHA256_HASH_LENGTH; j++) reply(digest[j]);
+  }
+}
+
+/*
+  digestFolder()
+    Computes the digest of a folder from the digests of its entries. The
+    subtree is walked without recursion, as vaultWalk() does, with the
+    sums and the positions of the folders being walked on a stack. A
+    subfolder whose digest is kept in RAM is not read again
+    path - The path of the folder
+    digest - A SHA256_HASH_LENGTH bytes buffer receiving the digest
+  Returns nothing
+*/
+void digestFolder(char * path, byte * digest) {
+  if (digestKept(path, digest)) return;
+  
+  //A level of the subtree takes 2 characters of the path at least
+  byte sums[PATH_LENGTH / 2][SHA256_HASH_LENGTH];
+  int positions[PATH_LENGTH / 2];
+  char folder[PATH_LENGTH];
+  char name[13];
+  char child[PATH_LENGTH];
+  int depth = 0;
+  int position = 0;
+  strcpy(folder, path);
+  memset(sums[0], 0, SHA256_HASH_LENGTH);
+  while (true) {
+    File directory = SD.open(folder);
+    uint32_t key = pathHash(folder);
+    uint32_t check = pathCheck(folder);
+    int type = directory ? ENTRY_SKIP : ENTRY_END;
+    while (type != ENTRY_END) {
+      type = readDirEntry(directory, key, check, position++, name);
+      if (type == ENTRY_SKIP || type == ENTRY_END) continue;
+      joinPath(folder, name, child);
+      if (type == ENTRY_FOLDER && !digestKept(child, digest)) break;
+      digestEntry(child, type, digest);
+      for (int j=0; j<SHA256_HASH_LENGTH; j++) sums[depth][j] ^= digest[j];
+    }
+    if (directory) directory.close();
+    if (type == ENTRY_FOLDER && depth + 1 < PATH_LENGTH / 2) {
+      //Down in the subfolder, its sum is added to this one once done
+      positions[depth++] = position;
+      memset(sums[depth], 0, SHA256_HASH_LENGTH);
+      strcpy(folder, child);
+      position = 0;
+      continue;
+    }
+    
+    for (int slot=0; slot<RAW_SLOTS; slot++) {
+      if (!RAW_LIVE[slot] || RAW_PARENT[slot] != key || !rawPath(slot, child)) continue;
+      digestEntry(child, ENTRY_FILE, digest);
+      for (int j=0; j<SHA256_HASH_LENGTH; j++) sums[depth][j] ^= digest[j];
+    }
+    Sha256.init();
+    Sha256.write(sums[depth], SHA256_HASH_LENGTH);
+    memcpy(digest, Sha256.result(), SHA256_HASH_LENGTH);
+    DIGEST_KEY[DIGEST_NEXT] = key;
+    memcpy(DIGEST[DIGEST_NEXT], digest, SHA256_HASH_LENGTH);
+    DIGEST_NEXT = (DIGEST_NEXT + 1) % DIGEST_SLOTS;
+    if (depth == 0) return;
+    
+    //Back up in the parent, after the entry of the folder
+    digestName(folder, ENTRY_FOLDER, digest);
+    depth--;
+    for (int j=0; j<SHA256_HASH_LENGTH; j++) sums[depth][j] ^= digest[j];
+    strcpy(child, folder);
+    parentPath(child, folder);
+    position = positions[depth];
+  }
+}
+
+/*
+  digestKept()
+    Reads the digest of a folder from the digests kept in RAM
+    path - The path of the folder
+    digest - A SHA256_HASH_LENGTH bytes buffer receiving the digest
+  Returns true if the digest of the folder is kept
+*/
+boolean digestKept(char * path, byte * digest) {
+  uint32_t key = pathHash(path);
+  for (int slot=0; slot<DIGEST_SLOTS; slot++) {
+    if (DIGEST_KEY[slot] == key) {
+      memcpy(digest, DIGEST[slot], SHA256_HASH_LENGTH);
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+  digestEntry()
+    Computes the digest of a folder entry
+    path - The path of the entry
+    type - ENTRY_FILE or ENTRY_FOLDER
+    digest - A SHA256_HASH_LENGTH bytes buffer receiving the digest
+  Returns nothing
+*/
+void digestEntry(char * path, int type, byte * digest) {
+  if (type == ENTRY_FOLDER) {
+    digestFolder(path, digest);
+  } else {
+    if (!manifestHash(path, digest) && !recordHash(path, digest)) {
+      memset(digest, 0, SHA256_HASH_LENGTH);
+    }
+  }
+  digestName(path, type, digest);
+}
+
+/*
+  digestName()
+    Turns the digest of a record or of a folder into the digest of its
+    entry, which covers its type and its name
+    path - The path of the entry
+    type - ENTRY_FILE or ENTRY_FOLDER
+    digest - The SHA256_HASH_LENGTH bytes digest, replaced
+  Returns nothing
+*/
+void digestName(char * path, int type, byte * digest) {
+  char * name = baseName(path);
+  byte header[2] = {(byte)type, (byte)strlen(name)};
+  Sha256.init();
+  Sha256.write(header, 2);
+  Sha256.write((byte *)name, header[1]);
+  Sha256.write(digest, SHA256_HASH_LENGTH);
+  memcpy(digest, Sha256.result(), SHA256_HASH_LENGTH);
+}
+
+/*
+  digestForget()
+    Drops the digests of the folders containing a changed entry
+    path - The path of the changed entry
+  Returns nothing
+*/
+void digestForget(char * path) {
+  char child[PATH_LENGTH];
+  char folder[PATH_LENGTH];
+  strcpy(folder, path);
+  do {
+    strcpy(child, folder);
+    parentPath(child, folder);
+    uint32_t key = pathHash(folder);
+    for (int slot=0; slot<DIGEST_SLOTS; slot++) {
+      if (DIGEST_KEY[slot] == key) DIGEST_KEY[slot] = 0;
+    }
+  } while (strcmp(folder, "/"));
+}
+
+/*
+  manifestOpen()
+    Checks the root of the manifest once the device is unlocked, and
+    builds the manifest if there is none. A root that does not match is
+    reported, and the tree is not committed again until it is rebuilt by
+    the verify command. All the groups are then queued for the idle
+    verifier
+  Returns nothing
+*/
+void manifestOpen(void) {
+  MANIFEST_READY = false;
+  MANIFEST_BROKEN = false;
+  if (pathLookup(MANIFEST_NAME) != ENTRY_FILE) {
+    manifestBuild();
+  } else if (!manifestCheckRoot()) {
+    VERIFY_ERRORS++;
+    MANIFEST_BROKEN = true;
+  }
+  File file = SD.open(MANIFEST_NAME);
+  if (!file) return;
+  byte header[4];
+  if (file.read(header, 4) == 4 && header[0] == 'M') {
+    MANIFEST_COUNT = header[2] | (header[3] << 8);
+    MANIFEST_READY = true;
+  }
+  file.close();
+  memset(VERIFY_PENDING, 0xFF, sizeof(VERIFY_PENDING));
+  VERIFY_GROUP = 0;
+  VERIFY_LEAF = 0;
+}
+
+/*
+  manifestBuild()
+    Creates the manifest by hashing all the records of the vault
+  Returns nothing
+*/
+void manifestBuild(void) {
+  char folder[PATH_LENGTH] = "/";
+  char path[PATH_LENGTH];
+  byte leaf[MANIFEST_LEAF] = {0};
+  File file = SD.open(MANIFEST_NAME, FILE_REWRITE);
+  if (!file) return;
+  pathRemember(MANIFEST_NAME, ENTRY_FILE);
+  MANIFEST_BROKEN = false;
+  
+  for (int i=0; i<MANIFEST_HEADER; i+=SHA256_HASH_LENGTH) file.write(leaf, SHA256_HASH_LENGTH);
+  for (int g=0; g<MANIFEST_GROUPS; g++) file.write(leaf, SHA256_HASH_LENGTH);
+  for (int i=0; i<MANIFEST_LEAVES; i++) file.write(leaf, MANIFEST_LEAF);
+  MANIFEST_COUNT = 0;
+  int position = 0;
+  int type;
+  while ((type = vaultWalk(folder, &position, path)) != ENTRY_END) {
+    if (type == ENTRY_FILE && recordHash(path, leaf)) manifestPlace(file, path, leaf);
+  }
+  file.close();
+  memset(MANIFEST_STALE, 0xFF, sizeof(MANIFEST_STALE));
+  manifestCommit();
+}
+
+/*
+  manifestUpdate()
+    Updates the leaf of a record that has just been written. The group
+    hashes and the root are updated by manifestCommit()
+    path - The path of the record
+    record - The record contents
+    length - The length of the record
+  Returns nothing
+*/
+void manifestUpdate(char * path, byte * record, int length) {
+  byte hash[SHA256_HASH_LENGTH];
+  if (!MANIFEST_READY) return;
+  File file = SD.open(MANIFEST_NAME, FILE_WRITE);
+  if (!file) return;
+  Sha256.init();
+  Sha256.write(record, length);
+  memcpy(hash, Sha256.result(), SHA256_HASH_LENGTH);
+  int slot = manifestPlace(file, path, hash);
+  file.close();
+  //The new record is read back from the card by the idle verifier
+  if (slot >= 0) groupMark(VERIFY_PENDING, slot / MANIFEST_FANOUT, true);
+}
+
+/*
+  manifestPlace()
+    Writes the leaf of a record, in the leaf it already has or in the
+    first free one
+    file - The manifest file, opened for writing
+    path - The path of the record
+    hash - The SHA-256 of the record
+  Returns the leaf number, or -1 if the manifest is full
+*/
+int manifestPlace(File file, char * path, byte * hash) {
+  byte leaf[MANIFEST_LEAF];
+  int slot = manifestSlot(file, path, leaf);
+  if (slot < 0) return -1;
+  if (leaf[SHA256_HASH_LENGTH] == '\x00') MANIFEST_COUNT++;
+  memset(leaf, 0, sizeof(leaf));
+  memcpy(leaf, hash, SHA256_HASH_LENGTH);
+  strncpy((char *)leaf + SHA256_HASH_LENGTH, path, PATH_LENGTH - 1);
+  file.seek(manifestLeaf(slot));
+  file.write(leaf, sizeof(leaf));
+  groupMark(MANIFEST_STALE, slot / MANIFEST_FANOUT, true);
+  return slot;
+}
+
+/*
+  manifestSlot()
+    Looks for the leaf of a record. The leaves are probed in turn from the
+    path hash, until the record or a free leaf is found
+    file - The open manifest file
+    path - The path of the record
+    leaf - A MANIFEST_LEAF bytes buffer receiving the leaf, whose path is
+           empty if the record has no leaf yet
+  Returns the leaf number, or -1 if the record has no leaf and none is free
+*/
+int manifestSlot(File file, char * path, byte * leaf) {
+  int slot = pathHash(path) % MANIFEST_LEAVES;
+  for (int probe=0; probe<MANIFEST_LEAVES; probe++) {
+    if (!file.seek(manifestLeaf(slot)) || file.read(leaf, MANIFEST_LEAF) != MANIFEST_LEAF) return -1;
+    leaf[MANIFEST_LEAF-1] = '\x00';
+    if (leaf[SHA256_HASH_LENGTH] == '\x00' || pathSame((char *)leaf + SHA256_HASH_LENGTH, path)) {
+      return slot;
+    }
+    slot = (slot + 1) % MANIFEST_LEAVES;
+  }
+  return -1;
+}
+
+/*
+  manifestHash()
+    Reads the hash of a record from its manifest leaf, which avoids reading
+    the record when the leaf is up to date
+    path - The path of the record
+    hash - A SHA256_HASH_LENGTH bytes buffer receiving the hash
+  Returns true if the record has a leaf
+*/
+boolean manifestHash(char * path, byte * hash) {
+  byte leaf[MANIFEST_LEAF];
+  if (!MANIFEST_READY) return false;
+  File file = SD.open(MANIFEST_NAME);
+  if (!file) return false;
+  boolean found = manifestSlot(file, path, leaf) >= 0 && leaf[SHA256_HASH_LENGTH] != '\x00';
+  file.close();
+  if (found) memcpy(hash, leaf, SHA256_HASH_LENGTH);
+  return found;
+}
+
+/*
+  manifestCommit()
+    Recomputes the hashes of the groups with updated leaves, then the root.
+    A broken manifest is not committed, so that its root keeps failing
+  Returns nothing
+*/
+void manifestCommit(void) {
+  byte leaf[MANIFEST_LEAF];
+  if (MANIFEST_BROKEN) return;
+  boolean stale = false;
+  for (int i=0; i<(int)sizeof(MANIFEST_STALE); i++) stale = stale || MANIFEST_STALE[i];
+  if (!stale || pathLookup(MANIFEST_NAME) != ENTRY_FILE) return;
+  File file = SD.open(MANIFEST_NAME, FILE_WRITE);
+  if (!file) return;
+  
+  for (int g=0; g<MANIFEST_GROUPS; g++) {
+    if (!groupFlag(MANIFEST_STALE, g)) continue;
+    file.seek(manifestLeaf(g * MANIFEST_FANOUT));
+    Sha256.init();
+    for (int i=0; i<MANIFEST_FANOUT; i++) {
+      file.read(leaf, sizeof(leaf));
+      Sha256.write(leaf, sizeof(leaf));
+    }
+    file.seek(MANIFEST_HEADER + (uint32_t)g * SHA256_HASH_LENGTH);
+    file.write(Sha256.result(), SHA256_HASH_LENGTH);
+    groupMark(MANIFEST_STALE, g, false);
+  }
+  
+  byte header[4] = {'M', 0, (byte)(MANIFEST_COUNT & 0xFF), (byte)(MANIFEST_COUNT >> 8)};
+  memcpy(leaf, manifestRoot(file), SHA256_HASH_LENGTH);
+  file.seek(0);
+  file.write(header, 4);
+  file.write(leaf, SHA256_HASH_LENGTH);
+  file.close();
+}
+
 /*
-  Globals
+  manifestRoot()
+    Computes the root of the manifest from its group hashes
+    file - The open manifest file
+  Returns a pointer to the root, valid until the next hash computation
 */
-//INPUTS contains the pin numbers associated with the touch input buttons
-//  Order is UP, DOWN, BACK, ENTER
-int INPUTS[] = {16,15,17,18};
-//THRESHOLDS contains the threshold value to consider a touch button "pressed"
-int THRESHOLDS[] = {510,520,590,730};
+byte * manifestRoot(File file) {
+  byte hash[SHA256_HASH_LENGTH];
+  Sha256.initHmac(KEY, KEYBITS/8);
+  file.seek(MANIFEST_HEADER);
+  for (int g=0; g<MANIFEST_GROUPS; g++) {
+    file.read(hash, sizeof(hash));
+    Sha256.write(hash, sizeof(hash));
+  }
+  return Sha256.resultHmac();
+}
 
-//MENU_LINES contains the number of lines to be displayed in a single screen
-const int MENU_LINES = 10;
-//CURRENT_DIR contains the current directory on the SD card
-File CURRENT_DIR;
-//CURRENT_POSITION defines the current position in the menu
-int CURRENT_POSITION = 0;
+/*
+  manifestCheckRoot()
+    Checks the root of the manifest against its group hashes
+  Returns true if the root matches
+*/
+boolean manifestCheckRoot(void) {
+  byte root[SHA256_HASH_LENGTH];
+  File file = SD.open(MANIFEST_NAME);
+  if (!file) return false;
+  boolean valid = file.seek(4) && file.read(root, sizeof(root)) == sizeof(root) &&
+                  memcmp(root, manifestRoot(file), sizeof(root)) == 0;
+  file.close();
+  return valid;
+}
 
-//Initializes the LCD display
-Teensy3_ST7735 tft = Teensy3_ST7735(10, 9, 8);
+/*
+  manifestLeaf()
+    Gives the offset of a leaf in the manifest file
+    slot - The leaf number
+  Returns the offset of the leaf
+*/
+uint32_t manifestLeaf(int slot) {
+  return MANIFEST_HEADER + (uint32_t)MANIFEST_GROUPS * SHA256_HASH_LENGTH +
+         (uint32_t)slot * MANIFEST_LEAF;
+}
 
-//PASSWORD contains the lock screen password
-int PASSWORD[PASS_LENGTH] = {0};
+/*
+  groupFlag()
+    Reads the bit of a manifest group in MANIFEST_STALE or VERIFY_PENDING
+    flags - The bit array
+    group - The group number
+  Returns true if the bit is set
+*/
+boolean groupFlag(byte * flags, int group) {
+  return flags[group / 8] & (1 << (group % 8));
+}
 
-//KEY defines the AES key to use
-byte KEY[KEYBITS/8] = {0};
-//CLEARTEXT is the buffer used to store the unencrypted data
-byte CLEARTEXT[65] = {0};
-//CRYPTED is the buffer containing the encrypted data
-byte CRYPTED[65] = {0};
+/*
+  groupMark()
+    Sets or clears the bit of a manifest group in MANIFEST_STALE or
+    VERIFY_PENDING
+    flags - The bit array
+    group - The group number
+    value - The new value of the bit
+  Returns nothing
+*/
+void groupMark(byte * flags, int group, boolean value) {
+  if (value) {
+    flags[group / 8] |= (1 << (group % 8));
+  } else {
+    flags[group / 8] &= ~(1 << (group % 8));
+  }
+}
 
+/*
+  recordHash()
+    Computes the SHA-256 of a record as stored on the card, bypassing the
+    block cache so that what is checked is what the card returns
+    path - The path of the record
+    hash - A SHA256_HASH_LENGTH bytes buffer receiving the hash
+  Returns true if the record has been read
+*/
+boolean recordHash(char * path, byte * hash) {
+  byte block[BLOCK_SIZE];
+  Sha256.init();
+  int raw = rawFind(pathHash(path));
+  if (raw >= 0) {
+    if (!rawRead(raw, block)) return false;
+    Sha256.write(block + RAW_HEADER, min(block[2] | (block[3] << 8), RECORD_MAX));
+  } else {
+    File file = SD.open(path);
+    if (!file) return false;
+    int length;
+    while ((length = file.read(block, BLOCK_SIZE)) > 0) Sha256.write(block, length);
+    file.close();
+  }
+  memcpy(hash, Sha256.result(), SHA256_HASH_LENGTH);
+  return true;
+}
 
+/*
+  verifyRecord()
+    Checks a record against its manifest leaf
+    file - The open manifest file
+    slot - The leaf number
+    path - A PATH_LENGTH bytes buffer receiving the path of the record,
+           empty for a free leaf
+  Returns true if the record matches, or if the leaf is free
+*/
+boolean verifyRecord(File file, int slot, char * path) {
+  byte leaf[MANIFEST_LEAF];
+  byte hash[SHA256_HASH_LENGTH];
+  path[0] = '\x00';
+  if (!file.seek(manifestLeaf(slot)) || file.read(leaf, sizeof(leaf)) != sizeof(leaf)) return false;
+  if (leaf[SHA256_HASH_LENGTH] == '\x00') return true;
+  leaf[MANIFEST_LEAF-1] = '\x00';
+  strcpy(path, (char *)leaf + SHA256_HASH_LENGTH);
+  VERIFY_CHECKED++;
+  return recordHash(path, hash) && memcmp(leaf, hash, sizeof(hash)) == 0;
+}
 
 /*
-  serialCommands()
-    Manages the management serial communication
-  Returns nothing
+  verifyGroup()
+    Checks the hash of a manifest group against its leaves
+    file - The open manifest file
+    group - The group number
+  Returns true if the group hash matches
 */
-void serialCommands(void) {
-  //Manages the serial communication with the device
-  Serial.begin(9600);
-  
-  while (!Serial) {
-    ; // wait for serial port to connect.
-  }
-  
-  Serial.print("\x42\x42");
-  Serial.flush();
-  
-  while (1) {
-    //Wait for the first two data bytes
-    while (Serial.available() < 2) {
-      delay(1);
-    }
-    
-    int command = Serial.read();
-    int length = Serial.read();
-    
-    char data[255] = {0};
-    
-    for (int i=0; i<length; i++) {
-      data[i] = Serial.read();
-    }
-    
-    int path_len = 0;
-    char path[256] = {0};
-    int field_type = 0;
-    int field_len = 0;
-    int file_type = 0;
-    char field_value[256] = {0};
-        
-    switch(command) {
-      case 1:
-        //Create command
-        //Extract parameters
-        path_len = data[0];
-        for (int i=0; i< path_len; i++){
-          path[i] = data[i+1];
-        }
-        file_type = data[path_len+1];
-        field_type = data[path_len+2];
-        field_len = data[path_len+3];
-        if (field_len>64) field_len=64;
-        for (int i=0; i< field_len; i++){
-          CLEARTEXT[i] = data[i+path_len+4];
-        }
-        encrypt();
-        updateFile(path, file_type, field_type, 64, (char *)CRYPTED);
-        break;
-      case 3:
-        //Sync clock command
-        setTime((int)data);
-        break;
-      case 4:
-        listFolder(data);
-        break;
-      default:
-        break;
-    }
-    
+boolean verifyGroup(File file, int group) {
+  byte leaf[MANIFEST_LEAF];
+  file.seek(manifestLeaf(group * MANIFEST_FANOUT));
+  Sha256.init();
+  for (int i=0; i<MANIFEST_FANOUT; i++) {
+    if (file.read(leaf, sizeof(leaf)) != sizeof(leaf)) return false;
+    Sha256.write(leaf, sizeof(leaf));
   }
-  
-  Serial.end();
+  memcpy(leaf, Sha256.result(), SHA256_HASH_LENGTH);
+  file.seek(MANIFEST_HEADER + (uint32_t)group * SHA256_HASH_LENGTH);
+  if (file.read(leaf + SHA256_HASH_LENGTH, SHA256_HASH_LENGTH) != SHA256_HASH_LENGTH) return false;
+  return memcmp(leaf, leaf + SHA256_HASH_LENGTH, SHA256_HASH_LENGTH) == 0;
 }
 
 /*
-  makeDir()
-    Creates a folder on the SD card
-    path - The path for the folder
-    Sends a \x01 on the serial line if the creation is successfull
-    Sends a \x00 if it fails
+  verifyIdle()
+    Checks one leaf of the pending manifest groups against the card.
+    Called while waiting for the user or for a command, at most once
+    every VERIFY_INTERVAL ms
   Returns nothing
 */
-void makeDir(char * path){
-  if ( SD.exists(path)) {
-    Serial.write('\x00');
-  }else{
-    SD.mkdir(path);
-    Serial.write('\x01');
+void verifyIdle(void) {
+  char path[PATH_LENGTH];
+  if (!MANIFEST_READY || millis() - VERIFY_LAST < VERIFY_INTERVAL) return;
+  VERIFY_LAST = millis();
+  if (!groupFlag(VERIFY_PENDING, VERIFY_GROUP)) {
+    int g = 0;
+    while (g < MANIFEST_GROUPS && !groupFlag(VERIFY_PENDING, g)) g++;
+    if (g == MANIFEST_GROUPS) return;
+    VERIFY_GROUP = g;
+    VERIFY_LEAF = 0;
+  }
+  File file = SD.open(MANIFEST_NAME);
+  if (!file) return;
+  if (VERIFY_LEAF == 0 && !groupFlag(MANIFEST_STALE, VERIFY_GROUP) && !verifyGroup(file, VERIFY_GROUP)) {
+    VERIFY_ERRORS++;
+  }
+  if (!verifyRecord(file, VERIFY_GROUP * MANIFEST_FANOUT + VERIFY_LEAF, path)) VERIFY_ERRORS++;
+  file.close();
+  if (++VERIFY_LEAF == MANIFEST_FANOUT) {
+    groupMark(VERIFY_PENDING, VERIFY_GROUP, false);
+    VERIFY_LEAF = 0;
   }
 }
 
 /*
-  listFolder()
-    Lists the current folder and outputs the result in the serial
-    path - A string with the folder name
-  A \x01 is sent to the serial line at the end of the procedure.
+  verifyVault()
+    Checks the whole manifest tree and all the records against the card
+  Sends a \x01 on the serial line if everything matches, \x00 otherwise.
+  Then sends the number of records checked, the number of mismatches and
+  the time taken in ms, one per line, followed by the path of each
+  mismatched record. A mismatch in the tree itself, or a root that did
+  not match at unlock, is reported as the path of the manifest
+    rebuild - true to build the manifest again from the records first,
+              which accepts the current records of the vault
   Returns nothing
 */
-void listFolder(char * path) {
-  File folder = SD.open(path);
-  if (folder.isDirectory()) {
-    while( File content = folder.openNextFile()) {
-      if (content.isDirectory()) {
-        Serial.print(content.name());
-        Serial.println("/");
-      }else{
-        Serial.println(content.name());
+void verifyVault(boolean rebuild) {
+  char path[PATH_LENGTH];
+  uint32_t start = millis();
+  if (!MANIFEST_READY) {
+    reply('\x00');
+    return;
+  }
+  if (rebuild) manifestBuild();
+  uint32_t checked = VERIFY_CHECKED;
+  int errors = 0;
+  boolean tree = !MANIFEST_BROKEN && manifestCheckRoot();
+  File file = SD.open(MANIFEST_NAME);
+  //Groups holding mismatched records, checked again to send their paths
+  byte failed[MANIFEST_GROUPS / 8] = {0};
+  for (int g=0; g<MANIFEST_GROUPS; g++) {
+    tree = tree && verifyGroup(file, g);
+    for (int i=0; i<MANIFEST_FANOUT; i++) {
+      if (!verifyRecord(file, g * MANIFEST_FANOUT + i, path)) {
+        groupMark(failed, g, true);
+        errors++;
       }
-      content.close();
     }
-  }else{
-    Serial.write('\x00'); //Command NOK, folder is a file
   }
-  folder.close();
-}
-
-void updateFile(char * path, int file_type, int section_type, int data_len, char * data) {
-  int offset = 2;
-  File file;
-  if (SD.exists(path)) {
-    file  = SD.open(path, FILE_WRITE);
-  while (file.seek(offset)) {
-      int type = file.read();
-      if (section_type == type) {
-        break;
-      }else{
-        offset += (file.read()+2); // go to next header offset
-      }
+  if (!tree) errors++;
+  VERIFY_ERRORS += errors;
+  
+  reply(errors ? '\x00' : '\x01');
+  replyLine(VERIFY_CHECKED - checked);
+  replyLine((int32_t)errors);
+  replyLine((uint32_t)(millis() - start));
+  if (!tree) replyLine(MANIFEST_NAME);
+  checked = VERIFY_CHECKED;
+  for (int g=0; g<MANIFEST_GROUPS; g++) {
+    if (!groupFlag(failed, g)) continue;
+    for (int i=0; i<MANIFEST_FANOUT; i++) {
+      if (!verifyRecord(file, g * MANIFEST_FANOUT + i, path)) replyLine(path[0] ? path : MANIFEST_NAME);
     }
-  }else{
-    file = SD.open(path, FILE_WRITE);
-    file.write("\x42");
-    file.write((byte)file_type);
-  }
-  file.seek(offset);
-  file.write((byte)section_type);
-  file.write((byte)data_len);
-  file.write(data);
+  }
+  VERIFY_CHECKED = checked;
   file.close();
-  Serial.write('\x01');
 }
 
-void encrypt (void) {
-  AES aes;
+/*
+  encrypt()
+    Encrypts the first bytes of CLEARTEXT into CRYPTED
+    length - The number of cleartext bytes to encrypt. The cleartext
+             is padded with the zeroes of CLEARTEXT up to a full block
+  Returns the number of encrypted bytes
+*/
+int encrypt (int length) {
   byte iv [16] = {0} ;
+  int blocks = (length + N_BLOCK - 1) / N_BLOCK;
   
-  byte succ = aes.set_key (KEY, KEYBITS) ;
-  //succ = aes.encrypt (CLEARTEXT, CRYPTED) ;
-  succ = aes.cbc_encrypt (CLEARTEXT, CRYPTED, 4, iv) ;
+  CIPHER.cbc_encrypt (CLEARTEXT, CRYPTED, blocks, iv) ;
+  return blocks * N_BLOCK;
+}
+
+/*
+  encryptView()
+    Encrypts a field where it was received, without copying it to
+    CLEARTEXT first. Only the last partial block is copied, to be padded
+    with zeroes as encrypt() does
+    aes - An AES object with the key already set
+    field - The cleartext field
+    length - The length of the field, up to FIELD_MAX
+    output - A buffer receiving the encrypted field, which can be field
+  Returns the number of encrypted bytes
+*/
+int encryptView(AES * aes, byte * field, int length, byte * output) {
+  byte iv[N_BLOCK] = {0};
+  byte last[N_BLOCK] = {0};
+  int blocks = length / N_BLOCK;
+  int rest = length % N_BLOCK;
+  //The iv is updated by each block, so the last one continues the chain
+  if (blocks > 0) aes->cbc_encrypt(field, output, blocks, iv);
+  if (rest > 0) {
+    memcpy(last, field + blocks * N_BLOCK, rest);
+    aes->cbc_encrypt(last, output + blocks * N_BLOCK, 1, iv);
+    wipe(last, sizeof(last));
+    blocks++;
+  }
+  return blocks * N_BLOCK;
 }
 
-void decrypt (void) {
-  AES aes;
+/*
+  decrypt()
+    Decrypts the first bytes of CRYPTED into CLEARTEXT. The rest of
+    CLEARTEXT is cleared so that it is always null terminated
+    length - The number of encrypted bytes, a multiple of N_BLOCK
+  Returns nothing
+*/
+void decrypt (int length) {
   byte iv [16] = {0} ;
-  byte succ = aes.set_key (KEY, KEYBITS) ;
+  if (length > FIELD_MAX) length = FIELD_MAX;
+  int blocks = length / N_BLOCK;
   
-  //succ = aes.decrypt (CRYPTED, CLEARTEXT) ;
-  succ = aes.cbc_decrypt (CRYPTED, CLEARTEXT, 4, iv) ;
+  wipe(CLEARTEXT, sizeof(CLEARTEXT));
+  CIPHER.cbc_decrypt (CRYPTED, CLEARTEXT, blocks, iv) ;
+}
+
+/*
+  readSection()
+    Looks for a section in a record and decrypts it
+    record - The record contents
+    length - The length of the record
+    section_type - The type of the section to decrypt
+    value - A FIELD_MAX+1 bytes buffer receiving the decrypted section
+  Returns true if the section has been found
+*/
+boolean readSection(byte * record, int length, int section_type, char * value) {
+  int offset = 2;
+  while (offset + 1 < length) {
+    int type = record[offset];
+    int section_length = record[offset+1];
+    if (type == section_type) {
+      if (section_length > FIELD_MAX) section_length = FIELD_MAX;
+      if (offset + 2 + section_length > length) section_length = length - offset - 2;
+      memcpy(CRYPTED, record + offset + 2, section_length);
+      decrypt(section_length);
+      memcpy(value, CLEARTEXT, FIELD_MAX);
+      wipe(CLEARTEXT, sizeof(CLEARTEXT));
+      return true;
+    }
+    offset += (section_length+2); // go to next header offset
+  }
+  return false;
+}
+
+/*
+  recordSection()
+    Reads a record and decrypts one of its sections
+    path - The path of the record
+    section_type - The type of the section to decrypt
+    value - A FIELD_MAX+1 bytes buffer receiving the decrypted section
+  Returns true if the section has been found
+*/
+boolean recordSection(char * path, int section_type, char * value) {
+  byte record[RECORD_MAX];
+  int length = loadRecord(path, record);
+  return readSection(record, length, section_type, value);
+}
+
+/*
+  wipe()
+    Overwrites a buffer holding sensitive data
+    buffer - The buffer to clear
+    length - Size of the buffer
+  Returns nothing
+*/
+void wipe(byte * buffer, int length) {
+  for (int i=0; i<length; i++) {
+    buffer[i] = '\x00';
+  }
 }
 
 /*
@@ -258,14 +5510,15 @@ void calculateTOTP(char * secret, int length, char * resultCode) {
   otp &= 0x7FFFFFFF;
   otp %= 1000000;
 
-  sprintf(resultCode, "%06ld", otp);
+  sprintf(resultCode, "%06d", otp);
   
 }
 
 
 /*
   readButtons()
-  Waits for a user to touch a button
+  Waits for a user to touch a button, running the management commands
+  meanwhile
   Returns the presesed button code
 */
 int readButtons(){
@@ -276,13 +5529,54 @@ int readButtons(){
         return i;  //Return the key code
       }
     }
+    serialCommands();
   }
   delay(10);
 }
 
+/*
+  readButtonsHold()
+  Waits for a user to touch a button, telling short and long presses apart
+  The management commands are run, the catalog is built, the records
+  around the cursor are prefetched and the vault is checked while waiting
+  Returns the pressed button code, with ACTION_LONG set for a long press,
+  or ACTION_REDRAW once the commands changed the vault
+*/
+int readButtonsHold(){
+  while (1) {
+    //The touch value bounces around the threshold on release, so the
+    // buttons are ignored for a while, without blocking the commands
+    for (int i=0;i<4 && millis() - BUTTON_RELEASED > DEBOUNCE;i++){  //Test each input
+      if (touchRead(INPUTS[i]) > THRESHOLDS[i] ){  //Does the input value go over the threshold ?
+        uint32_t start = millis();
+        int action = i;
+        //Wait for the release so that a long press only acts once
+        while (touchRead(INPUTS[i]) > THRESHOLDS[i]) {
+          if (millis() - start > LONG_PRESS) action = i | ACTION_LONG;
+          delay(10);
+        }
+        BUTTON_RELEASED = millis();
+        return action;  //Return the key code
+      }
+    }
+    //Use the idle time to run the management commands, to decrypt the
+    // entries around the cursor, and to check the vault
+    if (serialCommands()) continue;
+    //Once the commands are idle, so that a sync is not slowed down
+    if (VAULT_CHANGED) {
+      VAULT_CHANGED = false;
+      return ACTION_REDRAW;
+    }
+    if (catalogStep()) continue;
+    prefetchIdle();
+    verifyIdle();
+  }
+}
+
 /*
   nonblock_readButtons()
-  Returns a read button (if any) or -1
+  Returns a read button (if any) or -1, running a management command if no
+  button is touched
   Returns the presesed button code
 */
 int nonblock_readButtons(){
@@ -292,38 +5586,30 @@ int nonblock_readButtons(){
       return i;  //Return the key code
     }
   }
+  serialCommands();
   return(-1);
 }
 
 
 /*
   drawFolderContents()
-  Displays the contents of a folder using pages.
+  Displays the contents of the current folder using pages.
   Size of the page is defined by the MENU_LINES constant
-    folder is a File object pointing to a folder
     selected_entry contains the position of the selected entry
   Returns nothing
 */
-int drawFolderContents(File folder, int selected_entry){
+int drawFolderContents(int selected_entry){
+  char name[13];
   //Get number of entries in the folder
-  int number_files = 0;
-  folder.rewindDirectory();
-  while(File tmp = folder.openNextFile()) {
-    //We have to close each file as openNextFile() creates a handle
-    // to the new file, resulting in a memory leak
-    tmp.close();
-    number_files++;
-  }
-  
-  folder.rewindDirectory();
+  int number_files = listCount();
   
   //if selected index is out of bounds, return to the first or last one
   if (selected_entry >= number_files) selected_entry = 0;
   if (selected_entry < 0) selected_entry = number_files -1;
   
   //Select the page to display
-  unsigned int min_entry = 0;
-  unsigned int max_entry = 0;
+  int min_entry = 0;
+  int max_entry = 0;
   if (number_files < MENU_LINES) {
     //Display all folder contents
     min_entry = 0;
@@ -335,27 +5621,16 @@ int drawFolderContents(File folder, int selected_entry){
     if (max_entry > number_files) max_entry = number_files;
   }
   
-  //list the folder until we get to the entries to display
-  for (int i = 0; i < min_entry; i++) {
-    File tmp = folder.openNextFile();
-    //We have to close each file as openNextFile() creates a handle
-    // to the new file, resulting in a memory leak
-    tmp.close();
-  }
-  
   //display the entries
   for (int i = min_entry ; i < max_entry ; i++) {
-    File entry = folder.openNextFile();
+    if (listEntry(i, name) == ENTRY_END) break;
     if (i == selected_entry) {
       tft.setTextColor(ST7735_BLACK, ST7735_BLUE);
-      tft.println(entry.name());
+      tft.println(name);
       tft.setTextColor(ST7735_BLUE);
     } else {
-      tft.println(entry.name());
+      tft.println(name);
     }
-    //We have to close each file as openNextFile() creates a handle
-    // to the new file, resulting in a memory leak
-    entry.close();
   }
   return selected_entry;
 }
@@ -363,19 +5638,16 @@ int drawFolderContents(File folder, int selected_entry){
 
 /*
   getEntry()
-    folder is a File object pointing to a folder
-    selected_entry contains the position of the selected entry
-  Returns a File object containing the selected entry
+    selected_entry contains the position of the selected entry in the
+    current folder
+    path is a PATH_LENGTH bytes buffer receiving the path of the entry
+  Returns ENTRY_FILE or ENTRY_FOLDER, or ENTRY_END if there is no such entry
 */
-File getEntry(File folder, int selected_entry) {
-  folder.rewindDirectory();
-  for (int i = 0; i < selected_entry; i++) {
-    File tmp = folder.openNextFile();
-    //We have to close each file as openNextFile() creates a handle
-    // to the new file, resulting in a memory leak
-    tmp.close();
-  }
-  return folder.openNextFile();
+int getEntry(int selected_entry, char * path) {
+  char name[13];
+  int type = listEntry(selected_entry, name);
+  if (type != ENTRY_END) joinPath(CURRENT_PATH, name, path);
+  return type;
 }
 
 
@@ -385,7 +5657,7 @@ File getEntry(File folder, int selected_entry) {
     text is the text that appears below the title
   Returns nothing
 */
-void drawHeader(char * text) {
+void drawHeader(const char * text) {
   tft.fillScreen(ST7735_BLACK);
   tft.setCursor(0, 0);
   tft.setTextSize(2);
@@ -399,13 +5671,13 @@ void drawHeader(char * text) {
 }
 
 /*
-  drawUserPass()
-  Displays the user's username and password and waits for user input
+  drawAccount()
+  Draws the account details screen
     username contains the username
-    password - guess what ?
+    password contains the password, or a mask if it is hidden
   Returns nothing
 */
-void drawUserPass(char * username, char * password) {
+void drawAccount(char * username, const char * password) {
   drawHeader("Account details");
   tft.println();
   tft.println("Username :");
@@ -414,18 +5686,41 @@ void drawUserPass(char * username, char * password) {
   tft.println("Password :");
   tft.println(password);
   tft.println();
+  tft.println("Press Down to show the password");
   tft.println("Press Enter to type the password");
+}
+
+/*
+  drawUserPass()
+  Displays the user's username and waits for user input
+  The record is only read when the password is shown or typed, and the
+  password is wiped from memory right after
+    path contains the path of the record the password is read from
+    username contains the username
+  Returns nothing
+*/
+void drawUserPass(char * path, char * username) {
+  char password[FIELD_MAX+1] = {0};
+  drawAccount(username, "********");
   
   while (true) {
     switch(readButtons()){
       case ACTION_UP:
+        drawAccount(username, "********");
         break;
       case ACTION_DOWN:
+        recordSection(path, 0x02, password);
+        drawAccount(username, password);
+        wipe((byte *)password, sizeof(password));
+        passwordUsed();
         break;
       case ACTION_BACK:
         return;
       case ACTION_ENTER:
+        recordSection(path, 0x02, password);
         Keyboard.print(password);
+        wipe((byte *)password, sizeof(password));
+        passwordUsed();
         break;
     }
   }
@@ -486,73 +5781,303 @@ void doTOTP(char * secret) {
 /*
   doFile()
   Performs stuff when a file is selected in the menu
-    file is the pointer to the file
+    path is the path of the file
   Returns nothing
 */
-void doFile(File file) {
+void doFile(char * path) {
+  char field[FIELD_MAX+1] = {0};
+  //Only the username is needed for the first screen, the password is
+  // read on demand by drawUserPass(). A prefetched record is opened
+  // without reading the card
+  int type = prefetchLookup(path, field) ? 0x01 : recordField(path, field);
+  if (type) mruTouch(path);
+  switch (type) {
+    // User/password file
+    case 0x01:
+      drawUserPass(path, field);
+      break;
+    //TOTP file
+    case 0x02:
+      doTOTP(field);
+      break;
+  }
+  wipe((byte *)field, sizeof(field));
+}
+
+/*
+  recordField()
+    Reads the field shown by the first screen of a record. The record is
+    read in its own stack frame, which is gone while the screen runs the
+    management commands
+    path - The path of the record
+    field - A FIELD_MAX+1 bytes buffer receiving the username of a
+            user/password record, or the secret of a TOTP record
+  Returns the record type, 0 if the file is not a record
+*/
+int recordField(char * path, char * field) {
+  byte record[RECORD_MAX];
+  int length = loadRecord(path, record);
   //check for file header
-  if (file.read() == 0x42) {
-    char username[65] = {0};
-    char password[65] = {0};
-    switch (file.read()) {
-      // User/password file
-      case 0x01:
-        {
-        while(file.available()) {
-          int section_type = file.read();
-          int section_length = file.read();
-          for (int i=0; i<section_length; i++) {
-            CRYPTED[i] = file.read();
-          }
-          decrypt();
-          switch(section_type){
-            case 0x01:
-              for (int i=0; i<64; i++) {
-                username[i] = CLEARTEXT[i];
-                CLEARTEXT[i] = '\x00';
-              }
-              break;
-            case 0x02:
-              for (int i=0; i<64; i++) {
-                password[i] = CLEARTEXT[i];
-                CLEARTEXT[i] = '\x00';
-              }
-              break;
-          }
-        }
-        drawUserPass(username, password);
-        for(int i=0; i<65; i++) {
-          username[i] = '\x00';
-          password[i] = '\x00';
-        }
+  if (length < 2 || record[0] != 0x42) return 0;
+  int type = record[1];
+  if (type == 0x01) {
+    readSection(record, length, 0x01, field);
+  } else if (type == 0x02) {
+    //The secret is the last section
+    int offset = 2;
+    while (offset + 1 < length) {
+      int section_length = record[offset+1];
+      if (offset + 2 + section_length > length) break;
+      memcpy(CRYPTED, record + offset + 2, min(section_length, FIELD_MAX));
+      decrypt(section_length);
+      offset += (section_length+2);
+    }
+    //The commands run by the TOTP screen use CLEARTEXT
+    memcpy(field, CLEARTEXT, FIELD_MAX+1);
+    wipe(CLEARTEXT, sizeof(CLEARTEXT));
+  }
+  wipe(record, sizeof(record));
+  return type;
+}
+
+/*
+  drawRecent()
+  Displays the favourite and recently used records, favourites first, so
+  that they can be opened without browsing the folders
+  Long press Enter to add or remove a favourite, Back to browse the folders
+  Returns nothing
+*/
+void drawRecent(void) {
+  char path[PATH_LENGTH];
+  int order[MRU_SLOTS];
+  int selected = 0;
+  while (true) {
+    int count = mruList(order);
+    if (count == 0) return;
+    if (selected >= count) selected = 0;
+    if (selected < 0) selected = count - 1;
+    
+    drawHeader("Recent");
+    for (int i=0; i<count; i++) {
+      int flags = mruRead(order[i], path);
+      if (i == selected) tft.setTextColor(ST7735_BLACK, ST7735_BLUE);
+      tft.print((flags & MRU_FAVOURITE) ? '*' : ' ');
+      tft.println(baseName(path));
+      tft.setTextColor(ST7735_BLUE);
+    }
+    
+    mruRead(order[selected], path);
+    switch (readButtonsHold()) {
+      case ACTION_UP:
+        selected--;
         break;
-        }
-      case 0x02:
-        {
-        //TOTP file
-        char seed[65] = {0};
-        while(file.available()) {
-          int section_type = file.read();
-          int section_length = file.read();
-          for (int i=0; i<section_length; i++) {
-            CRYPTED[i] = file.read();
-          }
-          decrypt();
-        }
-        doTOTP((char*)CLEARTEXT);
-        for (int i=0; i<64; i++) {
-          CLEARTEXT[i] = '\x00';
-        }
+      case ACTION_DOWN:
+        selected++;
         break;
-        }
-      default:
+      case ACTION_BACK:
         return;
+      case ACTION_ENTER:
+        doFile(path);
+        //The opened record is now the most recent one
+        selected = 0;
+        break;
+      case ACTION_ENTER | ACTION_LONG:
+        mruFavourite(path);
+        break;
+      case ACTION_REDRAW:
+        openFolder(CURRENT_PATH);
+        break;
     }
-  } else {
-    return;
   }
 }
 
+/*
+  passwordUsed()
+    Records the time to the first password used since the last unlock
+  Returns nothing
+*/
+void passwordUsed(void) {
+  if (UNLOCK_TIME == 0) return;
+  TIME_TO_PASSWORD = millis() - UNLOCK_TIME;
+  UNLOCK_TIME = 0;
+}
+
+/*
+  mruRead()
+    Reads a recently used records entry from the EEPROM
+    slot - The entry number
+    path - A PATH_LENGTH bytes buffer receiving the path of the record
+  Returns the flags of the entry, 0 if the entry is not used or invalid
+*/
+int mruRead(int slot, char * path) {
+  int address = MRU_OFFSET + slot * MRU_ENTRY;
+  int flags = EEPROM.read(address);
+  byte hash[4];
+  if (flags == 0xFF || !(flags & MRU_USED)) return 0;
+  for (int i=0; i<PATH_LENGTH; i++) path[i] = EEPROM.read(address + 8 + i);
+  path[PATH_LENGTH-1] = '\x00';
+  for (int i=0; i<4; i++) hash[i] = EEPROM.read(address + 4 + i);
+  if (readLong(hash) != pathHash(path)) return 0;
+  return flags;
+}
+
+/*
+  mruStamp()
+    Reads the last use stamp of a recently used records entry
+    slot - The entry number
+  Returns the stamp
+*/
+unsigned int mruStamp(int slot) {
+  int address = MRU_OFFSET + slot * MRU_ENTRY;
+  return EEPROM.read(address + 2) | (EEPROM.read(address + 3) << 8);
+}
+
+/*
+  mruFind()
+    Looks for a record in the recently used records
+    path - The path of the record
+  Returns the entry number, or -1 if the record is not in the list
+*/
+int mruFind(char * path) {
+  char entry[PATH_LENGTH];
+  uint32_t key = pathHash(path);
+  for (int slot=0; slot<MRU_SLOTS; slot++) {
+    if (mruRead(slot, entry) && pathHash(entry) == key) return slot;
+  }
+  return -1;
+}
+
+/*
+  mruTouch()
+    Makes a record the most recently used one. The EEPROM is only written
+    when the order changes, and only the bytes that differ are written
+    path - The path of the record
+  Returns the entry number of the record, or -1 if all the entries are
+  favourites
+*/
+int mruTouch(char * path) {
+  char entry[PATH_LENGTH];
+  int flags[MRU_SLOTS];
+  uint32_t key = pathHash(path);
+  unsigned int newest = 0;
+  int slot = -1;
+  for (int i=0; i<MRU_SLOTS; i++) {
+    flags[i] = mruRead(i, entry);
+    if (!flags[i]) continue;
+    newest = max(newest, mruStamp(i));
+    if (pathHash(entry) == key) slot = i;
+  }
+  if (slot >= 0 && mruStamp(slot) == newest) return slot;
+  
+  if (slot < 0) {
+    //Use a free entry, or the least recently used non favourite
+    for (int i=0; i<MRU_SLOTS; i++) {
+      if (!flags[i]) {
+        slot = i;
+        break;
+      }
+      if (!(flags[i] & MRU_FAVOURITE) && (slot < 0 || mruStamp(i) < mruStamp(slot))) slot = i;
+    }
+    if (slot < 0) return -1;
+    int address = MRU_OFFSET + slot * MRU_ENTRY;
+    byte hash[4];
+    writeLong(hash, key);
+    for (int i=0; i<4; i++) eepromUpdate(address + 4 + i, hash[i]);
+    int length = strlen(path);
+    for (int i=0; i<PATH_LENGTH; i++) eepromUpdate(address + 8 + i, (i < length) ? path[i] : 0);
+    eepromUpdate(address, MRU_USED);
+  }
+  if (newest == 0xFFFF) newest = mruRenumber();
+  int address = MRU_OFFSET + slot * MRU_ENTRY;
+  eepromUpdate(address + 2, (newest + 1) & 0xFF);
+  eepromUpdate(address + 3, (newest + 1) >> 8);
+  return slot;
+}
+
+/*
+  mruRenumber()
+    Renumbers the last use stamps from 1, keeping their order, when the
+    stamps reach their maximum value
+  Returns the highest new stamp
+*/
+unsigned int mruRenumber(void) {
+  char entry[PATH_LENGTH];
+  int order[MRU_SLOTS];
+  int count = 0;
+  //Sort the used entries by stamp, oldest first
+  for (int slot=0; slot<MRU_SLOTS; slot++) {
+    if (!mruRead(slot, entry)) continue;
+    int i = count++;
+    while (i > 0 && mruStamp(order[i-1]) > mruStamp(slot)) {
+      order[i] = order[i-1];
+      i--;
+    }
+    order[i] = slot;
+  }
+  for (int i=0; i<count; i++) {
+    int address = MRU_OFFSET + order[i] * MRU_ENTRY;
+    eepromUpdate(address + 2, (i + 1) & 0xFF);
+    eepromUpdate(address + 3, (i + 1) >> 8);
+  }
+  return count;
+}
+
+/*
+  mruFavourite()
+    Adds a record to the favourites, or removes it if it is one
+    path - The path of the record
+  Returns true if the record is now a favourite
+*/
+boolean mruFavourite(char * path) {
+  char entry[PATH_LENGTH];
+  int slot = mruFind(path);
+  if (slot < 0) slot = mruTouch(path);
+  if (slot < 0) return false;
+  int flags = mruRead(slot, entry) ^ MRU_FAVOURITE;
+  eepromUpdate(MRU_OFFSET + slot * MRU_ENTRY, flags);
+  return (flags & MRU_FAVOURITE);
+}
+
+/*
+  mruList()
+    Lists the recently used records, favourites first, then from the most
+    recently used
+    order - A MRU_SLOTS entries array receiving the entry numbers
+  Returns the number of entries
+*/
+int mruList(int * order) {
+  char entry[PATH_LENGTH];
+  long rank[MRU_SLOTS];
+  int count = 0;
+  for (int slot=0; slot<MRU_SLOTS; slot++) {
+    int flags = mruRead(slot, entry);
+    if (!flags) continue;
+    //Favourites are ranked above all the stamps
+    long value = mruStamp(slot) + ((flags & MRU_FAVOURITE) ? 0x10000L : 0);
+    int i = count++;
+    while (i > 0 && rank[i-1] < value) {
+      order[i] = order[i-1];
+      rank[i] = rank[i-1];
+      i--;
+    }
+    order[i] = slot;
+    rank[i] = value;
+  }
+  return count;
+}
+
+/*
+  eepromUpdate()
+    Writes a byte in the EEPROM only if it has changed, to save the
+    EEPROM write cycles
+    address - The EEPROM address
+    value - The new value
+  Returns nothing
+*/
+void eepromUpdate(int address, byte value) {
+  if (EEPROM.read(address) != value) EEPROM.write(address, value);
+}
+
 /*
   lockScreen()
   Displays the lock screen. Can only be bypassed once the correct button sequence has been activated
@@ -563,10 +6088,18 @@ void doFile(File file) {
 void lockScreen() {
   int attempts = EEPROM.read(0);
   
-  //Clear AES key from memory
+  //The queued commands need the key, and no command runs while locked
+  commandStop();
+  
+  //Clear AES key and decrypted catalog from memory
   for (int i=0; i<(KEYBITS/8); i++) {
     KEY[i] = '\x00';
   }
+  CIPHER.clean();
+  catalogWipe();
+  prefetchWipe();
+  //The manifest root is keyed with the AES key
+  MANIFEST_READY = false;
 
   while (attempts < MAX_TRIES) {
     attempts++;
@@ -596,6 +6129,15 @@ void lockScreen() {
       for (int i=0; i<(KEYBITS/8); i++) {
         KEY[i] = EEPROM.read(i+1);
       }
+      CIPHER.set_key(KEY, KEYBITS);
+      catalogLoad();
+      manifestOpen();
+      compactOpen();
+      //Finish any checkpoint interrupted by a power loss
+      journalCheckpoint();
+      openFolder(CURRENT_PATH);
+      SHOW_RECENT = true;
+      UNLOCK_TIME = millis();
       
       return;
     } else {
@@ -630,28 +6172,25 @@ void setup()  {
   tft.fillScreen(ST7735_BLACK);
 
   //Init SD card
-  if (!SD.begin(6)) {
+  if (!SD.begin(SD_CHIP_SELECT)) {
     drawHeader("SD init failed");
     return;
   }
-  CURRENT_DIR = SD.open("/");
+  rawMount();
+  openFolder("/");
   
   //Init EEPROM
-  if (EEPROM.read(0) == 255 == 255) {
+  if (EEPROM.read(0) == 255) {
     EEPROM.write(0,0);
   }
   
-  //Init is done. If the back button is pressed during bootup, charge the command mode.
+  //Init is done. If the back button is pressed during bootup, start in command mode.
+  //It can also be started and stopped from the menu
   if (nonblock_readButtons() == ACTION_BACK) {
     delay(1000);
     if (nonblock_readButtons() == ACTION_BACK) {
       lockScreen();
-      drawHeader("Command mode");
-      serialCommands();
-      //Serial mode "bypass protection"
-      while(true){
-        delay(1000);
-      }
+      commandStart();
     }else{
       lockScreen();
     }
@@ -666,31 +6205,68 @@ void setup()  {
   MAIN LOOP
 */
 void loop() {
-  drawHeader(CURRENT_DIR.name());
-  CURRENT_POSITION = drawFolderContents(CURRENT_DIR, CURRENT_POSITION);
-  switch(readButtons()){
+  if (SHOW_RECENT) {
+    SHOW_RECENT = false;
+    drawRecent();
+  }
+  if (COMMAND_MODE) {
+    char header[20];
+    snprintf(header, sizeof(header), "%s [cmd]", CURRENT_DIR.name());
+    drawHeader(header);
+  } else {
+    drawHeader(CURRENT_DIR.name());
+  }
+  CURRENT_POSITION = drawFolderContents(CURRENT_POSITION);
+  switch(readButtonsHold()){
     case ACTION_UP:
       CURRENT_POSITION--;
       break;
     case ACTION_DOWN:
       CURRENT_POSITION++;
       break;
+    case ACTION_UP | ACTION_LONG:
+      CURRENT_POSITION = jumpLetter(CURRENT_POSITION, -1);
+      break;
+    case ACTION_DOWN | ACTION_LONG:
+      CURRENT_POSITION = jumpLetter(CURRENT_POSITION, 1);
+      break;
     case ACTION_BACK:
-      if (CURRENT_DIR.name() == "/") {
+      if (strcmp(CURRENT_PATH, "/") == 0) {
         lockScreen();
       }else{
-        CURRENT_DIR = SD.open("/");
+        openFolder("/");
       }
       break;
-    case ACTION_ENTER:
-      File active_entry = getEntry(CURRENT_DIR, CURRENT_POSITION);
-      if (active_entry.isDirectory()) {
-        CURRENT_DIR.close();
-        CURRENT_DIR = active_entry;
+    case ACTION_BACK | ACTION_LONG:
+      if (COMMAND_MODE) {
+        commandStop();
+        drawHeader("Command mode off");
       } else {
-        doFile(active_entry);
+        commandStart();
+        drawHeader("Command mode on");
+      }
+      delay(700);
+      break;
+    case ACTION_ENTER:
+      char path[PATH_LENGTH];
+      switch (getEntry(CURRENT_POSITION, path)) {
+        case ENTRY_FOLDER:
+          openFolder(path);
+          break;
+        case ENTRY_FILE:
+          doFile(path);
+          break;
       }
       break;
+    case ACTION_ENTER | ACTION_LONG:
+      if (getEntry(CURRENT_POSITION, path) == ENTRY_FILE) {
+        drawHeader(mruFavourite(path) ? "Added to favourites" : "Removed from favourites");
+        delay(700);
+      }
+      break;
+    case ACTION_REDRAW:
+      //The listing is read again from the changed vault
+      openFolder(CURRENT_PATH);
+      break;
   }
 }
-